@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Helper of bench/run.sh, see usage below.
+
+static const char usage[] =
+    "usage: bench gen DIR COUNT [-l LENGTH] [-c CHAINS] [-y CYCLES] "
+    "[-x DELETIONS] [-k GROUP] [-s SEED]\n"
+    "       bench time COMMAND [ARG]...\n"
+    "\n"
+    "gen creates COUNT empty files in DIR, whose names are LENGTH characters "
+    "long\n(default 16, at least 8). Of the files, CHAINS percent are "
+    "renamed in chains of\nGROUP files (default 4) onto each other's names, "
+    "CYCLES percent in cycles of\nGROUP files, DELETIONS percent are marked "
+    "for deletion and the others get new\nnames. It writes the new names in "
+    "listing order to DIR.names (for an editor\nthat copies them over its "
+    "file) and OLD<TAB>NEW lines to DIR.map (for --from),\nthen prints how "
+    "many files remain after renaming.\n"
+    "\n"
+    "time runs COMMAND and prints its wall time in seconds and its peak RSS "
+    "in KiB.\n";
+
+// ===== GENERATOR =============================================================
+
+typedef struct {
+    size_t count;
+    int length;
+    int chains;    // percent of files
+    int cycles;    // percent of files
+    int deletions; // percent of files
+    size_t group;
+    uint64_t seed;
+} GenOptions;
+
+static inline uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Writes the name of file i to buffer. Names start with i in base 36 at a
+// fixed width, so they are unique and already in listing (strcmp) order, and
+// are padded to their length with letters derived from i.
+void name_write(char *buffer, size_t i, int length) {
+    static const char digits[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+    size_t n = i;
+    for (int k = 5; k >= 0; k--) {
+        buffer[k] = digits[n % 36];
+        n /= 36;
+    }
+    uint64_t state = i;
+    for (int k = 6; k < length; k++) {
+        buffer[k] = 'a' + splitmix64(&state) % 26;
+    }
+    buffer[length] = '\0';
+}
+
+// appends one "OLD<TAB>NEW" line to map and NEW to names
+void entry_write(FILE *names, FILE *map, const char *old_name,
+                 const char *new_name) {
+    fprintf(names, "%s\n", new_name);
+    fprintf(map, "%s\t%s\n", old_name, new_name);
+}
+
+int generate(const char *dir, const GenOptions *options) {
+    if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        perror("mkdir");
+        return EXIT_FAILURE;
+    }
+    int dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        perror("open");
+        return EXIT_FAILURE;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.names", dir);
+    FILE *names = fopen(path, "w");
+    snprintf(path, sizeof(path), "%s.map", dir);
+    FILE *map = fopen(path, "w");
+    if (!names || !map) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+    static char names_buffer[1 << 20], map_buffer[1 << 20];
+    setvbuf(names, names_buffer, _IOFBF, sizeof(names_buffer));
+    setvbuf(map, map_buffer, _IOFBF, sizeof(map_buffer));
+
+    char old_name[256], new_name[300];
+    for (size_t i = 0; i < options->count; i++) {
+        name_write(old_name, i, options->length);
+        if (mknodat(dir_fd, old_name, S_IFREG | 0644, 0) != 0) {
+            perror("mknodat");
+            return EXIT_FAILURE;
+        }
+    }
+
+    // files are assigned to chains, cycles, deletions and plain renames in
+    // groups, chosen at random with the requested shares
+    uint64_t state = options->seed;
+    size_t remaining = options->count;
+    for (size_t i = 0; i < options->count;) {
+        int roll = splitmix64(&state) % 100;
+        size_t group = options->group;
+        if (group > options->count - i) { group = options->count - i; }
+
+        if (roll < options->chains) {
+            // each file takes the name of the next, the last a new one
+            for (size_t k = 0; k < group; k++) {
+                name_write(old_name, i + k, options->length);
+                if (k + 1 == group) {
+                    snprintf(new_name, sizeof(new_name), "%s.new", old_name);
+                } else {
+                    name_write(new_name, i + k + 1, options->length);
+                }
+                entry_write(names, map, old_name, new_name);
+            }
+            i += group;
+        } else if (roll < options->chains + options->cycles) {
+            // each file takes the name of the next, the last the first's
+            for (size_t k = 0; k < group; k++) {
+                name_write(old_name, i + k, options->length);
+                name_write(new_name, i + (k + 1) % group, options->length);
+                entry_write(names, map, old_name, new_name);
+            }
+            i += group;
+        } else if (roll < options->chains + options->cycles +
+                              options->deletions) {
+            name_write(old_name, i, options->length);
+            snprintf(new_name, sizeof(new_name), "#%s", old_name);
+            entry_write(names, map, old_name, new_name);
+            remaining--;
+            i++;
+        } else {
+            name_write(old_name, i, options->length);
+            snprintf(new_name, sizeof(new_name), "%s.new", old_name);
+            entry_write(names, map, old_name, new_name);
+            i++;
+        }
+    }
+
+    if (fclose(names) != 0 || fclose(map) != 0) {
+        perror("fclose");
+        return EXIT_FAILURE;
+    }
+    close(dir_fd);
+    printf("%zu\n", remaining);
+    return EXIT_SUCCESS;
+}
+
+// ===== TIMING ================================================================
+
+int run_timed(char *argv[]) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return EXIT_FAILURE;
+    }
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        perror("execvp");
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double wall = (double)(end.tv_sec - start.tv_sec) +
+                  (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%.3f %ld\n", wall, usage.ru_maxrss);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+// ===== MAIN ==================================================================
+
+// returns the value of a numeric option, or exits on an invalid one
+long option_number(const char *arg, long min, long max) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*end != '\0' || value < min || value > max) {
+        fprintf(stderr, "Error: Invalid number '%s'.\n", arg);
+        exit(EXIT_FAILURE);
+    }
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "time") == 0) {
+        return run_timed(argv + 2);
+    }
+    if (argc < 4 || strcmp(argv[1], "gen") != 0) {
+        fputs(usage, stderr);
+        return EXIT_FAILURE;
+    }
+
+    GenOptions options = {.count = option_number(argv[3], 0, LONG_MAX),
+                          .length = 16,
+                          .chains = 0,
+                          .cycles = 0,
+                          .deletions = 0,
+                          .group = 4,
+                          .seed = 1};
+    optind = 4;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:c:y:x:k:s:")) != -1) {
+        switch (opt) {
+        case 'l':
+            options.length = option_number(optarg, 8, 200);
+            break;
+        case 'c':
+            options.chains = option_number(optarg, 0, 100);
+            break;
+        case 'y':
+            options.cycles = option_number(optarg, 0, 100);
+            break;
+        case 'x':
+            options.deletions = option_number(optarg, 0, 100);
+            break;
+        case 'k':
+            options.group = option_number(optarg, 2, 1 << 20);
+            break;
+        case 's':
+            options.seed = option_number(optarg, 0, LONG_MAX);
+            break;
+        default:
+            fputs(usage, stderr);
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.chains + options.cycles + options.deletions > 100) {
+        fprintf(stderr, "Error: Shares add up to more than 100 percent.\n");
+        return EXIT_FAILURE;
+    }
+    return generate(argv[2], &options);
+}
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Benchmarks cbr on synthetic directories of increasing size, see usage below.
+set -eu
+
+usage() {
+    cat >&2 <<EOF
+usage: bench/run.sh [-d DIR] [-n SIZES] [-m editor|from] [-l LENGTH]
+                    [-c CHAINS] [-y CYCLES] [-x DELETIONS] [-k GROUP] [-T]
+                    [-- CBR_ARGUMENTS...]
+
+Generates directories of each of SIZES files (default "1000 10000 100000
+1000000") below DIR (default /dev/shm, a tmpfs), renames them with cbr and
+prints its wall time, peak RSS and syscall count (counted in a second run
+under strace, if installed, unless -T is given).
+
+Files are renamed through an editor that copies the planned names over the
+list (-m editor, the default) or from a mapping (-m from). CHAINS, CYCLES and
+DELETIONS are the percentages of files renamed in chains or cycles of GROUP
+files or marked for deletion (defaults 10, 10 and 5, groups of 4), the rest
+get new names. CBR_ARGUMENTS are passed to cbr, e.g. -- --engine uring.
+EOF
+    exit 1
+}
+
+BENCH_DIR=$(dirname "$0")
+CBR=${CBR:-$BENCH_DIR/../cbr}
+GEN=${GEN:-$BENCH_DIR/bench}
+
+mount=/dev/shm
+sizes="1000 10000 100000 1000000"
+mode=editor
+length=16
+chains=10
+cycles=10
+deletions=5
+group=4
+strace=yes
+while getopts "d:n:m:l:c:y:x:k:Th" opt; do
+    case $opt in
+    d) mount=$OPTARG ;;
+    n) sizes=$OPTARG ;;
+    m) mode=$OPTARG ;;
+    l) length=$OPTARG ;;
+    c) chains=$OPTARG ;;
+    y) cycles=$OPTARG ;;
+    x) deletions=$OPTARG ;;
+    k) group=$OPTARG ;;
+    T) strace=no ;;
+    *) usage ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ "$mode" = editor ] || [ "$mode" = from ] || usage
+command -v strace >/dev/null 2>&1 || strace=no
+
+root=$(mktemp -d "$mount/cbr-bench.XXXXXX")
+trap 'rm -rf "$root"' EXIT INT TERM
+
+# fills $root/d with a fresh directory of $1 files, sets $expected
+generate() {
+    rm -rf "$root/d" "$root/state"
+    expected=$("$GEN" gen "$root/d" "$1" -l "$length" -c "$chains" \
+        -y "$cycles" -x "$deletions" -k "$group")
+}
+
+# runs cbr on $root/d, behind the command given as arguments; the journal is
+# kept on the benchmarked filesystem
+cbr_run() {
+    if [ "$mode" = editor ]; then
+        set -- "$@" "$CBR" -s -C "$root/d" -e "cp $root/d.names"
+    else
+        set -- "$@" "$CBR" -s -C "$root/d" --from "$root/d.map"
+    fi
+    XDG_STATE_HOME=$root/state "$@" $cbr_arguments
+}
+cbr_arguments="$*"
+
+echo "cbr benchmark on $(stat -f -c %T "$root") ($root), $mode mode," \
+    "$chains% chains, $cycles% cycles, $deletions% deletions"
+printf '%10s %10s %12s %12s %8s\n' files wall_s peak_rss_kb syscalls check
+
+for size in $sizes; do
+    generate "$size"
+    result=$(cbr_run "$GEN" time) || result="$result failed"
+    check=ok
+    count=$(find "$root/d" -mindepth 1 -maxdepth 1 | wc -l)
+    [ "$count" -eq "$expected" ] || check="$count!=$expected"
+
+    syscalls=-
+    if [ "$strace" = yes ]; then
+        generate "$size"
+        cbr_run strace -f -c -o "$root/strace" >/dev/null
+        syscalls=$(awk '$NF == "total" { print $4 }' "$root/strace")
+    fi
+
+    set -- $result
+    printf '%10s %10s %12s %12s %8s\n' "$size" "$1" "$2" "$syscalls" "$check"
+done
@@ -2,22 +2,52 @@
 
 #include <argp.h>
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <poll.h>
+#include <pthread.h>
+#include <regex.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #define CBR_VERSION "1.0.0"
 
 // used to define type-safe dynamic arrays
 #define DEFINE_ARRAY_TYPE(Name, Type)                                          \
     typedef struct {                                                           \
         Type *data;                                                            \
-        int capacity;                                                          \
-        int count;                                                             \
+        size_t capacity;                                                       \
+        size_t count;                                                          \
     } Name;                                                                    \
                                                                                \
     static inline void Name##_init(Name *a) {                                  \
@@ -35,41 +65,347 @@
         a->count++;                                                            \
     }                                                                          \
                                                                                \
+    /* elements are not owned by the array (see Arena) */                      \
     static inline void Name##_free(Name *a) {                                  \
-        for (int i = 0; i < a->count; i++) {                                   \
-            free(a->data[i]);                                                  \
-        }                                                                      \
         if (a->data) { free(a->data); }                                        \
     }
 
-#define ARRAY_LEN(arr) (sizeof(arr) / sizeof((arr)[0]))
-
 #define BOLD "\x1b[1m"
 #define RED "\x1b[31m"
 #define GREEN "\x1b[32m"
 #define YELLOW "\x1b[33m"
 #define RESET "\x1b[0m"
 
-#define TARGET_DIR "."
-
 // ===== DATA STRUCTURES =======================================================
 
-// used for multi-step file renaming
+typedef enum {
+    OP_RENAME,   // rename src to dst
+    OP_EXCHANGE, // swap src and dst
+    OP_DELETE,   // remove src
+    OP_TRASH,    // send src to trash
+} OpKind;
+
+// which names of an entry a rename goes between
+typedef enum {
+    STEP_DIRECT,    // initial name to new name
+    STEP_TO_TEMP,   // initial name to temporary name (breaks a cycle, or
+                    // holds a deleted file until it is unlinked)
+    STEP_FROM_TEMP, // temporary name to new name (completes a cycle)
+} RenameStep;
+
+#define INDEX_NONE SIZE_MAX
+
+// bump allocator holding filenames, freed all at once
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
 typedef struct {
-    char *initial_name;
-    char *temp_name;
-    char *new_name;
-} RenamePath;
+    ArenaBlock *head;
+} Arena;
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
 
 DEFINE_ARRAY_TYPE(FilenameList, char *)
-DEFINE_ARRAY_TYPE(RenamePathList, RenamePath *)
+DEFINE_ARRAY_TYPE(CharBuffer, char)
+
+// identity of a listed file, by which recovery tells whether a name still
+// refers to it
+typedef struct {
+    uint64_t ino; // 0 if unknown
+    uint64_t dev;
+} FileId;
+
+DEFINE_ARRAY_TYPE(FileIdList, FileId)
+
+// order of names in the editor
+typedef enum {
+    SORT_NAME,    // byte order
+    SORT_NATURAL, // byte order, except that numbers compare by value
+    SORT_MTIME,   // oldest first
+    SORT_SIZE,    // smallest first
+    SORT_NONE,    // as listed
+} SortOrder;
+
+// name i of a list with a number that orders it
+typedef struct {
+    uint64_t prefix;
+    uint32_t index;
+} SortKey;
+
+// what a filesystem treats as the same name, checked by --fold
+typedef enum {
+    FOLD_NONE,          // byte equality only
+    FOLD_ASCII,         // ASCII letters in either case
+    FOLD_NFC,           // canonically equivalent Unicode (e.g. NFC and NFD)
+    FOLD_NFKC_CASEFOLD, // also compatibility equivalents, in either case
+} FoldMode;
+
+// open-addressing hash set over an array of names, used to answer whether a
+// name is among them (and at which position) in constant time
+typedef struct {
+    uint64_t hash;
+    uint32_t entry; // position in names + 1, 0 marks an empty slot
+} NameIndexSlot;
+
+typedef struct {
+    char **names;
+    NameIndexSlot *slots;
+    size_t mask; // slot count - 1, slot count is a power of two
+} NameIndex;
+
+// every entry of a directory with its file type, kept current by a daemon
+// from inotify events so that the runs it serves skip listing and lookups
+typedef struct {
+    int dir_fd;
+    int inotify_fd;
+    dev_t dev;
+    ino_t ino;
+    char **names;  // "" for removed entries, until the index is rebuilt
+    mode_t *types; // S_IFMT bits
+    size_t count;
+    size_t capacity;
+    size_t removed;
+    NameIndex index; // over names
+    Arena arena;     // owns names
+} DirIndex;
+
+// parent directories of the files named by a batch of lookups or operations,
+// each opened once, so that a file is reached by its leaf below the fd of its
+// directory instead of by a path the kernel walks again on every call
+typedef struct {
+    int dir_fd;   // target directory, paths are relative to it
+    char **paths; // directory of each shard
+    int *fds;     // of each shard, -1 where it could not be opened
+    size_t count; // shard 0 (SHARD_NONE) names files by their whole path
+    size_t capacity;
+    size_t opened;   // fds held
+    size_t max_open; // half of RLIMIT_NOFILE, later directories use paths
+    size_t last;     // shard of the previous file, checked first
+    NameIndex index; // over paths
+    Arena arena;     // owns paths
+} Shards;
+
+// names of every entry as parallel arrays, where entry i renames
+// initial_names[i] to new_names[i]
+typedef struct {
+    char **initial_names;
+    char **new_names;
+    char **temp_names; // NULL unless entry is moved aside or deleted
+    uint32_t *depths;  // nesting level of each initial name, NULL if flat
+    bool *emptied;     // whether entries are directories that listed
+                       // entries are renamed out of, NULL if flat
+    const FileId *ids; // of each initial name as listed, NULL if unknown
+    size_t count;
+} RenameTable;
+
+// execution plan as parallel arrays, operation i applies kinds[i] to entry
+// entries[i] of the rename table
+typedef struct {
+    RenameTable *table;
+    uint8_t *kinds;       // OpKind
+    uint8_t *steps;       // RenameStep (renames and staged deletions)
+    uint32_t *entries;    // index into rename table
+    uint32_t *components; // operations of one chain or cycle, run in plan order
+    size_t count;
+    size_t capacity;
+    size_t *phase_ends; // each phase completes before the next one starts
+    size_t phase_count;
+} Plan;
+
+// trash directory of one filesystem, see
+// https://specifications.freedesktop.org/trash-spec/latest/
+typedef struct {
+    dev_t dev;     // filesystem this trash directory serves
+    char *path;    // absolute path of the trash directory
+    int files_fd;  // "files" subdirectory, holds the trashed files
+    int info_fd;   // "info" subdirectory, holds the .trashinfo files
+    char *top_dir; // trashinfo paths are relative to this, NULL if absolute
+} TrashDir;
+
+DEFINE_ARRAY_TYPE(TrashDirList, TrashDir *)
+
+typedef struct {
+    int dir_fd;           // target directory
+    char *dir_path;       // absolute path of target directory
+    TrashDirList dirs;    // resolved once per filesystem
+    FilenameList trashed; // name and path in the trash of each trashed file
+    Arena arena;          // owns trashed
+} Trash;
+
+// private hidden directory inside the target directory, used to hold files
+// moved aside while breaking rename cycles and deleted files until they are
+// unlinked
+typedef struct {
+    int dir_fd;          // target directory
+    char name[64];       // relative to target directory
+    bool created;        // created on first use
+    bool dry_run;        // hand out names without creating the directory
+    unsigned long count; // temporary names handed out
+} Staging;
+
+// append-only record of a run in cbr's state directory, which lets an
+// interrupted run be finished or undone
+typedef struct {
+    int fd;              // -1 if not journaling
+    int dir_fd;          // target directory
+    char path[PATH_MAX]; // empty without a state directory
+    size_t synced;       // operations recorded as durable
+    bool stalled;        // a write or sync failed, nothing more is recorded
+} Journal;
+
+#define REAPER_THREADS 4
+
+// deletions whose files wait in the staging directory, unlinked by a pool of
+// threads while the rest of the plan runs
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    const Plan *plan;
+    int dir_fd;
+    size_t *queue; // plan operations
+    size_t count;
+    size_t capacity;
+    size_t next;  // first operation not taken by a thread
+    bool closing; // no more operations are added
+    bool detach;  // threads are started only by reaper_finish()
+    pthread_t threads[REAPER_THREADS];
+    size_t thread_count;
+    size_t failed; // accessed atomically
+} Reaper;
+
+#define JOURNAL_SYNC_INTERVAL 4096
+
+// directory walk over a tree, where idle threads steal directories queued by
+// busy ones
+typedef struct Walk Walk;
+
+typedef struct {
+    Walk *walk;
+    pthread_mutex_t lock;
+    FilenameList queue; // directories to list, owner takes from the back
+    size_t head;        // thieves take from here
+    FilenameList names; // entries found by this thread
+    FileIdList ids;     // of the names
+    Arena arena;        // owns the names
+    char *buffer;       // getdents64() buffer
+} WalkWorker;
+
+struct Walk {
+    int dir_fd;
+    size_t buffer_size;
+    char delete_char;
+    WalkWorker *workers;
+    size_t worker_count;
+    size_t next_worker; // taken atomically by threads
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    size_t pending;       // directories queued or being listed
+    unsigned long pushes; // bumped on every queued directory
+    bool failed;
+};
+
+// built-in transform giving new names without an editor, applied to the last
+// component of every path
+typedef struct {
+    char *pattern;        // --subst regular expression, NULL if none
+    char *replacement;    // stored in the same allocation as pattern
+    int cflags;           // regcomp() flags
+    bool global;          // whether to replace every match or the first one
+    const char *template; // --template, NULL if none
+} Transform;
+
+#define OUTPUT_BUFFER_SIZE (128 * 1024)
+
+// report lines for stdout, gathered and written in large chunks
+typedef struct {
+    char buffer[OUTPUT_BUFFER_SIZE];
+    size_t length;
+    bool color;    // whether stdout is a terminal
+    bool progress; // counter on stderr and a summary instead of file lines
+    bool started;  // whether operations are being counted
+    size_t total;  // operations to report
+    size_t done;
+    size_t renamed;
+    size_t removed;
+    size_t trashed;
+    double start;         // CLOCK_MONOTONIC seconds
+    double last_progress; // when the counter was last drawn
+} Output;
+
+// parts of a run timed by --stats
+typedef enum {
+    STATS_ARGUMENTS,         // argument parsing
+    STATS_LIST,              // listing, walking, reading a mapping
+    STATS_VALIDATE_INPUT,    // checking files exist and are unique
+    STATS_SORT,              // sorting the listing
+    STATS_EDIT,              // waiting for the editor, or transforming
+    STATS_PARSE,             // splitting the edited names
+    STATS_VALIDATE_OUTPUT,   // checking new names
+    STATS_PLAN,              // resolving paths and cycles
+    STATS_RENAME,            // running the plan
+    STATS_TRASH,             // trashing files, while running the plan
+    STATS_REAP,              // waiting for deleted files to be unlinked
+    STATS_PHASE_COUNT,
+} StatsPhase;
+
+// calls counted by --stats, issued as syscalls or through io_uring
+typedef enum {
+    CALL_STAT,
+    CALL_RENAME,
+    CALL_UNLINK,
+    CALL_FORK,
+    CALL_URING_ENTER,
+    CALL_COUNT,
+} StatsCall;
+
+typedef struct {
+    bool enabled;
+    const char *path;   // JSON is written here, NULL for text on stderr
+    StatsPhase phase;   // phase being timed
+    double phase_start; // CLOCK_MONOTONIC seconds
+    double seconds[STATS_PHASE_COUNT];
+    size_t calls[CALL_COUNT]; // accessed atomically
+    size_t heap_peak;         // bytes allocated, sampled between phases
+} Stats;
+
+typedef enum {
+    ENGINE_SYNC,  // one blocking syscall per operation
+    ENGINE_URING, // operations submitted in batches through io_uring
+} Engine;
 
 typedef struct {
     bool force;          // whether to overwrite existing files
+    bool recursive;      // whether to list directories recursively
     bool silent;         // whether to write to stdout
     bool trash;          // whether to marked files to trash
     char delete_char;    // character used to mark file for deletion
     char *editor;        // specify editor to use
+    char *directory;     // directory that all file operations are relative to
+    char *from;          // mapping to read instead of editing, "-" for stdin
+    bool null_data;      // whether mapping records are NUL-separated
+    bool progress;       // whether to show a counter instead of file lines
+    char *subst;         // substitution giving new names, NULL if none
+    char *template;      // template giving new names, NULL if none
+    bool review;         // whether to edit transformed names before renaming
+    bool resume;         // whether to finish an interrupted run
+    bool rollback;       // whether to undo an interrupted run
+    char *undo;          // ID of the run --undo reverts, "" for the last one
+    bool dry_run;        // whether to print the plan instead of running it
+    bool detach;         // whether deletions finish after cbr exits
+    bool daemon;         // whether to serve runs on DIR from an index
+    bool connect;        // whether to hand the run over to a daemon
+    bool stats;          // whether to report timings and counters
+    char *stats_file;    // JSON stats are written here, NULL for stderr
+    bool json;           // whether the dry run prints JSON lines
+    Engine engine;       // how renames and deletions are executed
+    int jobs;            // worker threads for the sync engine
+    size_t scan_buffer;  // bytes read per getdents64() call when listing
+    SortOrder sort;      // order of listed names
+    FoldMode fold;       // equality of names on the target filesystem
     FilenameList *files; // the files to be renamed (args)
 } Arguments;
 
@@ -83,40 +419,319 @@ static char doc[] =
     "list of command-line arguments, e.g.\n\n  $ cbr *.mp3\n\nThe list of "
     "files will be opened in the editor specified by the $VISUAL environment "
     "variable, one filename per line. Edit the list, save and exit. The files "
-    "will be renamed to the edited filenames. Directories and special files "
-    "(e.g. sockets) cannot be renamed.\n\nIf the input file list is empty, "
-    "cbr defaults to listing the contents of the current working "
-    "directory.\n\ncbr supports cycle-renaming, as in you can safely rename A "
-    "to B, B to C and C to A in a single operation.\n\nYou can delete a file "
-    "by prefixing its name with the delete character (by default '#'). Deleted "
-    "files will be fully removed unless -t/--trash is specified, in "
-    "which case they will be moved to the system's recycle bin. Trash "
-    "functionality requires the gio program from GLib.";
+    "will be renamed to the edited filenames. Special files (e.g. sockets) "
+    "cannot be renamed, and directories only in recursive mode.\n\nIf the "
+    "input file list is empty, cbr defaults to listing the contents of the "
+    "current working directory (or of DIR if -C/--directory is specified). "
+    "File arguments are also interpreted relative to DIR.\n\nWith "
+    "-r/--recursive, the listing descends into subdirectories (and into "
+    "directory arguments), showing paths relative to DIR, directories "
+    "included. Directories are renamed after their contents, so a renamed "
+    "directory takes its contents with it, and paths below it may use either "
+    "its old or its new name.\n\nRenames can also be scripted: with --from "
+    "FILE or --stdin, cbr reads OLD<TAB>NEW lines (or NUL-separated OLD and "
+    "NEW records with -0) and applies them without an editor, with the same "
+    "checks. Common renames need no list at all: --subst and --template "
+    "compute every new name directly (in parallel for long lists), and "
+    "--review opens the result in the editor.\n\ncbr supports cycle-renaming, "
+    "as in you can safely rename A to B, B to C and C to A in a single "
+    "operation. Chains of renames are performed in dependency order, and only "
+    "true cycles require a temporary name. A file renamed onto another "
+    "filesystem is copied there (sharing its blocks where the filesystems "
+    "allow it) with its mode, owner and timestamps, and removed once the copy "
+    "is complete. Cycles may span directories.\n\nYou can delete a file by "
+    "prefixing its name with the delete character (by default '#'). Deleted "
+    "files will be fully removed unless -t/--trash is specified, in which case "
+    "they will be moved to the freedesktop.org trash of the file's filesystem "
+    "(usually ~/.local/share/Trash). Deleted files are first moved into a "
+    "hidden staging directory, and unlinked on background threads while the "
+    "renames run (with --detach, by a background process after cbr has "
+    "returned).\n\nOn filesystems that fold names, such as exFAT, SMB shares "
+    "or case-insensitive ext4 directories, Foo.txt and foo.txt are the same "
+    "file. With --fold=ascii, nfc or nfkc-casefold, cbr compares new names "
+    "with each other and with the entries of their directories as such a "
+    "filesystem would, and reports every collision before renaming anything. "
+    "Unicode folding covers Latin, Greek and Cyrillic letters, their combining "
+    "marks, ligatures and fullwidth forms (as of Unicode 14.0); names that "
+    "differ in other scripts are compared as they are.\n\nEach run is "
+    "journaled in $XDG_STATE_HOME/cbr (by default ~/.local/state/cbr) before "
+    "its first rename. If a run is interrupted, by a crash or a failed rename, "
+    "cbr refuses to start another one in that directory until --resume "
+    "finishes it or --rollback undoes its renames and trashing (and deletions "
+    "whose files are still in the staging directory). A completed run is "
+    "recorded there as well: --undo renames its files back and restores those "
+    "it trashed, through the same planner and checks as any run, and --undo=ID "
+    "reverts an older one (the 16 newest are kept per directory). Deleted "
+    "files cannot be restored.\n\nWith -n/--dry-run, cbr does all of the above "
+    "up to running the plan, then prints each planned operation and a summary "
+    "of the renames, deletions and expected syscalls (as JSON lines with "
+    "--json), leaving the files untouched.\n\nFor directories that are renamed "
+    "in all day, cbr --daemon -C DIR keeps an index of the entries of DIR, "
+    "updated with inotify, and serves runs started with --connect from it over "
+    "a socket in the state directory. The client hands over its arguments, "
+    "standard streams and working directory, and the run is made as usual, "
+    "except that DIR is neither listed nor are its names looked up (the editor "
+    "comes from the daemon's environment). Runs are served one at a time, so "
+    "an open editor holds up later clients.";
 
 static char args_doc[] = "[FILE]...";
 
+// keys for options without a short form
+enum {
+    OPT_CONNECT = 0x100,
+    OPT_DAEMON,
+    OPT_DETACH,
+    OPT_ENGINE,
+    OPT_FOLD,
+    OPT_FROM,
+    OPT_JSON,
+    OPT_PROGRESS,
+    OPT_RESUME,
+    OPT_REVIEW,
+    OPT_ROLLBACK,
+    OPT_SCAN_BUFFER,
+    OPT_SORT,
+    OPT_STATS,
+    OPT_STDIN,
+    OPT_SUBST,
+    OPT_TEMPLATE,
+    OPT_UNDO,
+};
+
 static struct argp_option options[] = {
+    {"null", '0', 0, 0, "Mapping records are separated by NUL characters", 0},
+    {"directory", 'C', "DIR", 0,
+     "Operate on files relative to DIR instead of the current directory", 0},
     {"delchar", 'd', "CHARACTER", 0,
      "Specify what deletion mark to use. Default '#'", 0},
     {"editor", 'e', "PROGRAM", 0, "Specify what editor to use", 0},
+    {"connect", OPT_CONNECT, 0, 0,
+     "Hand the run over to the daemon serving DIR, which checks names "
+     "against its index instead of listing and looking them up",
+     0},
+    {"daemon", OPT_DAEMON, 0, 0,
+     "Serve --connect runs on DIR until interrupted, keeping an index of its "
+     "entries current with inotify",
+     0},
+    {"detach", OPT_DETACH, 0, 0,
+     "Return once all files are renamed and deleted files moved aside, and "
+     "unlink them in a background process",
+     0},
+    {"dry-run", 'n', 0, 0,
+     "Plan everything as usual, then print the planned operations and their "
+     "cost instead of running them",
+     0},
+    {"engine", OPT_ENGINE, "ENGINE", 0,
+     "How renames and deletions are executed: 'sync' (default, one syscall "
+     "at a time) or 'uring' (batched through io_uring)",
+     0},
     {"force", 'f', 0, 0, "Allow overwriting of existing files", 0},
+    {"fold", OPT_FOLD, "MODE", 0,
+     "Also reject new names that collide once folded as on the target "
+     "filesystem: 'ascii' (letter case), 'nfc' (Unicode normalization), "
+     "'nfkc-casefold' (both, compatibility forms too) or 'none' (default)",
+     0},
+    {"from", OPT_FROM, "FILE", 0,
+     "Rename as listed in FILE instead of opening an editor, one "
+     "'OLD<TAB>NEW' line per file (or OLD and NEW records with -0)",
+     0},
+    {"json", OPT_JSON, 0, 0,
+     "Print the dry run as JSON lines, one object per operation and a "
+     "summary",
+     0},
+    {"jobs", 'j', "N", 0,
+     "Run independent renames on N worker threads (sync engine), which start "
+     "in different directories. Default 1. "
+     "The -r walk uses one thread per CPU (up to 8) unless N is given",
+     0},
+    {"scan-buffer", OPT_SCAN_BUFFER, "SIZE", 0,
+     "Read directory listings SIZE bytes at a time; accepts K and M "
+     "suffixes. Default 1M",
+     0},
+    {"sort", OPT_SORT, "ORDER", 0,
+     "Order of the names in the editor: 'name' (default), 'natural' "
+     "(numbers by value, file2 before file10), 'mtime', 'size' or 'none' (as "
+     "listed, fastest)",
+     0},
+    {"progress", OPT_PROGRESS, 0, 0,
+     "Show a counter with rate and ETA on stderr instead of a line per file, "
+     "and a summary at the end",
+     0},
+    {"resume", OPT_RESUME, 0, 0,
+     "Finish the interrupted run in DIR recorded in its journal, instead of "
+     "renaming",
+     0},
+    {"review", OPT_REVIEW, 0, 0,
+     "Open the names given by --subst or --template in the editor before "
+     "renaming",
+     0},
+    {"recursive", 'r', 0, 0,
+     "List directories recursively, directories included. Directory "
+     "arguments are walked too",
+     0},
+    {"rollback", OPT_ROLLBACK, 0, 0,
+     "Undo the renames of the interrupted run in DIR recorded in its journal",
+     0},
     {"silent", 's', 0, 0, "Only report errors", 0},
+    {"stats", OPT_STATS, "FILE", OPTION_ARG_OPTIONAL,
+     "Report the time spent in each phase, the counts of stat, rename, unlink "
+     "and fork calls and peak memory use on stderr, or as JSON to FILE",
+     0},
+    {"stdin", OPT_STDIN, 0, 0, "Read the mapping from standard input", 0},
+    {"subst", OPT_SUBST, "EXPR", 0,
+     "Rename by EXPR, of the form s/REGEX/REPL/FLAGS: the first match of "
+     "extended REGEX in each name (every match with flag g, ignoring case "
+     "with flag i) is replaced with REPL, where & and \\1 to \\9 refer to "
+     "the match and its groups",
+     0},
+    {"template", OPT_TEMPLATE, "TEMPLATE", 0,
+     "Rename to TEMPLATE, where {name}, {stem}, {ext} and {n} stand for "
+     "the name, the name without and after its last dot, and the position in "
+     "the list. Fields take modifiers :lower, :upper and :W (zero-pad numbers "
+     "to W digits), e.g. {stem:lower}_{n:4}.{ext}",
+     0},
     {"trash", 't', 0, 0, "Send files to trash instead of deleting them.", 0},
+    {"undo", OPT_UNDO, "ID", OPTION_ARG_OPTIONAL,
+     "Revert the last completed run in DIR, or the run recorded as ID, "
+     "renaming its files back and restoring those it trashed",
+     0},
     {0}};
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state) {
     Arguments *arguments = state->input;
 
     switch (key) {
+    case '0':
+        arguments->null_data = true;
+        break;
+    case 'C':
+        arguments->directory = arg;
+        break;
     case 'd':
         arguments->delete_char = arg[0];
         break;
     case 'e':
         arguments->editor = arg;
         break;
+    case OPT_ENGINE:
+        if (strcmp(arg, "sync") == 0) {
+            arguments->engine = ENGINE_SYNC;
+        } else if (strcmp(arg, "uring") == 0) {
+            arguments->engine = ENGINE_URING;
+        } else {
+            argp_error(state, "unknown engine '%s'", arg);
+        }
+        break;
     case 'f':
         arguments->force = true;
         break;
+    case 'j': {
+        char *end;
+        long jobs = strtol(arg, &end, 10);
+        if (*end != '\0' || jobs < 1 || jobs > 1024) {
+            argp_error(state, "invalid number of jobs '%s'", arg);
+        }
+        arguments->jobs = (int)jobs;
+        break;
+    }
+    case OPT_FROM:
+        arguments->from = arg;
+        break;
+    case OPT_JSON:
+        arguments->json = true;
+        break;
+    case OPT_CONNECT:
+        arguments->connect = true;
+        break;
+    case OPT_DAEMON:
+        arguments->daemon = true;
+        break;
+    case OPT_DETACH:
+        arguments->detach = true;
+        break;
+    case 'n':
+        arguments->dry_run = true;
+        break;
+    case OPT_PROGRESS:
+        arguments->progress = true;
+        break;
+    case OPT_RESUME:
+        arguments->resume = true;
+        break;
+    case OPT_REVIEW:
+        arguments->review = true;
+        break;
+    case OPT_ROLLBACK:
+        arguments->rollback = true;
+        break;
+    case OPT_STATS:
+        arguments->stats = true;
+        arguments->stats_file = arg;
+        break;
+    case OPT_STDIN:
+        arguments->from = "-";
+        break;
+    case OPT_SUBST:
+        arguments->subst = arg;
+        break;
+    case OPT_UNDO:
+        if (arg && (arg[0] == '\0' || strchr(arg, '/'))) {
+            argp_error(state, "invalid run ID '%s'", arg);
+        }
+        arguments->undo = arg ? arg : "";
+        break;
+    case OPT_TEMPLATE:
+        arguments->template = arg;
+        break;
+    case OPT_SCAN_BUFFER: {
+        char *end;
+        unsigned long long size = strtoull(arg, &end, 10);
+        if (*end == 'K' || *end == 'k') {
+            size <<= 10;
+            end++;
+        } else if (*end == 'M' || *end == 'm') {
+            size <<= 20;
+            end++;
+        }
+        if (*end != '\0' || size < 4096 || size > (64 << 20)) {
+            argp_error(state, "invalid scan buffer size '%s'", arg);
+        }
+        arguments->scan_buffer = (size_t)size;
+        break;
+    }
+    case OPT_SORT: {
+        static const char *const orders[] = {[SORT_NAME] = "name",
+                                             [SORT_NATURAL] = "natural",
+                                             [SORT_MTIME] = "mtime",
+                                             [SORT_SIZE] = "size",
+                                             [SORT_NONE] = "none"};
+        int order = 0;
+        while (order <= SORT_NONE && strcmp(arg, orders[order]) != 0) {
+            order++;
+        }
+        if (order > SORT_NONE) { argp_error(state, "unknown order '%s'", arg); }
+        arguments->sort = (SortOrder)order;
+        break;
+    }
+    case OPT_FOLD: {
+        static const char *const modes[] = {
+            [FOLD_NONE] = "none",
+            [FOLD_ASCII] = "ascii",
+            [FOLD_NFC] = "nfc",
+            [FOLD_NFKC_CASEFOLD] = "nfkc-casefold"};
+        int mode = 0;
+        while (mode <= FOLD_NFKC_CASEFOLD && strcmp(arg, modes[mode]) != 0) {
+            mode++;
+        }
+        if (mode > FOLD_NFKC_CASEFOLD) {
+            argp_error(state, "unknown fold mode '%s'", arg);
+        }
+        arguments->fold = (FoldMode)mode;
+        break;
+    }
+    case 'r':
+        arguments->recursive = true;
+        break;
     case 's':
         arguments->silent = true;
         break;
@@ -124,7 +739,47 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         arguments->trash = true;
         break;
     case ARGP_KEY_ARG:
-        FilenameList_add(arguments->files, strdup(arg));
+        FilenameList_add(arguments->files, arg); // argv outlives the list
+        break;
+    case ARGP_KEY_END:
+        if (arguments->from && arguments->files->count > 0) {
+            argp_error(state, "file arguments cannot be used with a mapping");
+        }
+        if (arguments->null_data && !arguments->from) {
+            argp_error(state, "-0 requires --from or --stdin");
+        }
+        bool transform = arguments->subst || arguments->template;
+        if (transform && arguments->from) {
+            argp_error(state, "--subst and --template cannot be used with a "
+                              "mapping");
+        }
+        if (arguments->review && !transform) {
+            argp_error(state, "--review requires --subst or --template");
+        }
+        if (arguments->resume && arguments->rollback) {
+            argp_error(state, "--resume and --rollback are exclusive");
+        }
+        bool listing = arguments->from || transform ||
+                       arguments->files->count > 0;
+        if ((arguments->resume || arguments->rollback) && listing) {
+            argp_error(state, "--resume and --rollback take no files");
+        }
+        if ((arguments->resume || arguments->rollback) && arguments->dry_run) {
+            argp_error(state, "--resume and --rollback cannot be dry runs");
+        }
+        if (arguments->undo &&
+            (listing || arguments->resume || arguments->rollback)) {
+            argp_error(state, "--undo takes no files and cannot be combined "
+                              "with --resume or --rollback");
+        }
+        if (arguments->json && !arguments->dry_run) {
+            argp_error(state, "--json requires -n/--dry-run");
+        }
+        if (arguments->daemon &&
+            (listing || arguments->connect || arguments->resume ||
+             arguments->rollback || arguments->undo || arguments->dry_run)) {
+            argp_error(state, "--daemon takes no files and runs nothing");
+        }
         break;
     default:
         return ARGP_ERR_UNKNOWN;
@@ -134,451 +789,6365 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 
 static struct argp argp = {options, parse_opt, args_doc, doc, 0, 0, 0};
 
-// ===== UTIL ==================================================================
+// ===== STATS =================================================================
 
-bool file_exists(const char *filename) {
-    struct stat st;
-    return lstat(filename, &st) == 0; // lstat() does not follow symlink
+static Stats stats = {.enabled = false, .path = NULL, .heap_peak = 0};
+
+double monotonic_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
 }
 
-bool file_is_reg_or_sym(const char *filename) {
-    struct stat st;
-    int result = lstat(filename, &st);
-    if (result != 0) { return false; }
-    return S_ISREG(st.st_mode) || S_ISLNK(st.st_mode);
+// starts collecting stats, with arguments parsed since start
+void stats_init(const Arguments *arguments, double start) {
+    stats.enabled = arguments->stats;
+    stats.path = arguments->stats_file;
+    stats.phase = STATS_ARGUMENTS;
+    stats.phase_start = start;
+}
+
+static inline void stats_count(StatsCall call) {
+    if (!stats.enabled) { return; }
+    __atomic_fetch_add(&stats.calls[call], 1, __ATOMIC_RELAXED);
 }
 
-// whether binary exists in directory in $PATH
-bool binary_exists(const char *name) {
-    const char *path = getenv("PATH");
-    if (!path) { return false; }
+// bytes currently allocated through malloc
+static size_t heap_in_use(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
 
-    char *paths = strdup(path); // cannot directly edit str from getenv()
-    if (!paths) { return false; }
+// Ends the phase being timed and starts timing phase (from the main thread
+// only). Memory is sampled at every change, so the peak is approximate.
+void stats_phase(StatsPhase phase) {
+    if (!stats.enabled) { return; }
+    double now = monotonic_now();
+    stats.seconds[stats.phase] += now - stats.phase_start;
+    stats.phase = phase;
+    stats.phase_start = now;
 
-    char *dir = strtok(paths, ":");
-    while (dir) {
-        char absolute_path[512];
-        snprintf(absolute_path, sizeof(absolute_path), "%s/%s", dir, name);
+    size_t heap = heap_in_use();
+    if (heap > stats.heap_peak) { stats.heap_peak = heap; }
+}
 
-        if (access(absolute_path, X_OK) == 0) {
-            free(paths);
-            return true;
+static const char *const stats_phase_names[] = {
+    [STATS_ARGUMENTS] = "arguments",
+    [STATS_LIST] = "list",
+    [STATS_VALIDATE_INPUT] = "validate_input",
+    [STATS_SORT] = "sort",
+    [STATS_EDIT] = "edit",
+    [STATS_PARSE] = "parse",
+    [STATS_VALIDATE_OUTPUT] = "validate_output",
+    [STATS_PLAN] = "plan",
+    [STATS_RENAME] = "rename",
+    [STATS_TRASH] = "trash",
+    [STATS_REAP] = "reap"};
+static const char *const stats_call_names[] = {
+    [CALL_STAT] = "stat",
+    [CALL_RENAME] = "rename",
+    [CALL_UNLINK] = "unlink",
+    [CALL_FORK] = "fork",
+    [CALL_URING_ENTER] = "io_uring_enter"};
+
+// Writes what --stats collected, as text on stderr or as JSON to the file
+// given. Called once at the end of a run, whether it succeeded or not.
+void stats_report(void) {
+    if (!stats.enabled) { return; }
+    stats_phase(stats.phase);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double total = 0;
+    for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+        total += stats.seconds[p];
+    }
+
+    FILE *file = stderr;
+    if (stats.path) {
+        file = fopen(stats.path, "w");
+        if (!file) {
+            perror("fopen");
+            fprintf(stderr, "Error: Could not write stats to '%s'.\n",
+                    stats.path);
+            return;
         }
 
-        dir = strtok(NULL, ":");
+        fprintf(file, "{\"phases\":{");
+        for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+            fprintf(file, "%s\"%s\":%.6f", p > 0 ? "," : "",
+                    stats_phase_names[p], stats.seconds[p]);
+        }
+        fprintf(file, "},\"total\":%.6f,\"calls\":{", total);
+        for (int c = 0; c < CALL_COUNT; c++) {
+            fprintf(file, "%s\"%s\":%zu", c > 0 ? "," : "",
+                    stats_call_names[c], stats.calls[c]);
+        }
+        fprintf(file, "},\"heap_peak_bytes\":%zu,\"max_rss_kb\":%ld}\n",
+                stats.heap_peak, usage.ru_maxrss);
+        if (fclose(file) != 0) {
+            perror("fclose");
+            fprintf(stderr, "Error: Could not write stats to '%s'.\n",
+                    stats.path);
+        }
+        return;
     }
 
-    free(paths);
-    return false;
+    for (int p = 0; p < STATS_PHASE_COUNT; p++) {
+        fprintf(file, "%-16s %10.6fs\n", stats_phase_names[p],
+                stats.seconds[p]);
+    }
+    fprintf(file, "%-16s %10.6fs\n", "total", total);
+    for (int c = 0; c < CALL_COUNT; c++) {
+        fprintf(file, "%s %zu%s", stats_call_names[c], stats.calls[c],
+                c + 1 < CALL_COUNT ? ", " : "\n");
+    }
+    fprintf(file, "heap peak %zu KiB, max RSS %ld KiB\n",
+            stats.heap_peak / 1024, usage.ru_maxrss);
 }
 
-void unique_filepath_generate(char buffer[], int buf_len, const char *prefix) {
-    do {
-        snprintf(buffer, buf_len, "%s_%d", prefix, rand() % 1000);
-    } while (file_exists(buffer));
-}
+// ===== UTIL ==================================================================
 
-char *editor_from_env(void) {
-    char *editor_path;
+void *arena_alloc(Arena *arena, size_t size) {
+    ArenaBlock *block = arena->head;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (!block) {
+            // no caller can go on without the name; like a crash, this
+            // leaves a run that has started to its journal
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        block->next = arena->head;
+        block->used = 0;
+        block->size = block_size;
+        arena->head = block;
+    }
+
+    void *memory = block->data + block->used;
+    block->used += size;
+    return memory;
+}
 
-    editor_path = getenv("VISUAL");
-    if (editor_path) { return editor_path; }
+char *arena_strdup(Arena *arena, const char *string) {
+    size_t size = strlen(string) + 1;
+    return memcpy(arena_alloc(arena, size), string, size);
+}
 
-    editor_path = getenv("EDITOR");
-    if (editor_path) { return editor_path; }
+void arena_free(Arena *arena) {
+    while (arena->head) {
+        ArenaBlock *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
 
-    if (binary_exists("nano")) { return "nano"; }
-    if (binary_exists("vi")) { return "vi"; }
+// moves all blocks of from into arena, from is left empty
+void arena_merge(Arena *arena, Arena *from) {
+    ArenaBlock *block = from->head;
+    if (!block) { return; }
+    while (block->next) { block = block->next; }
+    block->next = arena->head;
+    arena->head = from->head;
+    from->head = NULL;
+}
 
-    return NULL;
+// filenames are resolved relative to dir_fd (AT_FDCWD for absolute paths)
+bool file_exists(int dir_fd, const char *filename) {
+    struct stat st;
+    stats_count(CALL_STAT);
+    // AT_SYMLINK_NOFOLLOW does not follow symlink (like lstat())
+    return fstatat(dir_fd, filename, &st, AT_SYMLINK_NOFOLLOW) == 0;
 }
 
-int string_compare(const void *s1_ptr, const void *s2_ptr) {
-    const char *s1 = *(const char **)s1_ptr;
-    const char *s2 = *(const char **)s2_ptr;
-    return strcmp(s1, s2);
+// file type bits (S_IFMT) of filename, without following symlinks, or 0 with
+// errno set, and its identity in id if given (zeroed if not found); statx() is
+// asked for the type (and inode) only, and fstatat() is used on kernels
+// without statx()
+mode_t file_type_id(int dir_fd, const char *filename, FileId *id) {
+    static bool statx_unsupported = false;
+    if (id) { *id = (FileId){.ino = 0, .dev = 0}; }
+    stats_count(CALL_STAT);
+    if (!__atomic_load_n(&statx_unsupported, __ATOMIC_RELAXED)) {
+        struct statx stx;
+        unsigned mask = id ? STATX_TYPE | STATX_INO : STATX_TYPE;
+        if (statx(dir_fd, filename, AT_SYMLINK_NOFOLLOW, mask, &stx) == 0) {
+            if (id) {
+                id->ino = stx.stx_ino;
+                id->dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+            }
+            return stx.stx_mode & S_IFMT;
+        }
+        if (errno != ENOSYS) { return 0; }
+        __atomic_store_n(&statx_unsupported, true, __ATOMIC_RELAXED);
+    }
+
+    struct stat st;
+    if (fstatat(dir_fd, filename, &st, AT_SYMLINK_NOFOLLOW) != 0) { return 0; }
+    if (id) { *id = (FileId){.ino = st.st_ino, .dev = st.st_dev}; }
+    return st.st_mode & S_IFMT;
 }
 
-// filename list must be sorted
-bool filename_list_has(FilenameList *fl, const char *filename) {
-    char **match = bsearch(&filename, fl->data, fl->count, sizeof(char **),
-                           string_compare);
-    return match != NULL;
+mode_t file_type(int dir_fd, const char *filename) {
+    return file_type_id(dir_fd, filename, NULL);
 }
 
-bool file_rename(const char *old_filename, const char *new_filename) {
-    int result = rename(old_filename, new_filename);
-    if (result != 0) {
-        perror("rename");
-        fprintf(stderr, "Error: Could not rename '%s' to '%s'\n", old_filename,
-                new_filename);
-        return false;
+// number of components in path before its last one
+uint32_t path_depth(const char *path) {
+    uint32_t depth = 0;
+    for (const char *c = path; *c; c++) {
+        if (*c == '/' && c[1] != '/' && c[1] != '\0') { depth++; }
     }
-    return true;
+    return depth;
 }
 
-// https://www.csl.mtu.edu/cs4411.ck/www/NOTES/process/fork/create.html
-// returns whether successful
-bool gio_trash(char *argv[]) {
-    pid_t pid = fork();
+// record layout returned by getdents64(2)
+typedef struct {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} LinuxDirent64;
 
-    // if fork() unsuccesful
-    if (pid < 0) {
-        perror("fork");
+// collect names of regular files and symbolic links in directory path
+// (relative to dir_fd, "." for dir_fd itself) into names, reading entries with
+// getdents64() into buffer so that huge directories take few round-trips.
+// Names are copied into arena, prefixed with path unless it is ".". If subdirs
+// is given, subdirectories are collected as names too and added to subdirs.
+// If ids is given, the inode of each name (from its entry) is added to it.
+// returns whether successful
+bool directory_scan(int dir_fd, const char *path, char *buffer,
+                    size_t buffer_size, char delete_char, Arena *arena,
+                    FilenameList *names, FileIdList *ids,
+                    FilenameList *subdirs) {
+    // getdents64() advances the file offset, so scan through a fresh fd
+    int scan_fd = openat(dir_fd, path,
+                         O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (scan_fd < 0) {
+        perror("openat");
+        fprintf(stderr, "Error: Could not list directory '%s'.\n", path);
         return false;
     }
 
-    // code for child process
-    if (pid == 0) {
-        execvp("gio", argv);
-
-        // if execvp returns, it's an error
-        perror("execvp");
+    // entries are on the device of their directory
+    struct stat st;
+    uint64_t dev = 0;
+    if (ids) {
+        stats_count(CALL_STAT);
+        if (fstat(scan_fd, &st) == 0) { dev = st.st_dev; }
+    }
 
-        // POSIX convention for failed exec() in child-process
-        // 127 means "exec failed for this command"
-        // _exit() bypasses standard exit() procedure (skips atexit() handlers)
-        _exit(127);
+    // only top level names can be mistaken for deletion marks
+    bool top_level = strcmp(path, ".") == 0;
+    size_t prefix_len = 0; // including the separating slash
+    if (!top_level) {
+        prefix_len = strlen(path);
+        if (path[prefix_len - 1] != '/') { prefix_len++; }
     }
 
-    // in parent process, wait for child
-    int status;
-    if (waitpid(pid, &status, 0) < 0) {
-        perror("waitpid");
-        return false;
+    bool success = true;
+    while (success) {
+        long bytes = syscall(SYS_getdents64, scan_fd, buffer, buffer_size);
+        if (bytes < 0) {
+            perror("getdents64");
+            fprintf(stderr, "Error: Could not list directory '%s'.\n", path);
+            success = false;
+        }
+        if (bytes <= 0) { break; }
+
+        for (long offset = 0; offset < bytes;) {
+            LinuxDirent64 *entry = (LinuxDirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+
+            // d_type already classifies the entry on most filesystems
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                type = IFTODT(file_type(scan_fd, entry->d_name));
+            }
+            bool is_dir = type == DT_DIR && subdirs;
+            if (type != DT_REG && type != DT_LNK && !is_dir) { continue; }
+            if (is_dir && (strcmp(entry->d_name, ".") == 0 ||
+                           strcmp(entry->d_name, "..") == 0)) {
+                continue;
+            }
+
+            if (top_level && entry->d_name[0] == delete_char) {
+                fprintf(stderr,
+                        "Error: Input filenames ('%s') cannot begin with "
+                        "delete character '%c'.\n",
+                        entry->d_name, delete_char);
+                success = false;
+                break;
+            }
+
+            size_t size = strlen(entry->d_name) + 1;
+            char *name = arena_alloc(arena, prefix_len + size);
+            if (prefix_len > 0) {
+                memcpy(name, path, prefix_len - 1);
+                name[prefix_len - 1] = '/';
+            }
+            memcpy(name + prefix_len, entry->d_name, size);
+            FilenameList_add(names, name);
+            if (ids) {
+                FileIdList_add(ids, (FileId){.ino = entry->d_ino, .dev = dev});
+            }
+            if (is_dir) { FilenameList_add(subdirs, name); }
+        }
     }
 
-    // if child process terminated normalled and return code is 0
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) { return true; }
+    close(scan_fd);
+    return success;
+}
 
-    return false;
+// threads for parallel listing and transforms, -j N if given, else one per
+// CPU (up to 8)
+size_t worker_thread_count(const Arguments *arguments) {
+    if (arguments->jobs > 1) { return arguments->jobs; }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) { return 1; }
+    return cpus > 8 ? 8 : cpus;
 }
 
-void rename_message_print(const char *old_filename, const char *new_filename) {
-    printf(BOLD GREEN "Renamed " RESET "'%s'\n", old_filename);
-    printf(GREEN "     ->" RESET " '%s'\n", new_filename);
+// Runs worker(arg) on up to thread_count threads, the calling one included,
+// and returns once all of them are done. Workers take their work from the
+// shared arg, so if fewer threads can be started, the ones that exist pick up
+// the rest.
+void pool_run(void *(*worker)(void *), void *arg, size_t thread_count) {
+    size_t extra = thread_count > 1 ? thread_count - 1 : 0;
+    pthread_t *threads = malloc((extra > 0 ? extra : 1) * sizeof(pthread_t));
+    size_t started = 0;
+    while (threads && started < extra &&
+           pthread_create(&threads[started], NULL, worker, arg) == 0) {
+        started++;
+    }
+    worker(arg);
+    for (size_t t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
 }
 
-void delete_message_print(const char *filename) {
-    printf(BOLD RED "Removed " RESET "'%s'\n", filename);
+// writes a new temporary name (relative to target directory) to buffer
+// names are unique by construction, so the filesystem is never probed and
+// only the staging directory itself is created (once)
+bool staging_temp_name(Staging *staging, char buffer[], int buf_len) {
+    if (!staging->created && staging->dry_run) {
+        snprintf(staging->name, sizeof(staging->name), ".cbr_staging_%ld_0",
+                 (long)getpid());
+    } else if (!staging->created) {
+        // only collides with a directory left behind by a crashed run
+        for (int attempt = 0;; attempt++) {
+            snprintf(staging->name, sizeof(staging->name),
+                     ".cbr_staging_%ld_%d", (long)getpid(), attempt);
+            if (mkdirat(staging->dir_fd, staging->name, 0700) == 0) { break; }
+            if (errno != EEXIST) {
+                perror("mkdirat");
+                fprintf(stderr,
+                        "Error: Could not create staging directory '%s'.\n",
+                        staging->name);
+                return false;
+            }
+        }
+        staging->created = true;
+    }
+
+    snprintf(buffer, buf_len, "%s/%lu", staging->name, staging->count++);
+    return true;
 }
 
-void trash_message_print(const char *filename) {
-    printf(BOLD YELLOW "Trashed " RESET "'%s'\n", filename);
+// removes staging directory, which fails if files are still held there
+void staging_remove(Staging *staging) {
+    if (!staging->created) { return; }
+
+    stats_count(CALL_UNLINK);
+    if (unlinkat(staging->dir_fd, staging->name, AT_REMOVEDIR) != 0) {
+        perror("unlinkat");
+        fprintf(stderr, "Error: Files remain in staging directory '%s'.\n",
+                staging->name);
+        return;
+    }
+    staging->created = false;
 }
 
-// ===== MAIN ==================================================================
+// writes all of iov to fd, retrying partial writes
+// returns whether successful (errno set otherwise)
+bool fd_writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
+}
 
-int main(int argc, char *argv[]) {
-    FilenameList initial_names_list, new_names_list, new_sorted_names_list;
-    FilenameList_init(&initial_names_list);
-    FilenameList_init(&new_names_list);
-    FilenameList_init(&new_sorted_names_list);
+// reads fd to its end into a single NUL-terminated buffer, which caller frees
+// returns NULL on error
+char *fd_read_all(int fd, size_t *size) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        return NULL;
+    }
+
+    size_t capacity = st.st_size;
+    char *buffer = malloc(capacity + 1);
+    size_t length = 0;
+    for (;;) {
+        // file may grow while being read
+        if (length == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            buffer = realloc(buffer, capacity + 1);
+        }
 
-    // used if -t/--trash is specified
-    FilenameList trash_list;
-    FilenameList_init(&trash_list);
+        ssize_t result = read(fd, buffer + length, capacity - length);
+        if (result < 0) {
+            if (errno == EINTR) { continue; }
+            perror("read");
+            free(buffer);
+            return NULL;
+        }
+        if (result == 0) { break; }
+        length += result;
+    }
 
-    // used to handle temporary files
-    RenamePathList rename_path_list;
-    RenamePathList_init(&rename_path_list);
+    buffer[length] = '\0';
+    *size = length;
+    return buffer;
+}
 
-    // default arguments
-    Arguments arguments = {.delete_char = '#',
-                           .editor = NULL,
-                           .force = false,
-                           .silent = false,
-                           .trash = false,
-                           .files = &initial_names_list};
+// reads whole file into a single NUL-terminated buffer, which caller frees
+// returns NULL on error
+char *file_read_all(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror("open");
+        return NULL;
+    }
+    char *buffer = fd_read_all(fd, size);
+    close(fd);
+    return buffer;
+}
 
-    // parse arguments
-    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+// splits buffer into records in place (separators are replaced by NUL) and
+// adds them to list, a final record without trailing separator is included
+// memchr() is vectorised by libc, so this is a single fast scan
+void records_split(char *buffer, size_t size, char separator,
+                   FilenameList *list) {
+    char *record = buffer;
+    char *end = buffer + size;
+
+    while (record < end) {
+        char *next = memchr(record, separator, end - record);
+        if (!next) {
+            FilenameList_add(list, record); // buffer is NUL-terminated
+            break;
+        }
+        *next = '\0';
+        FilenameList_add(list, record);
+        record = next + 1;
+    }
+}
 
-    DIR *cur_dir = NULL;
-    FILE *tmp_edit_file = NULL;
+// splits a mapping in buffer in place into pairs of initial and new names,
+// either "OLD\tNEW" lines or "OLD\0NEW\0" records if null_separated
+// returns whether successful
+bool mapping_split(char *buffer, size_t size, bool null_separated,
+                   FilenameList *initial_names, FilenameList *new_names) {
+    if (null_separated) {
+        records_split(buffer, size, '\0', initial_names);
+        if (initial_names->count % 2 != 0) {
+            fprintf(stderr, "Error: Mapping ends with unpaired name '%s'.\n",
+                    initial_names->data[initial_names->count - 1]);
+            return false;
+        }
 
-    // check that `gio` is available if trashing files
-    if (arguments.trash) {
-        if (!binary_exists("gio")) {
-            fprintf(stderr, "Error: gio (as part of GLib) is required for "
-                            "trash functionality.\n");
-            goto fail;
+        // records alternate between initial and new names
+        size_t pairs = initial_names->count / 2;
+        for (size_t i = 0; i < pairs; i++) {
+            FilenameList_add(new_names, initial_names->data[2 * i + 1]);
+            initial_names->data[i] = initial_names->data[2 * i];
         }
+        initial_names->count = pairs;
+        return true;
     }
 
-    // if no file arguments specified, populate input list with contents of
-    // current working directory
-    if (initial_names_list.count == 0) {
-        cur_dir = opendir(TARGET_DIR);
-        if (!cur_dir) {
-            perror("opendir");
-            goto fail;
+    records_split(buffer, size, '\n', initial_names);
+    for (size_t i = 0; i < initial_names->count; i++) {
+        char *tab = strchr(initial_names->data[i], '\t');
+        if (!tab) {
+            fprintf(stderr,
+                    "Error: Line %zu of mapping has no tab between the old "
+                    "and new name.\n",
+                    i + 1);
+            return false;
         }
+        *tab = '\0';
+        FilenameList_add(new_names, tab + 1);
+    }
+    return true;
+}
 
-        struct dirent *entry;
+// Splits command into words at blanks, honouring single and double quotes and
+// backslashes, so it runs without a shell. The words are written to buffer,
+// which holds strlen(command) + 1 bytes.
+// returns the number of words, 0 if command uses other shell syntax (or has
+// too many words) and is left to sh
+size_t command_split(const char *command, char *buffer, char *words[],
+                     size_t max_words) {
+    size_t count = 0;
+    const char *c = command;
+    for (;;) {
+        while (*c == ' ' || *c == '\t') {
+            c++;
+        }
+        if (!*c) { break; }
+        if (count + 1 >= max_words) { return 0; }
 
-        // collect names of regular files and symbolic links
-        while ((entry = readdir(cur_dir)) != NULL) {
-            if (entry->d_type == DT_REG || entry->d_type == DT_LNK) {
-                if (entry->d_name[0] == arguments.delete_char) {
-                    fprintf(stderr,
-                            "Error: Input filenames ('%s') cannot begin with "
-                            "delete character '%c'.\n",
-                            entry->d_name, arguments.delete_char);
-                    goto fail;
-                }
-                FilenameList_add(&initial_names_list, strdup(entry->d_name));
+        words[count++] = buffer;
+        char quote = 0;
+        for (; *c && (quote || (*c != ' ' && *c != '\t')); c++) {
+            if (quote && *c == quote) {
+                quote = 0;
+            } else if (quote == '\'') {
+                *buffer++ = *c;
+            } else if (*c == '\\' && c[1] &&
+                       (!quote || strchr("\"\\$`", c[1]))) {
+                *buffer++ = *++c;
+            } else if (!quote && (*c == '\'' || *c == '"')) {
+                quote = *c;
+            } else if (*c == '$' || *c == '`' ||
+                       (!quote && strchr("|&;<>()*?[]{}~!#\n", *c))) {
+                return 0;
+            } else {
+                *buffer++ = *c;
             }
         }
+        if (quote) { return 0; }
+        *buffer++ = '\0';
+    }
+    // variable assignments before the command
+    if (count > 0 && strchr(words[0], '=')) { return 0; }
+    words[count] = NULL;
+    return count;
+}
 
-        closedir(cur_dir);
-        cur_dir = NULL;
+// Runs command with path appended to it, as the shell would run
+// "command path", and waits for it. Simple commands are started directly
+// with posix_spawnp(), others through sh with path as "$1". Like system(),
+// SIGINT and SIGQUIT only reach the command while it runs.
+// returns the exit status of command, -1 with errno set if it was not run
+int command_run(const char *command, const char *path) {
+    char *buffer = malloc(strlen(command) + 1);
+    char *words[64];
+    size_t count = command_split(command, buffer, words, 63);
+    char *script = NULL;
+    if (count == 0) {
+        size_t size = strlen(command) + 8;
+        script = malloc(size);
+        snprintf(script, size, "%s \"$1\"", command);
+        words[0] = "sh";
+        words[1] = "-c";
+        words[2] = script;
+        words[3] = "sh";
+        count = 4;
     }
+    words[count] = (char *)path;
+    words[count + 1] = NULL;
 
-    // check that there is at least one input filename
-    if (initial_names_list.count == 0) { exit(EXIT_SUCCESS); }
+    struct sigaction ignore = {.sa_handler = SIG_IGN}, old_int, old_quit;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGINT, &ignore, &old_int);
+    sigaction(SIGQUIT, &ignore, &old_quit);
 
-    // check that input files exist
-    // and that they are regular or symbolic link files
-    for (int i = 0; i < initial_names_list.count; i++) {
-        char *filename = initial_names_list.data[i];
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
 
-        if (!file_exists(filename)) {
-            fprintf(stderr, "Error: File '%s' does not exist.\n", filename);
-            goto fail;
-        } else if (!file_is_reg_or_sym(filename)) {
-            fprintf(
-                stderr,
-                "Error: File '%s' is not a regular file or symbolic link.\n",
-                filename);
-            goto fail;
-        }
+    extern char **environ;
+    pid_t pid;
+    stats_count(CALL_FORK);
+    int error = posix_spawnp(&pid, words[0], NULL, &attr, words, environ);
+    int status = -1;
+    if (error == 0) {
+        int result;
+        do {
+            result = waitpid(pid, &status, 0);
+        } while (result < 0 && errno == EINTR);
+        if (result < 0) { error = errno; }
     }
 
-    // sort file names
-    qsort(initial_names_list.data, initial_names_list.count, sizeof(char **),
-          string_compare);
+    posix_spawnattr_destroy(&attr);
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
+    free(script);
+    free(buffer);
 
-    // temp file creation
-    char tmp_file_path[32];
-    unique_filepath_generate(tmp_file_path, sizeof(tmp_file_path),
-                             "/tmp/cbr_edit_file");
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    if (WIFSIGNALED(status)) { return 128 + WTERMSIG(status); }
+    return WEXITSTATUS(status);
+}
 
-    // open temp file
-    tmp_edit_file = fopen(tmp_file_path, "w+");
-    if (!tmp_edit_file) {
-        perror("fopen");
-        goto fail;
+// editor given with -e or by the environment, NULL if none
+char *editor_configured(const Arguments *arguments) {
+    if (arguments->editor) { return arguments->editor; }
+
+    char *editor = getenv("VISUAL");
+    if (editor && editor[0]) { return editor; }
+
+    editor = getenv("EDITOR");
+    if (editor && editor[0]) { return editor; }
+    return NULL;
+}
+
+// directory for the edit file, a private tmpfs where the session has one
+static const char *edit_directory(void) {
+    const char *directory = getenv("XDG_RUNTIME_DIR");
+    if (directory && directory[0] == '/' && access(directory, W_OK) == 0) {
+        return directory;
     }
+    directory = getenv("TMPDIR");
+    if (directory && directory[0] == '/') { return directory; }
+    return "/tmp";
+}
+
+// Lets the user edit names in an editor through a temporary file, whose path is
+// stored in tmp_file_path (PATH_MAX bytes) for the caller to remove. The list
+// is assembled in arena next to the names and written with a single write(),
+// and its mtime set to 0 so that any save changes it. Edited lines are split
+// into new_names, pointing into *buffer, unless the file is untouched: then
+// new_names are the names themselves and unchanged is set.
+// returns whether successful
+bool names_edit(const FilenameList *names, const Arguments *arguments,
+                Arena *arena, char *tmp_file_path, char **buffer,
+                FilenameList *new_names, bool *unchanged) {
+    stats_phase(STATS_EDIT);
+    *unchanged = false;
 
-    // write to temp file
-    for (int i = 0; i < initial_names_list.count; i++) {
-        fprintf(tmp_edit_file, "%s\n", initial_names_list.data[i]);
+    // temp file creation, mkostemp() picks a free name atomically
+    snprintf(tmp_file_path, PATH_MAX, "%s/cbr_edit_XXXXXX", edit_directory());
+    int tmp_edit_fd = mkostemp(tmp_file_path, O_CLOEXEC);
+    if (tmp_edit_fd < 0) {
+        perror("mkostemp");
+        tmp_file_path[0] = '\0';
+        return false;
     }
 
-    fclose(tmp_edit_file);
-    tmp_edit_file = NULL;
+    // assemble the list in memory
+    size_t size = 0;
+    for (size_t i = 0; i < names->count; i++) {
+        size += strlen(names->data[i]) + 1;
+    }
+    char *list = arena_alloc(arena, size > 0 ? size : 1);
+    char *end = list;
+    for (size_t i = 0; i < names->count; i++) {
+        size_t length = strlen(names->data[i]);
+        memcpy(end, names->data[i], length);
+        end[length] = '\n';
+        end += length + 1;
+    }
 
-    // edit file list
-    char *editor = arguments.editor;
-    if (!editor) { editor = editor_from_env(); }
-    if (!editor) {
-        fprintf(stderr, "Error: Could not find any editor from environment.\n");
-        goto fail;
+    struct iovec iov = {.iov_base = list, .iov_len = size};
+    struct timespec times[2] = {{.tv_sec = 0, .tv_nsec = UTIME_OMIT},
+                                {.tv_sec = 0, .tv_nsec = 0}};
+    bool written = fd_writev_all(tmp_edit_fd, &iov, 1) &&
+                   futimens(tmp_edit_fd, times) == 0;
+    if (close(tmp_edit_fd) != 0) { written = false; }
+    if (!written) {
+        perror("write");
+        fprintf(stderr, "Error: Could not write file list '%s'.\n",
+                tmp_file_path);
+        return false;
     }
 
-    char edit_cmd[256];
-    snprintf(edit_cmd, sizeof(edit_cmd), "%s %s", editor, tmp_file_path);
-    int return_code = system(edit_cmd);
+    // edit file list, without an editor configured the first of nano and vi
+    // that can be started is used (instead of searching $PATH beforehand)
+    char *editor = editor_configured(arguments);
+    int return_code = command_run(editor ? editor : "nano", tmp_file_path);
+    if (!editor && return_code < 0 && errno == ENOENT) {
+        return_code = command_run("vi", tmp_file_path);
+    }
+    stats_phase(STATS_PARSE);
 
+    if (return_code < 0) {
+        perror("posix_spawnp");
+        if (editor) {
+            fprintf(stderr, "Error: Could not start editor '%s'.\n", editor);
+        } else {
+            fprintf(stderr,
+                    "Error: Could not find any editor from environment.\n");
+        }
+        return false;
+    }
     if (return_code != 0) {
         fprintf(stderr, "Error: Editor returned exit code %d.\n", return_code);
-        goto fail;
+        return false;
     }
 
-    // open edited temp file
-    tmp_edit_file = fopen(tmp_file_path, "r");
-    if (!tmp_edit_file) {
-        perror("fopen");
-        goto fail;
+    // an untouched list needs no parsing
+    struct stat st;
+    if (stat(tmp_file_path, &st) == 0 && (size_t)st.st_size == size &&
+        st.st_mtim.tv_sec == 0 && st.st_mtim.tv_nsec == 0) {
+        for (size_t i = 0; i < names->count; i++) {
+            FilenameList_add(new_names, names->data[i]);
+        }
+        *unchanged = true;
+        return true;
     }
 
-    // read temp file
-    char new_fn_buf[256];
-    while (fgets(new_fn_buf, sizeof(new_fn_buf), tmp_edit_file)) {
-        new_fn_buf[strcspn(new_fn_buf, "\n")] = '\0'; // strip newline
-        FilenameList_add(&new_names_list, strdup(new_fn_buf));
-    }
+    // read edited temp file, new names point into the buffer
+    *buffer = file_read_all(tmp_file_path, &size);
+    if (!*buffer) { return false; }
+    records_split(*buffer, size, '\n', new_names);
+    return true;
+}
 
-    // check that there are same number of lines
-    if (initial_names_list.count != new_names_list.count) {
+// 64x64->128 bit multiply, folded
+static inline uint64_t hash_mum(uint64_t a, uint64_t b) {
+    __extension__ unsigned __int128 r = (unsigned __int128)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+// wyhash-style string hash, consumes 8 bytes per multiply
+uint64_t name_hash(const char *name) {
+    const uint64_t p0 = 0xa0761d6478bd642full;
+    const uint64_t p1 = 0xe7037ed1a0b428dbull;
+    const uint64_t p2 = 0x8ebc6af09c88c6e3ull;
+
+    size_t length = strlen(name);
+    uint64_t hash = length ^ p0;
+    uint64_t word;
+
+    for (; length >= 8; length -= 8, name += 8) {
+        memcpy(&word, name, 8);
+        hash = hash_mum(hash ^ word ^ p1, p2);
+    }
+    word = 0;
+    memcpy(&word, name, length);
+    hash = hash_mum(hash ^ word ^ p1, p2 ^ length);
+
+    return hash_mum(hash, p0);
+}
+
+void name_index_init(NameIndex *index, char **names, size_t count) {
+    size_t slot_count = 16;
+    while (slot_count < count * 2) {
+        slot_count *= 2;
+    }
+    index->names = names;
+    index->slots = calloc(slot_count, sizeof(NameIndexSlot));
+    index->mask = slot_count - 1;
+}
+
+void name_index_free(NameIndex *index) { free(index->slots); }
+
+// returns position of name (with given hash) in index, INDEX_NONE if absent
+size_t name_index_find(const NameIndex *index, const char *name,
+                       uint64_t hash) {
+    for (size_t slot = hash & index->mask;; slot = (slot + 1) & index->mask) {
+        const NameIndexSlot *s = &index->slots[slot];
+        if (s->entry == 0) { return INDEX_NONE; }
+        if (s->hash == hash && strcmp(index->names[s->entry - 1], name) == 0) {
+            return s->entry - 1;
+        }
+    }
+}
+
+// adds names[entry] (with given hash) to index
+// returns position of an equal name already present, INDEX_NONE otherwise
+size_t name_index_insert(NameIndex *index, size_t entry, uint64_t hash) {
+    const char *name = index->names[entry];
+
+    for (size_t slot = hash & index->mask;; slot = (slot + 1) & index->mask) {
+        NameIndexSlot *s = &index->slots[slot];
+        if (s->entry == 0) {
+            *s = (NameIndexSlot){.hash = hash, .entry = entry + 1};
+            return INDEX_NONE;
+        }
+        if (s->hash == hash && strcmp(index->names[s->entry - 1], name) == 0) {
+            return s->entry - 1;
+        }
+    }
+}
+
+// index of the target directory kept by a daemon, consulted instead of the
+// filesystem by the runs it serves (NULL otherwise)
+static const DirIndex *warm_index = NULL;
+
+// file type of name in dir_index, 0 if absent
+mode_t dir_index_type(const DirIndex *dir_index, const char *name) {
+    size_t e = name_index_find(&dir_index->index, name, name_hash(name));
+    return e == INDEX_NONE ? 0 : dir_index->types[e];
+}
+
+// whether the type of name is known to the warm index, which only holds the
+// entries of the target directory itself
+static inline bool warm_indexed(const char *name) {
+    return warm_index && !strchr(name, '/') && strcmp(name, ".") != 0 &&
+           strcmp(name, "..") != 0;
+}
+
+#define SHARD_NONE 0
+
+void shards_init(Shards *shards, int dir_fd) {
+    memset(shards, 0, sizeof(*shards));
+    shards->dir_fd = dir_fd;
+    shards->capacity = 64;
+    shards->paths = malloc(shards->capacity * sizeof(char *));
+    shards->fds = malloc(shards->capacity * sizeof(int));
+    shards->paths[SHARD_NONE] = "";
+    shards->fds[SHARD_NONE] = dir_fd;
+    shards->count = 1;
+    name_index_init(&shards->index, shards->paths, shards->capacity);
+
+    struct rlimit limit;
+    shards->max_open = 512;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur != RLIM_INFINITY) {
+        shards->max_open = limit.rlim_cur / 2;
+    }
+}
+
+// shard of the directory path (length bytes of it), opened when it is new
+static size_t shards_find(Shards *shards, const char *path, size_t length) {
+    char parent[PATH_MAX];
+    if (length >= sizeof(parent)) { return SHARD_NONE; }
+    memcpy(parent, path, length);
+    parent[length] = '\0';
+    uint64_t hash = name_hash(parent);
+    size_t s = name_index_find(&shards->index, parent, hash);
+    if (s != INDEX_NONE) { return s; }
+
+    // slots stay at most half full
+    if (shards->count >= shards->capacity) {
+        shards->capacity *= 2;
+        shards->paths =
+            realloc(shards->paths, shards->capacity * sizeof(char *));
+        shards->fds = realloc(shards->fds, shards->capacity * sizeof(int));
+        name_index_free(&shards->index);
+        name_index_init(&shards->index, shards->paths, shards->capacity);
+        for (size_t e = 1; e < shards->count; e++) {
+            name_index_insert(&shards->index, e, name_hash(shards->paths[e]));
+        }
+    }
+
+    s = shards->count++;
+    shards->paths[s] = arena_strdup(&shards->arena, parent);
+    shards->fds[s] = -1;
+    if (shards->opened < shards->max_open) {
+        shards->fds[s] =
+            openat(shards->dir_fd, parent, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    shards->opened += shards->fds[s] >= 0;
+    name_index_insert(&shards->index, s, hash);
+    return s;
+}
+
+// Returns the shard of the directory holding path, opening the directory the
+// first time one of its files is added. Files in the target directory itself,
+// paths ending in a slash and directories that cannot be opened (or would
+// exceed max_open) get SHARD_NONE, which names them by their path.
+uint32_t shards_add(Shards *shards, const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash[1] == '\0') { return SHARD_NONE; }
+    size_t length = slash > path ? (size_t)(slash - path) : 1; // "/"
+
+    // files come sorted or from one directory more often than not
+    const char *last = shards->paths[shards->last];
+    if (shards->last == SHARD_NONE || strncmp(last, path, length) != 0 ||
+        last[length] != '\0') {
+        shards->last = shards_find(shards, path, length);
+    }
+    return shards->fds[shards->last] >= 0 ? shards->last : SHARD_NONE;
+}
+
+// directory fd of a file of shard, whose path is replaced by the name of the
+// file below it
+static inline int shard_at(const Shards *shards, uint32_t shard,
+                           const char **path) {
+    if (shard == SHARD_NONE) { return shards->dir_fd; }
+    *path = strrchr(*path, '/') + 1;
+    return shards->fds[shard];
+}
+
+void shards_close(Shards *shards) {
+    for (size_t s = 1; s < shards->count; s++) {
+        if (shards->fds[s] >= 0) { close(shards->fds[s]); }
+    }
+    free(shards->paths);
+    free(shards->fds);
+    name_index_free(&shards->index);
+    arena_free(&shards->arena);
+}
+
+#define PROBE_THREADS 16 // lookups wait on the filesystem (NFS), not the CPU
+#define PROBE_BATCH 64    // names taken by a thread at a time
+
+// lookups of one preflight check, picked up by a pool of threads
+typedef struct {
+    const Shards *shards;
+    char *const *names;
+    const size_t *indices;       // names probed, NULL for all of them
+    const uint32_t *name_shards; // shard of each probed name
+    size_t count;
+    size_t next; // accessed atomically
+    mode_t *types;
+    FileId *ids; // NULL if not wanted
+} ProbeRun;
+
+static void *probe_worker(void *arg) {
+    ProbeRun *run = arg;
+
+    for (;;) {
+        size_t begin =
+            __atomic_fetch_add(&run->next, PROBE_BATCH, __ATOMIC_RELAXED);
+        if (begin >= run->count) { break; }
+        size_t end = begin + PROBE_BATCH;
+        if (end > run->count) { end = run->count; }
+
+        for (size_t k = begin; k < end; k++) {
+            const char *name = run->names[run->indices ? run->indices[k] : k];
+            if (warm_indexed(name)) {
+                run->types[k] = dir_index_type(warm_index, name);
+                if (run->ids) { run->ids[k] = (FileId){.ino = 0, .dev = 0}; }
+                continue;
+            }
+            int dir_fd = shard_at(run->shards, run->name_shards[k], &name);
+            run->types[k] =
+                file_type_id(dir_fd, name, run->ids ? &run->ids[k] : NULL);
+        }
+    }
+    return NULL;
+}
+
+// threads for preflight lookups, -j N if given, else PROBE_THREADS
+size_t probe_thread_count(const Arguments *arguments) {
+    return arguments->jobs > 1 ? (size_t)arguments->jobs : PROBE_THREADS;
+}
+
+// Looks up the file types (as file_type()) of count names, names[indices[k]]
+// or names[k] without indices, into types[k], and their identity into ids[k]
+// if ids is given. The lookups of long lists are spread over up to
+// thread_count threads, so that many are in flight at once. Names are looked
+// up below their directory, opened once (see Shards), and names in the warm
+// index of a daemon are not looked up at all.
+void names_probe(int dir_fd, char *const *names, const size_t *indices,
+                 size_t count, size_t thread_count, mode_t *types,
+                 FileId *ids) {
+    Shards shards;
+    shards_init(&shards, dir_fd);
+    uint32_t *name_shards = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+    for (size_t k = 0; k < count; k++) {
+        name_shards[k] = shards_add(&shards, names[indices ? indices[k] : k]);
+    }
+
+    ProbeRun run = {.shards = &shards,
+                    .names = names,
+                    .indices = indices,
+                    .name_shards = name_shards,
+                    .count = count,
+                    .next = 0,
+                    .types = types,
+                    .ids = ids};
+
+    size_t batches = (count + PROBE_BATCH - 1) / PROBE_BATCH;
+    if (thread_count > batches) { thread_count = batches; }
+    pool_run(probe_worker, &run, thread_count);
+    free(name_shards);
+    shards_close(&shards);
+}
+
+static Output output = {.length = 0, .color = false, .progress = false};
+
+// colors report lines only if they go to a terminal
+void output_init(bool progress) {
+    output.color = isatty(STDOUT_FILENO);
+    output.progress = progress;
+}
+
+// appends size bytes of data to the output, when the buffer is full it leaves
+// together with data in a single writev() (output to a closed pipe or full
+// disk is dropped)
+void output_write(const char *data, size_t size) {
+    if (output.length + size <= OUTPUT_BUFFER_SIZE) {
+        memcpy(output.buffer + output.length, data, size);
+        output.length += size;
+        return;
+    }
+    struct iovec iov[2] = {
+        {.iov_base = output.buffer, .iov_len = output.length},
+        {.iov_base = (char *)data, .iov_len = size}};
+    fd_writev_all(STDOUT_FILENO, iov, 2);
+    output.length = 0;
+}
+
+static inline void output_puts(const char *string) {
+    output_write(string, strlen(string));
+}
+
+// writes out the report lines buffered so far, also before an error message,
+// so that stdout and stderr read in order
+void output_flush(void) {
+    if (output.length == 0) { return; }
+    struct iovec iov = {.iov_base = output.buffer, .iov_len = output.length};
+    fd_writev_all(STDOUT_FILENO, &iov, 1);
+    output.length = 0;
+}
+
+// set once renameat2() flags are rejected by kernel or filesystem
+// (accessed atomically, as renames may run on worker threads)
+static bool noreplace_unsupported = false;
+static bool exchange_unsupported = false;
+
+// renames old_filename below old_fd to new_filename below new_fd; unless
+// overwrite is set, fails if new_filename exists (checked atomically with
+// RENAME_NOREPLACE where supported)
+// returns 0 if successful, errno otherwise (nothing is printed)
+int file_rename_quiet(int old_fd, const char *old_filename, int new_fd,
+                      const char *new_filename, bool overwrite) {
+    stats_count(CALL_RENAME);
+    if (!overwrite &&
+        !__atomic_load_n(&noreplace_unsupported, __ATOMIC_RELAXED)) {
+        int result = renameat2(old_fd, old_filename, new_fd, new_filename,
+                               RENAME_NOREPLACE);
+        if (result == 0) { return 0; }
+        if (errno != EINVAL && errno != ENOSYS) { return errno; }
+        __atomic_store_n(&noreplace_unsupported, true, __ATOMIC_RELAXED);
+    }
+
+    int result = renameat(old_fd, old_filename, new_fd, new_filename);
+    return result == 0 ? 0 : errno;
+}
+
+// temporary names handed out for moves across filesystems
+// (accessed atomically, as moves may run on worker threads)
+static unsigned long move_count = 0;
+
+// Copies size bytes from in_fd to out_fd without passing them through user
+// space: shares the blocks with an FICLONE reflink where the filesystems
+// support it, else copies them in the kernel with copy_file_range() and,
+// where that is unsupported between the two filesystems, sendfile().
+// returns 0 if successful, errno otherwise
+static int file_data_copy(int in_fd, int out_fd, off_t size) {
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) { return 0; }
+
+    bool range = true;
+    off_t done = 0;
+    while (done < size) {
+        ssize_t copied;
+        if (range) {
+            copied = copy_file_range(in_fd, NULL, out_fd, NULL, size - done, 0);
+            if (copied < 0 && done == 0 &&
+                (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                 errno == EOPNOTSUPP)) {
+                range = false;
+                continue;
+            }
+        } else {
+            copied = sendfile(out_fd, in_fd, NULL, size - done);
+        }
+        if (copied < 0) {
+            if (errno == EINTR) { continue; }
+            return errno;
+        }
+        if (copied == 0) { break; } // file shrank while being copied
+        done += copied;
+    }
+    return 0;
+}
+
+// Moves a regular file or symbolic link where rename() fails with EXDEV, as
+// new_filename is on another filesystem. The copy is written under a hidden
+// temporary name next to new_filename, gets the mode, owner (if permitted)
+// and timestamps of the original, is synced, and then renamed into place
+// (with the same overwrite rules as file_rename_quiet()). Only then is the
+// original removed, so an interruption leaves at worst both copies.
+// Directories and special files cannot be moved. Names are relative to old_fd
+// and new_fd, as for file_rename_quiet().
+// returns 0 if successful, errno otherwise (nothing is printed)
+int file_move_quiet(int old_fd, const char *old_filename, int new_fd,
+                    const char *new_filename, bool overwrite) {
+    struct stat st;
+    stats_count(CALL_STAT);
+    if (fstatat(old_fd, old_filename, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        return errno;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) { return EXDEV; }
+
+    const char *base = strrchr(new_filename, '/');
+    int dir_len = base ? (int)(base - new_filename) + 1 : 0;
+    char temp_filename[PATH_MAX];
+    int len = snprintf(
+        temp_filename, sizeof(temp_filename), "%.*s.cbr_move_%ld_%lu", dir_len,
+        new_filename, (long)getpid(),
+        __atomic_fetch_add(&move_count, 1, __ATOMIC_RELAXED));
+    if (len < 0 || (size_t)len >= sizeof(temp_filename)) {
+        return ENAMETOOLONG;
+    }
+
+    int error = 0;
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    if (S_ISLNK(st.st_mode)) {
+        char target[PATH_MAX];
+        ssize_t target_len =
+            readlinkat(old_fd, old_filename, target, sizeof(target) - 1);
+        if (target_len < 0) { return errno; }
+        target[target_len] = '\0';
+        if (symlinkat(target, new_fd, temp_filename) != 0) { return errno; }
+        fchownat(new_fd, temp_filename, st.st_uid, st.st_gid,
+                 AT_SYMLINK_NOFOLLOW);
+        utimensat(new_fd, temp_filename, times, AT_SYMLINK_NOFOLLOW);
+    } else {
+        int in_fd = openat(old_fd, old_filename, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) { return errno; }
+        int out_fd = openat(new_fd, temp_filename,
+                            O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (out_fd < 0) {
+            error = errno;
+            close(in_fd);
+            return error;
+        }
+
+        error = file_data_copy(in_fd, out_fd, st.st_size);
+        // the owner is kept where permitted (else the copy belongs to the
+        // mover), the mode is set after it as fchown() clears set-user-ID bits
+        if (error == 0 && fchown(out_fd, st.st_uid, st.st_gid) != 0 &&
+            errno != EPERM) {
+            error = errno;
+        }
+        if (error == 0 &&
+            (fchmod(out_fd, st.st_mode & 07777) != 0 ||
+             futimens(out_fd, times) != 0 || fsync(out_fd) != 0)) {
+            error = errno;
+        }
+        close(in_fd);
+        if (close(out_fd) != 0 && error == 0) { error = errno; }
+    }
+
+    if (error == 0) {
+        error = file_rename_quiet(new_fd, temp_filename, new_fd, new_filename,
+                                  overwrite);
+    }
+    if (error != 0) {
+        unlinkat(new_fd, temp_filename, 0);
+        return error;
+    }
+
+    stats_count(CALL_UNLINK);
+    return unlinkat(old_fd, old_filename, 0) == 0 ? 0 : errno;
+}
+
+// also moves files to other filesystems, by copying
+bool file_rename(int dir_fd, const char *old_filename, const char *new_filename,
+                 bool overwrite) {
+    int error = file_rename_quiet(dir_fd, old_filename, dir_fd, new_filename,
+                                  overwrite);
+    if (error == EXDEV) {
+        error = file_move_quiet(dir_fd, old_filename, dir_fd, new_filename,
+                                overwrite);
+    }
+    if (error != 0) {
+        output_flush();
+        errno = error;
+        perror("rename");
+        fprintf(stderr, "Error: Could not rename '%s' to '%s'.\n",
+                old_filename, new_filename);
+        return false;
+    }
+    return true;
+}
+
+// atomically swaps two files with RENAME_EXCHANGE, falls back to three
+// renames through a temporary name where unsupported
+bool file_exchange(int dir_fd, const char *filename_a, const char *filename_b,
+                   Staging *staging) {
+    if (!__atomic_load_n(&exchange_unsupported, __ATOMIC_RELAXED)) {
+        stats_count(CALL_RENAME);
+        int result = renameat2(dir_fd, filename_a, dir_fd, filename_b,
+                               RENAME_EXCHANGE);
+        if (result == 0) { return true; }
+
+        if (errno != EINVAL && errno != ENOSYS) {
+            output_flush();
+            perror("renameat2");
+            fprintf(stderr, "Error: Could not swap '%s' and '%s'.\n",
+                    filename_a, filename_b);
+            return false;
+        }
+        __atomic_store_n(&exchange_unsupported, true, __ATOMIC_RELAXED);
+    }
+
+    char temp_filename[96];
+    bool success =
+        staging_temp_name(staging, temp_filename, sizeof(temp_filename));
+    return success &&
+           file_rename(dir_fd, filename_a, temp_filename, false) &&
+           file_rename(dir_fd, filename_b, filename_a, false) &&
+           file_rename(dir_fd, temp_filename, filename_b, false);
+}
+
+// removes a file, or an empty directory (listed by -r/--recursive)
+// returns 0 if successful, errno otherwise
+int file_remove_quiet(int dir_fd, const char *filename) {
+    stats_count(CALL_UNLINK);
+    if (unlinkat(dir_fd, filename, 0) == 0) { return 0; }
+    if (errno != EISDIR) { return errno; }
+    return unlinkat(dir_fd, filename, AT_REMOVEDIR) == 0 ? 0 : errno;
+}
+
+// starts counting total operations for --progress
+void output_start(size_t total) {
+    output.started = true;
+    output.total = total;
+    output.start = monotonic_now();
+}
+
+// redraws the --progress counter at most ten times a second, and always once
+// everything is done
+void output_progress(void) {
+    double now = monotonic_now();
+    if (output.done < output.total && now - output.last_progress < 0.1) {
+        return;
+    }
+    output.last_progress = now;
+
+    double elapsed = now - output.start;
+    double rate = elapsed > 0 ? output.done / elapsed : 0;
+    double eta = rate > 0 ? (output.total - output.done) / rate : 0;
+    fprintf(stderr, "\r%zu/%zu done, %.0f/s, ETA %.0fs ", output.done,
+            output.total, rate, eta);
+}
+
+// ends counting, with a final counter line and summary for --progress
+void output_finish(bool silent) {
+    if (output.started && output.progress) {
+        // the counter is drawn when everything is done, unless something failed
+        if (output.done < output.total) {
+            output.last_progress = 0;
+            output_progress();
+        }
+        if (output.total > 0) { fputc('\n', stderr); }
+
+        if (!silent) {
+            char summary[160];
+            int len = snprintf(summary, sizeof(summary),
+                               "Renamed %zu, removed %zu, trashed %zu files "
+                               "in %.2fs\n",
+                               output.renamed, output.removed, output.trashed,
+                               monotonic_now() - output.start);
+            output_write(summary, len);
+        }
+    }
+    output.started = false;
+    output_flush();
+}
+
+void rename_message_print(const char *old_filename, const char *new_filename) {
+    output_puts(output.color ? BOLD GREEN "Renamed " RESET "'" : "Renamed '");
+    output_puts(old_filename);
+    output_puts(output.color ? "'\n" GREEN "     ->" RESET " '"
+                             : "'\n     -> '");
+    output_puts(new_filename);
+    output_puts("'\n");
+}
+
+void delete_message_print(const char *filename) {
+    output_puts(output.color ? BOLD RED "Removed " RESET "'" : "Removed '");
+    output_puts(filename);
+    output_puts("'\n");
+}
+
+void trash_message_print(const char *filename) {
+    output_puts(output.color ? BOLD YELLOW "Trashed " RESET "'" : "Trashed '");
+    output_puts(filename);
+    output_puts("'\n");
+}
+
+// ===== SORTING ===============================================================
+
+// Radix sorts keys by prefix, best first, stable. A pass is made per byte of
+// the prefix from the least significant up, skipping bytes that all keys
+// share (the leading bytes of similar names, the high bytes of sizes).
+void sort_keys_radix(SortKey *keys, SortKey *scratch, size_t count) {
+    size_t counts[8][256];
+    memset(counts, 0, sizeof(counts));
+    for (size_t i = 0; i < count; i++) {
+        uint64_t prefix = keys[i].prefix;
+        for (int b = 0; b < 8; b++) {
+            counts[b][(prefix >> (8 * b)) & 0xff]++;
+        }
+    }
+
+    for (int b = 0; b < 8; b++) {
+        size_t offset = 0;
+        bool shared = false;
+        for (int v = 0; v < 256; v++) {
+            size_t bucket = counts[b][v];
+            shared |= bucket == count;
+            counts[b][v] = offset;
+            offset += bucket;
+        }
+        if (shared) { continue; }
+
+        for (size_t i = 0; i < count; i++) {
+            uint8_t v = (keys[i].prefix >> (8 * b)) & 0xff;
+            scratch[counts[b][v]++] = keys[i];
+        }
+        memcpy(keys, scratch, count * sizeof(SortKey));
+    }
+}
+
+// first 8 bytes of string, big-endian so that integers order like strings
+static inline uint64_t string_prefix(const char *string) {
+    uint64_t prefix = 0;
+    for (int b = 0; b < 8 && string[b]; b++) {
+        prefix |= (uint64_t)(unsigned char)string[b] << (56 - 8 * b);
+    }
+    return prefix;
+}
+
+// Writes the natural sort key of name to key, which holds 3 * strlen(name) + 1
+// bytes. Digit runs are replaced by '0', their length without leading zeros
+// (plus one, capped at 255) and their significant digits, so that plain
+// strcmp() of keys puts file2 before file10.
+void natural_key_write(const char *name, char *key) {
+    while (*name) {
+        if (*name < '0' || *name > '9') {
+            *key++ = *name++;
+            continue;
+        }
+
+        while (*name == '0') {
+            name++;
+        }
+        const char *digits = name;
+        while (*name >= '0' && *name <= '9') {
+            name++;
+        }
+        size_t length = name - digits;
+        *key++ = '0';
+        *key++ = (char)(length < 254 ? length + 1 : 255);
+        memcpy(key, digits, length);
+        key += length;
+    }
+    *key = '\0';
+}
+
+// context of comparisons between keys with equal prefixes
+typedef struct {
+    char **names;
+    char **natural_keys; // NULL unless natural order
+} SortTies;
+
+static int sort_tie_compare(const void *a_ptr, const void *b_ptr, void *arg) {
+    const SortTies *ties = arg;
+    uint32_t a = ((const SortKey *)a_ptr)->index;
+    uint32_t b = ((const SortKey *)b_ptr)->index;
+    if (ties->natural_keys) {
+        int order = strcmp(ties->natural_keys[a], ties->natural_keys[b]);
+        if (order != 0) { return order; }
+    }
+    return strcmp(ties->names[a], ties->names[b]);
+}
+
+// Sorts names in order. Each name gets a fixed-size key whose prefix is a
+// number ordering it (the start of its name or natural key, its mtime or
+// its size), the keys are radix sorted, and only runs of equal prefixes are
+// compared in full. Files that cannot be stated sort first by mtime and size.
+// The identities in ids (if given, one per name) are reordered with the names.
+void names_sort(FilenameList *names, FileId *ids, SortOrder order,
+                int dir_fd) {
+    size_t count = names->count;
+    if (order == SORT_NONE || count < 2) { return; }
+
+    SortKey *keys = malloc(count * sizeof(SortKey));
+    SortKey *scratch = malloc(count * sizeof(SortKey));
+    SortTies ties = {.names = names->data, .natural_keys = NULL};
+    Arena arena = {.head = NULL};
+    if (order == SORT_NATURAL) {
+        ties.natural_keys = malloc(count * sizeof(char *));
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        const char *name = names->data[i];
+        keys[i].index = i;
+
+        if (order == SORT_NAME) {
+            keys[i].prefix = string_prefix(name);
+        } else if (order == SORT_NATURAL) {
+            char *key = arena_alloc(&arena, 3 * strlen(name) + 1);
+            natural_key_write(name, key);
+            ties.natural_keys[i] = key;
+            keys[i].prefix = string_prefix(key);
+        } else {
+            struct statx stx;
+            unsigned mask = order == SORT_MTIME ? STATX_MTIME : STATX_SIZE;
+            stats_count(CALL_STAT);
+            bool stated = statx(dir_fd, name, AT_SYMLINK_NOFOLLOW, mask,
+                                &stx) == 0;
+            if (!stated) {
+                keys[i].prefix = 0;
+            } else if (order == SORT_MTIME) {
+                // 34 bits of seconds, offset so that times before 1970 order
+                // first, and 30 bits of nanoseconds
+                uint64_t seconds = stx.stx_mtime.tv_sec + (1LL << 33);
+                keys[i].prefix = (seconds << 30) | stx.stx_mtime.tv_nsec;
+            } else {
+                keys[i].prefix = stx.stx_size;
+            }
+        }
+    }
+
+    sort_keys_radix(keys, scratch, count);
+    for (size_t i = 0; i < count;) {
+        size_t j = i + 1;
+        while (j < count && keys[j].prefix == keys[i].prefix) {
+            j++;
+        }
+        if (j - i > 1) {
+            qsort_r(keys + i, j - i, sizeof(SortKey), sort_tie_compare, &ties);
+        }
+        i = j;
+    }
+
+    // apply the order, through scratch space that is no longer needed
+    char **sorted = (char **)scratch;
+    for (size_t i = 0; i < count; i++) {
+        sorted[i] = names->data[keys[i].index];
+    }
+    memcpy(names->data, sorted, count * sizeof(char *));
+    FileId *sorted_ids = ids ? malloc(count * sizeof(FileId)) : NULL;
+    if (sorted_ids) {
+        for (size_t i = 0; i < count; i++) {
+            sorted_ids[i] = ids[keys[i].index];
+        }
+        memcpy(ids, sorted_ids, count * sizeof(FileId));
+        free(sorted_ids);
+    }
+
+    free(ties.natural_keys);
+    arena_free(&arena);
+    free(scratch);
+    free(keys);
+}
+
+// ===== WALK ==================================================================
+
+// queues directory path on worker, to be listed by it or a thief
+void walk_push(WalkWorker *worker, char *path) {
+    Walk *walk = worker->walk;
+
+    pthread_mutex_lock(&worker->lock);
+    FilenameList_add(&worker->queue, path);
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&walk->lock);
+    walk->pending++;
+    walk->pushes++;
+    pthread_cond_signal(&walk->wake);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// takes the most recently queued directory of worker, or the oldest one of
+// another worker, waiting while other workers may still queue more
+// returns NULL once the walk is finished or failed
+char *walk_take(WalkWorker *worker) {
+    Walk *walk = worker->walk;
+    size_t id = worker - walk->workers;
+
+    for (;;) {
+        pthread_mutex_lock(&walk->lock);
+        unsigned long pushes = walk->pushes;
+        bool done = walk->pending == 0 || walk->failed;
+        pthread_mutex_unlock(&walk->lock);
+        if (done) { return NULL; }
+
+        // own queue is used as a stack, which keeps the walk depth-first
+        char *path = NULL;
+        pthread_mutex_lock(&worker->lock);
+        if (worker->queue.count > worker->head) {
+            path = worker->queue.data[--worker->queue.count];
+        }
+        if (worker->queue.count == worker->head) {
+            worker->queue.count = worker->head = 0;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        // steal breadth-first from the others, where the larger subtrees are
+        for (size_t k = 1; !path && k < walk->worker_count; k++) {
+            WalkWorker *victim = &walk->workers[(id + k) % walk->worker_count];
+            pthread_mutex_lock(&victim->lock);
+            if (victim->queue.count > victim->head) {
+                path = victim->queue.data[victim->head++];
+            }
+            pthread_mutex_unlock(&victim->lock);
+        }
+        if (path) { return path; }
+
+        // sleep until something is queued or the walk ends
+        pthread_mutex_lock(&walk->lock);
+        while (walk->pending > 0 && !walk->failed && walk->pushes == pushes) {
+            pthread_cond_wait(&walk->wake, &walk->lock);
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+static void *walk_worker(void *arg) {
+    Walk *walk = arg;
+    size_t id = __atomic_fetch_add(&walk->next_worker, 1, __ATOMIC_RELAXED);
+    WalkWorker *worker = &walk->workers[id];
+
+    char *path;
+    while ((path = walk_take(worker)) != NULL) {
+        FilenameList subdirs;
+        FilenameList_init(&subdirs);
+        bool success = directory_scan(
+            walk->dir_fd, path, worker->buffer, walk->buffer_size,
+            walk->delete_char, &worker->arena, &worker->names, &worker->ids,
+            &subdirs);
+        for (size_t i = 0; i < subdirs.count; i++) {
+            walk_push(worker, subdirs.data[i]);
+        }
+        FilenameList_free(&subdirs);
+
+        pthread_mutex_lock(&walk->lock);
+        walk->pending--;
+        if (!success) { walk->failed = true; }
+        if (walk->pending == 0 || walk->failed) {
+            pthread_cond_broadcast(&walk->wake);
+        }
+        pthread_mutex_unlock(&walk->lock);
+    }
+    return NULL;
+}
+
+// Lists the trees below directories roots (relative to dir_fd) on
+// thread_count threads, adding every regular file, symbolic link and
+// directory in them to names, and their inodes to ids. Names are relative to
+// dir_fd, and owned by arena.
+// returns whether successful
+bool walk_run(int dir_fd, FilenameList *roots, size_t thread_count,
+              const Arguments *arguments, Arena *arena, FilenameList *names,
+              FileIdList *ids) {
+    Walk walk = {.dir_fd = dir_fd,
+                 .buffer_size = arguments->scan_buffer,
+                 .delete_char = arguments->delete_char,
+                 .worker_count = thread_count,
+                 .next_worker = 0,
+                 .pending = 0,
+                 .pushes = 0,
+                 .failed = false};
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.wake, NULL);
+
+    walk.workers = calloc(thread_count, sizeof(WalkWorker));
+    for (size_t t = 0; t < thread_count; t++) {
+        WalkWorker *worker = &walk.workers[t];
+        worker->walk = &walk;
+        pthread_mutex_init(&worker->lock, NULL);
+        FilenameList_init(&worker->queue);
+        FilenameList_init(&worker->names);
+        FileIdList_init(&worker->ids);
+        worker->buffer = malloc(walk.buffer_size);
+        if (!worker->buffer) {
+            perror("malloc");
+            walk.failed = true;
+        }
+    }
+    for (size_t i = 0; i < roots->count; i++) {
+        walk_push(&walk.workers[0], roots->data[i]);
+    }
+
+    pool_run(walk_worker, &walk, thread_count);
+
+    // hand over what the workers found, arena blocks included
+    for (size_t t = 0; t < thread_count; t++) {
+        WalkWorker *worker = &walk.workers[t];
+        for (size_t i = 0; i < worker->names.count; i++) {
+            FilenameList_add(names, worker->names.data[i]);
+            FileIdList_add(ids, worker->ids.data[i]);
+        }
+        arena_merge(arena, &worker->arena);
+        FilenameList_free(&worker->queue);
+        FilenameList_free(&worker->names);
+        FileIdList_free(&worker->ids);
+        free(worker->buffer);
+        pthread_mutex_destroy(&worker->lock);
+    }
+
+    free(walk.workers);
+    pthread_cond_destroy(&walk.wake);
+    pthread_mutex_destroy(&walk.lock);
+    return !walk.failed;
+}
+
+// ===== TRANSFORM =============================================================
+
+// appends size bytes of data to buffer
+void char_buffer_append(CharBuffer *buffer, const char *data, size_t size) {
+    if (size == 0) { return; }
+    if (buffer->count + size > buffer->capacity) {
+        buffer->capacity = 2 * (buffer->count + size);
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    memcpy(buffer->data + buffer->count, data, size);
+    buffer->count += size;
+}
+
+// zero-pads every run of digits from start to the end of buffer to width
+void numbers_pad(CharBuffer *buffer, size_t start, size_t width) {
+    size_t size = buffer->count - start;
+    char *text = malloc(size);
+    memcpy(text, buffer->data + start, size);
+    buffer->count = start;
+
+    for (size_t i = 0; i < size;) {
+        size_t run = 0;
+        while (i + run < size && text[i + run] >= '0' && text[i + run] <= '9') {
+            run++;
+        }
+        if (run == 0) {
+            char_buffer_append(buffer, text + i++, 1);
+            continue;
+        }
+        for (size_t pad = run; pad < width; pad++) {
+            char_buffer_append(buffer, "0", 1);
+        }
+        char_buffer_append(buffer, text + i, run);
+        i += run;
+    }
+    free(text);
+}
+
+// Expands template for the file named leaf at position index of the list
+// into out. Fields are {name}, {stem} (name up to its last dot), {ext} (after
+// it) and {n} (position from 1), each optionally followed by modifiers
+// ':lower', ':upper' or ':W' (zero-pad numbers to W digits). '{{' and '}}'
+// stand for braces.
+// returns whether template is valid
+bool template_expand(const char *template, const char *leaf, size_t index,
+                     CharBuffer *out) {
+    const char *dot = strrchr(leaf, '.');
+    size_t leaf_len = strlen(leaf);
+    size_t stem_len = dot && dot != leaf ? (size_t)(dot - leaf) : leaf_len;
+
+    for (const char *c = template; *c; c++) {
+        if ((c[0] == '{' || c[0] == '}') && c[1] == c[0]) {
+            char_buffer_append(out, c++, 1);
+            continue;
+        }
+        if (*c != '{') {
+            char_buffer_append(out, c, 1);
+            continue;
+        }
+
+        const char *end = strchr(c, '}');
+        if (!end) {
+            fprintf(stderr, "Error: Unterminated field in template '%s'.\n",
+                    template);
+            return false;
+        }
+
+        const char *field = c + 1;
+        size_t field_len = strcspn(field, ":}");
+        size_t start = out->count;
+        if (field_len == 4 && strncmp(field, "name", 4) == 0) {
+            char_buffer_append(out, leaf, leaf_len);
+        } else if (field_len == 4 && strncmp(field, "stem", 4) == 0) {
+            char_buffer_append(out, leaf, stem_len);
+        } else if (field_len == 3 && strncmp(field, "ext", 3) == 0) {
+            if (stem_len < leaf_len) {
+                char_buffer_append(out, leaf + stem_len + 1,
+                                   leaf_len - stem_len - 1);
+            }
+        } else if (field_len == 1 && field[0] == 'n') {
+            char number[24];
+            int len = snprintf(number, sizeof(number), "%zu", index + 1);
+            char_buffer_append(out, number, len);
+        } else {
+            fprintf(stderr, "Error: Unknown template field '%.*s'.\n",
+                    (int)field_len, field);
+            return false;
+        }
+
+        for (const char *m = field + field_len; m < end;) {
+            m++; // skip ':'
+            size_t m_len = strcspn(m, ":}");
+            size_t digits = strspn(m, "0123456789");
+            if (m_len == 5 && strncmp(m, "lower", 5) == 0) {
+                for (size_t i = start; i < out->count; i++) {
+                    char ch = out->data[i];
+                    if (ch >= 'A' && ch <= 'Z') { out->data[i] = ch + 32; }
+                }
+            } else if (m_len == 5 && strncmp(m, "upper", 5) == 0) {
+                for (size_t i = start; i < out->count; i++) {
+                    char ch = out->data[i];
+                    if (ch >= 'a' && ch <= 'z') { out->data[i] = ch - 32; }
+                }
+            } else if (m_len > 0 && m_len <= 3 && digits == m_len) {
+                numbers_pad(out, start, strtoul(m, NULL, 10));
+            } else {
+                fprintf(stderr, "Error: Unknown template modifier '%.*s'.\n",
+                        (int)m_len, m);
+                return false;
+            }
+            m += m_len;
+        }
+        c = end;
+    }
+    return true;
+}
+
+// Replaces the first match of re in leaf (every match if transform->global)
+// with the replacement, where '&' and '\0' stand for the match and '\1' to
+// '\9' for its groups. The result is appended to out.
+void subst_apply(const Transform *transform, const regex_t *re,
+                 const char *leaf, CharBuffer *out) {
+    regmatch_t match[10];
+    size_t len = strlen(leaf);
+    size_t pos = 0;
+    int eflags = 0;
+
+    while (pos <= len && regexec(re, leaf + pos, 10, match, eflags) == 0) {
+        const char *base = leaf + pos;
+        char_buffer_append(out, base, match[0].rm_so);
+
+        for (const char *r = transform->replacement; *r; r++) {
+            int group = -1;
+            if (*r == '&') {
+                group = 0;
+            } else if (r[0] == '\\' && r[1] >= '0' && r[1] <= '9') {
+                group = *++r - '0';
+            } else if (r[0] == '\\' && r[1] != '\0') {
+                r++;
+            }
+
+            if (group < 0) {
+                char_buffer_append(out, r, 1);
+            } else if (match[group].rm_so >= 0) {
+                char_buffer_append(out, base + match[group].rm_so,
+                                   match[group].rm_eo - match[group].rm_so);
+            }
+        }
+
+        // an empty match keeps the character after it, so the scan advances
+        size_t advance = match[0].rm_eo;
+        if (match[0].rm_eo == match[0].rm_so) {
+            if (pos + advance < len) {
+                char_buffer_append(out, base + advance, 1);
+            }
+            advance++;
+        }
+        pos += advance;
+        eflags = REG_NOTBOL;
+        if (!transform->global) { break; }
+    }
+
+    if (pos < len) { char_buffer_append(out, leaf + pos, len - pos); }
+}
+
+// Parses --subst and checks --template of arguments into transform.
+// --subst takes the form s/REGEX/REPLACEMENT/FLAGS, where any character may
+// stand in for '/' and FLAGS are 'g' (replace every match) and 'i' (ignore
+// case). The regular expression is extended POSIX syntax.
+// returns whether successful
+bool transform_init(Transform *transform, const Arguments *arguments) {
+    transform->template = arguments->template;
+    if (transform->template) {
+        CharBuffer check;
+        CharBuffer_init(&check);
+        bool valid = template_expand(transform->template, "name.ext", 0,
+                                     &check);
+        CharBuffer_free(&check);
+        if (!valid) { return false; }
+    }
+
+    const char *expression = arguments->subst;
+    if (!expression) { return true; }
+    if (expression[0] != 's' || expression[1] == '\0' ||
+        expression[1] == '\\') {
+        fprintf(stderr,
+                "Error: Invalid substitution '%s', expected "
+                "s/REGEX/REPLACEMENT/FLAGS.\n",
+                expression);
+        return false;
+    }
+
+    // split into fields in place, where an escaped delimiter stands for itself
+    char delimiter = expression[1];
+    char *fields = strdup(expression + 2);
+    char *field_starts[3] = {fields, NULL, NULL};
+    size_t field = 0;
+    char *dst = fields;
+    for (const char *src = fields; *src; src++) {
+        if (field < 2 && src[0] == '\\' && src[1] == delimiter) {
+            *dst++ = *++src;
+        } else if (field < 2 && *src == delimiter) {
+            *dst++ = '\0';
+            field_starts[++field] = dst;
+        } else {
+            *dst++ = *src;
+        }
+    }
+    *dst = '\0';
+    transform->pattern = fields;
+
+    if (field < 2) {
+        fprintf(stderr,
+                "Error: Invalid substitution '%s', expected "
+                "s/REGEX/REPLACEMENT/FLAGS.\n",
+                expression);
+        return false;
+    }
+    transform->replacement = field_starts[1];
+
+    transform->cflags = REG_EXTENDED;
+    for (const char *flag = field_starts[2]; *flag; flag++) {
+        if (*flag == 'g') {
+            transform->global = true;
+        } else if (*flag == 'i') {
+            transform->cflags |= REG_ICASE;
+        } else {
+            fprintf(stderr, "Error: Unknown substitution flag '%c'.\n", *flag);
+            return false;
+        }
+    }
+
+    regex_t re;
+    int error = regcomp(&re, transform->pattern, transform->cflags);
+    if (error != 0) {
+        char message[256];
+        regerror(error, &re, message, sizeof(message));
+        fprintf(stderr, "Error: Invalid regular expression '%s': %s.\n",
+                transform->pattern, message);
+        return false;
+    }
+    size_t groups = re.re_nsub;
+    regfree(&re);
+
+    for (const char *r = transform->replacement; *r; r++) {
+        if (r[0] != '\\' || r[1] == '\0') { continue; }
+        r++;
+        if (*r >= '1' && *r <= '9' && (size_t)(*r - '0') > groups) {
+            fprintf(stderr,
+                    "Error: Replacement refers to group \\%c, which the "
+                    "regular expression does not have.\n",
+                    *r);
+            return false;
+        }
+    }
+    return true;
+}
+
+void transform_free(Transform *transform) {
+    if (transform->pattern) { free(transform->pattern); }
+}
+
+// new name of name (at position index of the list) into out, NUL-terminated;
+// only the last path component is transformed
+// returns the length of the new last component
+size_t transform_apply(const Transform *transform, const regex_t *re,
+                       const char *name, size_t index, CharBuffer *out,
+                       CharBuffer *scratch) {
+    const char *slash = strrchr(name, '/');
+    const char *leaf = slash ? slash + 1 : name;
+    out->count = 0;
+    char_buffer_append(out, name, leaf - name);
+
+    if (re) {
+        scratch->count = 0;
+        subst_apply(transform, re, leaf, scratch);
+        char_buffer_append(scratch, "", 1);
+        leaf = scratch->data;
+    }
+    if (transform->template) {
+        template_expand(transform->template, leaf, index, out);
+    } else {
+        char_buffer_append(out, leaf, strlen(leaf));
+    }
+
+    size_t leaf_len = out->count - (slash ? slash + 1 - name : 0);
+    char_buffer_append(out, "", 1);
+    return leaf_len;
+}
+
+// entries [begin, end) of a transform run on one thread
+typedef struct {
+    const Transform *transform;
+    const regex_t *re; // compiled for this chunk alone
+    char **names;
+    char **results;
+    size_t begin;
+    size_t end;
+    Arena arena;   // owns the results
+    size_t failed; // first entry with an empty new name, or INDEX_NONE
+} TransformChunk;
+
+#define TRANSFORM_CHUNK_MIN 16384
+
+static void *transform_worker(void *arg) {
+    TransformChunk *chunk = arg;
+    CharBuffer out, scratch;
+    CharBuffer_init(&out);
+    CharBuffer_init(&scratch);
+
+    for (size_t i = chunk->begin; i < chunk->end; i++) {
+        size_t len = transform_apply(chunk->transform, chunk->re,
+                                     chunk->names[i], i, &out, &scratch);
+        if (len == 0) {
+            chunk->failed = i;
+            break;
+        }
+        char *result = arena_alloc(&chunk->arena, out.count);
+        chunk->results[i] = memcpy(result, out.data, out.count);
+    }
+
+    CharBuffer_free(&out);
+    CharBuffer_free(&scratch);
+    return NULL;
+}
+
+// Gives the new name of every entry of names by transform into results, on up
+// to thread_count threads for long lists. New names are owned by arena.
+// returns whether successful
+bool transform_run(const Transform *transform, const FilenameList *names,
+                   size_t thread_count, Arena *arena, FilenameList *results) {
+    size_t count = names->count;
+    for (size_t i = 0; i < count; i++) {
+        FilenameList_add(results, NULL);
+    }
+
+    size_t chunk_count =
+        (count + TRANSFORM_CHUNK_MIN - 1) / TRANSFORM_CHUNK_MIN;
+    if (chunk_count > thread_count) { chunk_count = thread_count; }
+    if (chunk_count == 0) { chunk_count = 1; }
+
+    // regexec() locks its compiled expression, so every chunk compiles its own
+    TransformChunk *chunks = calloc(chunk_count, sizeof(TransformChunk));
+    regex_t *res = calloc(chunk_count, sizeof(regex_t));
+    bool success = true;
+    size_t compiled = 0;
+    for (; transform->pattern && compiled < chunk_count; compiled++) {
+        if (regcomp(&res[compiled], transform->pattern, transform->cflags) !=
+            0) {
+            fprintf(stderr, "Error: Could not compile regular expression.\n");
+            success = false;
+            break;
+        }
+    }
+
+    for (size_t c = 0; success && c < chunk_count; c++) {
+        chunks[c] = (TransformChunk){.transform = transform,
+                                     .re = transform->pattern ? &res[c] : NULL,
+                                     .names = names->data,
+                                     .results = results->data,
+                                     .begin = count * c / chunk_count,
+                                     .end = count * (c + 1) / chunk_count,
+                                     .arena = {.head = NULL},
+                                     .failed = INDEX_NONE};
+    }
+
+    // the main thread takes the first chunk
+    pthread_t *threads = malloc(chunk_count * sizeof(pthread_t));
+    bool *started = calloc(chunk_count, sizeof(bool));
+    for (size_t c = 1; success && c < chunk_count; c++) {
+        started[c] = pthread_create(&threads[c], NULL, transform_worker,
+                                    &chunks[c]) == 0;
+    }
+    if (success) { transform_worker(&chunks[0]); }
+    for (size_t c = 1; success && c < chunk_count; c++) {
+        if (started[c]) {
+            pthread_join(threads[c], NULL);
+        } else {
+            transform_worker(&chunks[c]);
+        }
+    }
+
+    for (size_t c = 0; c < chunk_count; c++) {
+        if (success && chunks[c].failed != INDEX_NONE) {
+            fprintf(stderr, "Error: Transforming '%s' gives an empty name.\n",
+                    names->data[chunks[c].failed]);
+            success = false;
+        }
+        arena_merge(arena, &chunks[c].arena);
+    }
+
+    for (size_t c = 0; c < compiled; c++) {
+        regfree(&res[c]);
+    }
+    free(started);
+    free(threads);
+    free(res);
+    free(chunks);
+    return success;
+}
+
+// ===== TRASH =================================================================
+
+// creates directory (and missing parents) with given mode, like mkdir -p
+bool directory_create_all(const char *path, mode_t mode) {
+    char *copy = strdup(path);
+    for (char *p = copy + 1; *p; p++) {
+        if (*p != '/') { continue; }
+        *p = '\0';
+        if (mkdir(copy, mode) != 0 && errno != EEXIST) {
+            free(copy);
+            return false;
+        }
+        *p = '/';
+    }
+    bool success = mkdir(copy, mode) == 0 || errno == EEXIST;
+    free(copy);
+    return success;
+}
+
+// opens trash directory at path, creating its "files" and "info"
+// subdirectories if needed
+TrashDir *trash_dir_open(const char *path, dev_t dev, const char *top_dir) {
+    if (!directory_create_all(path, 0700)) { return NULL; }
+
+    int trash_fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (trash_fd < 0) { return NULL; }
+
+    mkdirat(trash_fd, "files", 0700);
+    mkdirat(trash_fd, "info", 0700);
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    int files_fd = openat(trash_fd, "files", flags);
+    int info_fd = openat(trash_fd, "info", flags);
+    close(trash_fd);
+
+    if (files_fd < 0 || info_fd < 0) {
+        if (files_fd >= 0) { close(files_fd); }
+        if (info_fd >= 0) { close(info_fd); }
+        return NULL;
+    }
+
+    TrashDir *td = malloc(sizeof *td);
+    *td = (TrashDir){.dev = dev,
+                     .path = strdup(path),
+                     .files_fd = files_fd,
+                     .info_fd = info_fd,
+                     .top_dir = top_dir ? strdup(top_dir) : NULL};
+    return td;
+}
+
+// finds mount point of filesystem dev that contains path (absolute)
+char *mount_point_find(const char *path, dev_t dev) {
+    char *top = strdup(path);
+
+    for (;;) {
+        char *slash = strrchr(top, '/');
+        if (slash == top && top[1] == '\0') { break; } // reached "/"
+
+        char *parent = strndup(top, slash == top ? 1 : slash - top);
+        struct stat st;
+        if (stat(parent, &st) != 0 || st.st_dev != dev) {
+            free(parent);
+            break;
+        }
+        free(top);
+        top = parent;
+    }
+    return top;
+}
+
+// returns trash directory for files on filesystem dev, resolving it on first
+// use (home trash if on the same filesystem, otherwise $topdir/.Trash/$uid or
+// $topdir/.Trash-$uid)
+TrashDir *trash_dir_get(Trash *trash, dev_t dev, const char *file_path) {
+    for (size_t i = 0; i < trash->dirs.count; i++) {
+        if (trash->dirs.data[i]->dev == dev) { return trash->dirs.data[i]; }
+    }
+
+    char path[4096];
+    TrashDir *td = NULL;
+
+    // home trash
+    const char *data_home = getenv("XDG_DATA_HOME");
+    const char *home = getenv("HOME");
+    if (data_home && data_home[0] == '/') {
+        snprintf(path, sizeof(path), "%s/Trash", data_home);
+    } else if (home) {
+        snprintf(path, sizeof(path), "%s/.local/share/Trash", home);
+    } else {
+        path[0] = '\0';
+    }
+
+    struct stat st;
+    if (path[0] && directory_create_all(path, 0700) && stat(path, &st) == 0 &&
+        st.st_dev == dev) {
+        td = trash_dir_open(path, dev, NULL);
+    }
+
+    // trash at top of the file's filesystem
+    if (!td) {
+        char *top_dir = mount_point_find(file_path, dev);
+        const char *sep = strcmp(top_dir, "/") == 0 ? "" : "/";
+        unsigned uid = (unsigned)getuid();
+
+        // shared $topdir/.Trash must be a sticky directory, not a symlink
+        snprintf(path, sizeof(path), "%s%s.Trash", top_dir, sep);
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode) &&
+            (st.st_mode & S_ISVTX)) {
+            snprintf(path, sizeof(path), "%s%s.Trash/%u", top_dir, sep, uid);
+            td = trash_dir_open(path, dev, top_dir);
+        }
+        if (!td) {
+            snprintf(path, sizeof(path), "%s%s.Trash-%u", top_dir, sep, uid);
+            td = trash_dir_open(path, dev, top_dir);
+        }
+        free(top_dir);
+    }
+
+    if (td) { TrashDirList_add(&trash->dirs, td); }
+    return td;
+}
+
+// percent-encodes path for the Path key of a .trashinfo file
+void trash_path_encode(FILE *file, const char *path) {
+    for (const unsigned char *c = (const unsigned char *)path; *c; c++) {
+        if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+            (*c >= '0' && *c <= '9') || strchr("/-_.~", *c)) {
+            fputc(*c, file);
+        } else {
+            fprintf(file, "%%%02X", *c);
+        }
+    }
+}
+
+// moves file (relative to target directory) to trash: a .trashinfo file
+// recording its location is written, then the file is renamed into the trash
+// returns whether successful
+bool trash_file(Trash *trash, const char *filename) {
+    char file_path[4096];
+    snprintf(file_path, sizeof(file_path), "%s/%s", trash->dir_path, filename);
+
+    struct stat st;
+    TrashDir *td = NULL;
+    stats_count(CALL_STAT);
+    if (fstatat(trash->dir_fd, filename, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        td = trash_dir_get(trash, st.st_dev, file_path);
+    }
+    if (!td) {
+        output_flush();
+        perror("trash");
+        fprintf(stderr, "Error: Could not find trash directory for '%s'.\n",
+                filename);
+        return false;
+    }
+
+    // path recorded relative to top directory for non-home trash
+    const char *recorded_path = file_path;
+    if (td->top_dir) {
+        size_t top_len = strlen(td->top_dir);
+        recorded_path = file_path + (top_len > 1 ? top_len : 0) + 1;
+    }
+
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+
+    char deletion_date[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(deletion_date, sizeof(deletion_date), "%Y-%m-%dT%H:%M:%S",
+             localtime_r(&now, &tm));
+
+    // creating the .trashinfo file claims the name, retry with a suffix until
+    // neither it nor the file in files/ exists
+    for (int n = 1;; n++) {
+        char trash_name[512];
+        char info_name[600];
+        if (n == 1) {
+            snprintf(trash_name, sizeof(trash_name), "%s", base);
+        } else {
+            snprintf(trash_name, sizeof(trash_name), "%s.%d", base, n);
+        }
+        snprintf(info_name, sizeof(info_name), "%s.trashinfo", trash_name);
+
+        int info_fd = openat(td->info_fd, info_name,
+                             O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (info_fd < 0) {
+            if (errno == EEXIST) { continue; }
+            output_flush();
+            perror("openat");
+            fprintf(stderr, "Error: Could not trash file '%s'.\n", filename);
+            return false;
+        }
+
+        FILE *info = fdopen(info_fd, "w");
+        fprintf(info, "[Trash Info]\nPath=");
+        trash_path_encode(info, recorded_path);
+        fprintf(info, "\nDeletionDate=%s\n", deletion_date);
+        if (fclose(info) != 0) {
+            output_flush();
+            perror("write");
+            unlinkat(td->info_fd, info_name, 0);
+            fprintf(stderr, "Error: Could not trash file '%s'.\n", filename);
+            return false;
+        }
+
+        stats_count(CALL_RENAME);
+        int result = renameat2(trash->dir_fd, filename, td->files_fd,
+                               trash_name, RENAME_NOREPLACE);
+        if (result != 0 && (errno == EINVAL || errno == ENOSYS)) {
+            result = renameat(trash->dir_fd, filename, td->files_fd,
+                              trash_name);
+        }
+        if (result == 0) {
+            // kept for the undo record of the run
+            size_t size = strlen(td->path) + strlen(trash_name) + 8;
+            char *trashed_path = arena_alloc(&trash->arena, size);
+            snprintf(trashed_path, size, "%s/files/%s", td->path, trash_name);
+            FilenameList_add(&trash->trashed,
+                             arena_strdup(&trash->arena, filename));
+            FilenameList_add(&trash->trashed, trashed_path);
+            return true;
+        }
+
+        int error = errno;
+        unlinkat(td->info_fd, info_name, 0);
+        if (error == EEXIST) { continue; }
+
+        output_flush();
+        errno = error;
+        perror("rename");
+        fprintf(stderr, "Error: Could not trash file '%s'.\n", filename);
+        return false;
+    }
+}
+
+// removes the .trashinfo file of a file restored from trashed_path, as
+// TRASH/files/NAME is described by TRASH/info/NAME.trashinfo
+void trash_info_remove(const char *trashed_path) {
+    const char *name = strrchr(trashed_path, '/');
+    if (!name || name - trashed_path < 6) { return; }
+    size_t trash_len = name - trashed_path - 6; // "/files"
+
+    char info_path[PATH_MAX];
+    snprintf(info_path, sizeof(info_path), "%.*s/info%s.trashinfo",
+             (int)trash_len, trashed_path, name);
+    unlink(info_path);
+}
+
+void trash_close(Trash *trash) {
+    for (size_t i = 0; i < trash->dirs.count; i++) {
+        TrashDir *td = trash->dirs.data[i];
+        close(td->files_fd);
+        close(td->info_fd);
+        if (td->top_dir) { free(td->top_dir); }
+        free(td->path);
+        free(td);
+    }
+    TrashDirList_free(&trash->dirs);
+    FilenameList_free(&trash->trashed);
+    arena_free(&trash->arena);
+    if (trash->dir_path) { free(trash->dir_path); }
+}
+
+// ===== PLANNING ==============================================================
+
+void plan_init(Plan *plan, RenameTable *table) {
+    memset(plan, 0, sizeof(*plan));
+    plan->table = table;
+}
+
+void plan_add(Plan *plan, OpKind kind, RenameStep step, size_t entry,
+              size_t component) {
+    if (plan->count >= plan->capacity) {
+        plan->capacity = plan->capacity ? plan->capacity * 2 : 64;
+        plan->kinds = realloc(plan->kinds, plan->capacity);
+        plan->steps = realloc(plan->steps, plan->capacity);
+        plan->entries =
+            realloc(plan->entries, plan->capacity * sizeof(uint32_t));
+        plan->components =
+            realloc(plan->components, plan->capacity * sizeof(uint32_t));
+    }
+    plan->kinds[plan->count] = kind;
+    plan->steps[plan->count] = step;
+    plan->entries[plan->count] = entry;
+    plan->components[plan->count] = component;
+    plan->count++;
+}
+
+void plan_free(Plan *plan) {
+    free(plan->kinds);
+    free(plan->steps);
+    free(plan->entries);
+    free(plan->components);
+    free(plan->phase_ends);
+}
+
+// filename before operation i
+static inline const char *plan_src(const Plan *plan, size_t i) {
+    size_t entry = plan->entries[i];
+    if (plan->steps[i] == STEP_FROM_TEMP) {
+        return plan->table->temp_names[entry];
+    }
+    return plan->table->initial_names[entry];
+}
+
+// filename after operation i (renames, exchanges and staged deletions)
+static inline const char *plan_dst(const Plan *plan, size_t i) {
+    size_t entry = plan->entries[i];
+    if (plan->steps[i] == STEP_TO_TEMP) {
+        return plan->table->temp_names[entry];
+    }
+    return plan->table->new_names[entry];
+}
+
+// position of the level of entry i in planning order, deepest level first
+static inline uint32_t plan_level(const RenameTable *table, size_t i,
+                                  uint32_t level_count) {
+    return table->depths ? level_count - 1 - table->depths[i] : 0;
+}
+
+// ends the current phase of plan, if it has any operations
+void plan_phase_end(Plan *plan) {
+    size_t begin = plan->phase_count ? plan->phase_ends[plan->phase_count - 1]
+                                     : 0;
+    if (plan->count == begin) { return; }
+    plan->phase_ends = realloc(plan->phase_ends,
+                               (plan->phase_count + 1) * sizeof(size_t));
+    plan->phase_ends[plan->phase_count++] = plan->count;
+}
+
+// entry of the directory holding entry i, INDEX_NONE if it is not listed
+static size_t plan_parent(const RenameTable *table,
+                          const NameIndex *initial_index, size_t i) {
+    const char *name = table->initial_names[i];
+    const char *slash = strrchr(name, '/');
+    if (!slash) { return INDEX_NONE; }
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%.*s", (int)(slash - name), name);
+    return name_index_find(initial_index, parent, name_hash(parent));
+}
+
+// marks the directories of table that renamed entries leave, at any depth
+// below them
+void plan_emptied_mark(RenameTable *table, const NameIndex *initial_index,
+                       char delete_char) {
+    table->emptied = calloc(table->count, sizeof(bool));
+    for (size_t i = 0; i < table->count; i++) {
+        if (table->new_names[i][0] == delete_char ||
+            strcmp(table->initial_names[i], table->new_names[i]) == 0) {
+            continue;
+        }
+        // ancestors are marked up to one that already is
+        for (size_t p = plan_parent(table, initial_index, i);
+             p != INDEX_NONE && !table->emptied[p];
+             p = plan_parent(table, initial_index, p)) {
+            table->emptied[p] = true;
+        }
+    }
+}
+
+// Orders the operations that turn the initial names of table into its new
+// names. initial_index indexes the initial names.
+//
+// Every entry renames one file and output names are unique, so the rename
+// graph (an edge from each file to the input file whose name it takes) is a
+// set of disjoint chains and cycles. Deletions come first, as they free names
+// that other files may take, and move files into the staging directory (under
+// a temporary name stored in the table) for the reaper to unlink later.
+// Chains are then run from their free end so that no file is ever moved out
+// of the way. Two-file cycles are swapped in place
+// and only longer cycles need a temporary name, which is stored in the table.
+//
+// With table->depths, entries are planned one nesting level at a time, deepest
+// first, so that the contents of a directory are handled before it is renamed
+// or removed. Each level is a phase, and the graph only links entries of the
+// same level.
+// returns whether successful
+bool plan_build(Plan *plan, const NameIndex *initial_index,
+                const Arguments *arguments, Staging *staging, Arena *arena) {
+    RenameTable *table = plan->table;
+    bool success = true;
+    size_t count = table->count;
+    size_t component = 0;
+
+    // target[i] is the input file whose name file i takes,
+    // pred[i] is the input file that takes the name of file i
+    // (INDEX_NONE if there is none)
+    size_t *target = malloc(count * sizeof(size_t));
+    size_t *pred = malloc(count * sizeof(size_t));
+    bool *planned = calloc(count, sizeof(bool));
+
+    // entries ordered by level, deepest first, and where each level starts
+    uint32_t level_count = 1;
+    for (size_t i = 0; table->depths && i < count; i++) {
+        if (table->depths[i] + 1 > level_count) {
+            level_count = table->depths[i] + 1;
+        }
+    }
+    size_t *level_starts = calloc(level_count + 1, sizeof(size_t));
+    size_t *order = malloc(count * sizeof(size_t));
+    for (size_t i = 0; i < count; i++) {
+        level_starts[plan_level(table, i, level_count) + 1]++;
+    }
+    for (uint32_t l = 0; l < level_count; l++) {
+        level_starts[l + 1] += level_starts[l];
+    }
+    for (size_t i = 0; i < count; i++) {
+        order[level_starts[plan_level(table, i, level_count)]++] = i;
+    }
+    for (uint32_t l = level_count; l > 0; l--) {
+        level_starts[l] = level_starts[l - 1];
+    }
+    level_starts[0] = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        target[i] = INDEX_NONE;
+        pred[i] = INDEX_NONE;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        char *new_name = table->new_names[i];
+
+        if (strcmp(table->initial_names[i], new_name) == 0) {
+            planned[i] = true;
+            continue;
+        }
+        if (new_name[0] == arguments->delete_char) { continue; }
+
+        uint64_t hash = name_hash(new_name);
+        size_t t = name_index_find(initial_index, new_name, hash);
+        if (t != INDEX_NONE &&
+            (!table->depths || table->depths[t] == table->depths[i])) {
+            target[i] = t;
+            pred[t] = i;
+        }
+    }
+
+    // directories with listed contents are removed in place once emptied, as
+    // the reaper could not tell their unlisted contents from deleted ones
+    bool *has_contents = calloc(count, sizeof(bool));
+    for (size_t i = 0; table->depths && i < count; i++) {
+        size_t p = plan_parent(table, initial_index, i);
+        if (p != INDEX_NONE) { has_contents[p] = true; }
+    }
+
+    // deletions of all levels, except those of directories that other files
+    // are renamed out of, which wait until the renames of deeper levels ran
+    for (uint32_t l = 0; success && l < level_count; l++) {
+        for (size_t k = level_starts[l]; k < level_starts[l + 1]; k++) {
+            size_t i = order[k];
+            if (planned[i] ||
+                table->new_names[i][0] != arguments->delete_char ||
+                (table->emptied && table->emptied[i])) {
+                continue;
+            }
+            if (arguments->trash || has_contents[i]) {
+                plan_add(plan, arguments->trash ? OP_TRASH : OP_DELETE,
+                         STEP_DIRECT, i, component++);
+                continue;
+            }
+
+            char temp_name[96];
+            if (!staging_temp_name(staging, temp_name, sizeof(temp_name))) {
+                success = false;
+                break;
+            }
+            table->temp_names[i] = arena_strdup(arena, temp_name);
+            plan_add(plan, OP_DELETE, STEP_TO_TEMP, i, component++);
+        }
+        plan_phase_end(plan);
+    }
+
+    for (uint32_t l = 0; success && l < level_count; l++) {
+        size_t begin = level_starts[l], end = level_starts[l + 1];
+
+        // deleted directories that deeper levels have renamed files out of,
+        // before this level takes their names
+        for (size_t k = begin; k < end; k++) {
+            size_t i = order[k];
+            if (planned[i] || !table->emptied || !table->emptied[i] ||
+                table->new_names[i][0] != arguments->delete_char) {
+                continue;
+            }
+            plan_add(plan, arguments->trash ? OP_TRASH : OP_DELETE,
+                     STEP_DIRECT, i, component++);
+        }
+        plan_phase_end(plan);
+
+        // chains, starting from the file whose new name is free
+        for (size_t k = begin; k < end; k++) {
+            size_t i = order[k];
+            if (planned[i] || target[i] != INDEX_NONE) { continue; }
+
+            bool deleted = table->new_names[i][0] == arguments->delete_char;
+            for (size_t j = deleted ? pred[i] : i; j != INDEX_NONE;
+                 j = pred[j]) {
+                plan_add(plan, OP_RENAME, STEP_DIRECT, j, component);
+                planned[j] = true;
+            }
+            planned[i] = true;
+            component++;
+        }
+
+        // what remains are cycles, move one file aside and run the rest as a
+        // chain
+        for (size_t k = begin; k < end; k++) {
+            size_t i = order[k];
+            if (planned[i]) { continue; }
+
+            if (pred[i] == target[i]) {
+                plan_add(plan, OP_EXCHANGE, STEP_DIRECT, i, component++);
+                planned[i] = true;
+                planned[pred[i]] = true;
+                continue;
+            }
+
+            char temp_name[96];
+            if (!staging_temp_name(staging, temp_name, sizeof(temp_name))) {
+                success = false;
+                break;
+            }
+            table->temp_names[i] = arena_strdup(arena, temp_name);
+
+            plan_add(plan, OP_RENAME, STEP_TO_TEMP, i, component);
+            planned[i] = true;
+            for (size_t j = pred[i]; j != i; j = pred[j]) {
+                plan_add(plan, OP_RENAME, STEP_DIRECT, j, component);
+                planned[j] = true;
+            }
+
+            plan_add(plan, OP_RENAME, STEP_FROM_TEMP, i, component++);
+        }
+        plan_phase_end(plan);
+    }
+
+    free(has_contents);
+    free(order);
+    free(level_starts);
+    free(target);
+    free(pred);
+    free(planned);
+    return success;
+}
+
+// entry of a directory newly named name and renamed after depth, or INDEX_NONE
+static size_t plan_renamed_dir(const RenameTable *table,
+                               const NameIndex *new_index, const char *name,
+                               uint32_t depth) {
+    size_t j = name_index_find(new_index, name, name_hash(name));
+    if (j == INDEX_NONE || table->depths[j] >= depth ||
+        strcmp(table->initial_names[j], table->new_names[j]) == 0) {
+        return INDEX_NONE;
+    }
+    return j;
+}
+
+// In recursive mode directories are renamed after their contents, so a renamed
+// directory takes its contents with it. Edited paths may also refer to a
+// directory by its new name, and are rewritten to the name the directory still
+// has when the entry itself is renamed. Unchanged entries follow their
+// directory. Renames onto names that are only freed later, or onto existing
+// files that are not inputs, are rejected.
+// new_index indexes the edited names.
+// returns whether successful
+bool plan_resolve_paths(RenameTable *table, const NameIndex *initial_index,
+                        const NameIndex *new_index, const Arguments *arguments,
+                        int dir_fd, Arena *arena) {
+    bool success = true;
+    size_t count = table->count;
+    char delete_char = arguments->delete_char;
+    size_t slots = count > 0 ? count : 1;
+    char **resolved = malloc(slots * sizeof(char *));
+    size_t *probed = malloc(slots * sizeof(size_t));
+    mode_t *types = malloc(slots * sizeof(mode_t));
+    if (!resolved || !probed || !types) {
+        perror("malloc");
+        free(resolved);
+        free(probed);
+        free(types);
+        return false;
+    }
+    // names_probe() reads none of these without entries, but the compiler
+    // cannot tell
+    resolved[0] = NULL;
+    probed[0] = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        char *new_name = table->new_names[i];
+        resolved[i] = new_name;
+        if (new_name[0] == delete_char ||
+            strcmp(table->initial_names[i], new_name) == 0) {
+            continue;
+        }
+
+        // walk the leading directories of the new name, tracking the name the
+        // directory they lead to has when entry i runs
+        size_t len = strlen(new_name);
+        char *text = strdup(new_name);
+        size_t current_cap = len + 1, current_len = 0;
+        char *current = malloc(current_cap);
+        bool rewritten = false;
+        size_t segment = 0; // start of the next component, with its slash
+
+        for (size_t k = 1; k < len; k++) {
+            if (text[k] != '/') { continue; }
+
+            size_t segment_len = k - segment;
+            if (current_len + segment_len + 1 > current_cap) {
+                current_cap = 2 * (current_len + segment_len + 1);
+                current = realloc(current, current_cap);
+            }
+            memcpy(current + current_len, text + segment, segment_len);
+            current_len += segment_len;
+            current[current_len] = '\0';
+
+            // by its new name, or by a new leaf in a directory already resolved
+            text[k] = '\0';
+            uint32_t depth = table->depths[i];
+            size_t j = plan_renamed_dir(table, new_index, text, depth);
+            if (j == INDEX_NONE && rewritten) {
+                j = plan_renamed_dir(table, new_index, current, depth);
+            }
+            text[k] = '/';
+            segment = k;
+
+            if (j != INDEX_NONE) {
+                const char *dir_name = table->initial_names[j];
+                current_len = strlen(dir_name);
+                if (current_len + 1 > current_cap) {
+                    current_cap = 2 * (current_len + 1);
+                    current = realloc(current, current_cap);
+                }
+                memcpy(current, dir_name, current_len + 1);
+                rewritten = true;
+            }
+        }
+
+        if (rewritten) {
+            size_t rest_len = len - segment;
+            char *path = arena_alloc(arena, current_len + rest_len + 1);
+            memcpy(path, current, current_len);
+            memcpy(path + current_len, text + segment, rest_len + 1);
+            resolved[i] = path;
+        }
+        free(current);
+        free(text);
+    }
+
+    // every conflict is reported, existing files are looked up all at once
+    size_t probe_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        const char *name = resolved[i];
+        if (name[0] == delete_char ||
+            strcmp(table->initial_names[i], name) == 0) {
+            continue;
+        }
+
+        size_t t = name_index_find(initial_index, name, name_hash(name));
+        if (t == INDEX_NONE) {
+            if (!arguments->force) { probed[probe_count++] = i; }
+        } else if (table->depths[t] != table->depths[i]) {
+            // other levels run as separate phases, deepest first, and
+            // directories that files are renamed out of are deleted at their
+            // own level
+            bool deeper = table->depths[t] > table->depths[i];
+            bool vacated =
+                (resolved[t][0] == delete_char &&
+                 (deeper || !table->emptied[t])) ||
+                (deeper && strcmp(table->initial_names[t], resolved[t]) != 0);
+            if (!vacated) {
+                fprintf(stderr,
+                        "Error: Cannot rename '%s' to '%s' before that file "
+                        "is moved away, rename them in separate runs.\n",
+                        table->initial_names[i], name);
+                success = false;
+            }
+        }
+    }
+
+    names_probe(dir_fd, resolved, probed, probe_count,
+                probe_thread_count(arguments), types, NULL);
+    for (size_t k = 0; k < probe_count; k++) {
+        if (types[k] != 0) {
+            fprintf(stderr, "Error: File '%s' already exists.\n",
+                    resolved[probed[k]]);
+            success = false;
+        }
+    }
+    free(types);
+    free(probed);
+
+    if (success) { memcpy(table->new_names, resolved, count * sizeof(char *)); }
+    free(resolved);
+    return success;
+}
+
+// ===== JOURNAL ===============================================================
+
+// Path of name in cbr's state directory ($XDG_STATE_HOME/cbr, by default
+// ~/.local/state/cbr), which is created if needed.
+// returns whether successful
+bool state_path(char *path, size_t size, const char *name) {
+    const char *state_home = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    int len;
+    if (state_home && state_home[0] == '/') {
+        len = snprintf(path, size, "%s/cbr", state_home);
+    } else if (home) {
+        len = snprintf(path, size, "%s/.local/state/cbr", home);
+    } else {
+        errno = ENOENT;
+        return false;
+    }
+    if (len < 0 || (size_t)len >= size || !directory_create_all(path, 0700)) {
+        return false;
+    }
+    size_t used = len;
+    len = snprintf(path + used, size - used, "/%s", name);
+    return len >= 0 && (size_t)len < size - used;
+}
+
+// file of the target directory in the state directory (its journal or the
+// socket of its daemon), named after its device and inode so that a later run
+// on the same directory finds it
+bool directory_state_path(int dir_fd, const char *extension, char *path,
+                          size_t size) {
+    struct stat st;
+    if (fstat(dir_fd, &st) != 0) { return false; }
+    char name[64];
+    snprintf(name, sizeof(name), "%lu-%lu.%s", (unsigned long)st.st_dev,
+             (unsigned long)st.st_ino, extension);
+    return state_path(path, size, name);
+}
+
+static const char journal_kinds[] = {[OP_RENAME] = 'R',
+                                     [OP_EXCHANGE] = 'X',
+                                     [OP_DELETE] = 'D',
+                                     [OP_TRASH] = 'T'};
+static const char journal_steps[] = {
+    [STEP_DIRECT] = 'D', [STEP_TO_TEMP] = 'T', [STEP_FROM_TEMP] = 'F'};
+
+// an interrupted run blocks new ones in the same directory
+static void journal_interrupted_print(const Arguments *arguments) {
+    fprintf(stderr,
+            "Error: An interrupted run was found in '%s', finish it with "
+            "--resume or undo it with --rollback.\n",
+            arguments->directory);
+}
+
+// finds the journal of the target directory, and fails if an interrupted run
+// left one behind. Without a state directory (no $HOME, or a read-only one)
+// the run goes unjournaled.
+// returns whether successful
+bool journal_check(Journal *journal, const Arguments *arguments) {
+    if (!directory_state_path(journal->dir_fd, "journal", journal->path,
+                              sizeof(journal->path))) {
+        perror("journal");
+        fprintf(stderr, "Warning: No state directory, running without a "
+                        "journal or undo record.\n");
+        journal->path[0] = '\0';
+        return true;
+    }
+    if (access(journal->path, F_OK) == 0) {
+        journal_interrupted_print(arguments);
+        return false;
+    }
+    return true;
+}
+
+// Writes the plan to a new journal before anything is executed, and makes it
+// durable. The journal is a sequence of NUL-terminated fields: a header
+// ("cbr-journal 1", flags, staging directory), one record per operation
+// (kind, step and component, e.g. "RD12", renames and exchanges add
+// ":INODE:DEVICE" of the file they move where known; then source and
+// destination), "P" once the plan is complete, "M<N>" markers once operations
+// [0, N) are durable, and "t<N>" records with the path in the trash of the
+// file trashed by operation N.
+// returns whether successful
+bool journal_begin(Journal *journal, const Plan *plan, const Staging *staging,
+                   const Arguments *arguments) {
+    if (journal->path[0] == '\0') { return true; }
+    int flags = O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC;
+    journal->fd = open(journal->path, flags, 0600);
+    if (journal->fd < 0) {
+        if (errno == EEXIST) {
+            journal_interrupted_print(arguments);
+        } else {
+            perror("open");
+            fprintf(stderr, "Error: Could not create journal '%s'.\n",
+                    journal->path);
+        }
+        return false;
+    }
+
+    CharBuffer records;
+    CharBuffer_init(&records);
+    char field[64];
+    int len = snprintf(field, sizeof(field), "cbr-journal 1%c%s%c",
+                       '\0', arguments->force ? "f" : "", '\0');
+    char_buffer_append(&records, field, len);
+    char_buffer_append(&records, staging->name, strlen(staging->name) + 1);
+
+    for (size_t i = 0; i < plan->count; i++) {
+        OpKind kind = plan->kinds[i];
+        const char *src = plan_src(plan, i);
+        const char *dst = "";
+        if (kind == OP_RENAME || kind == OP_EXCHANGE ||
+            plan->steps[i] == STEP_TO_TEMP) {
+            dst = plan_dst(plan, i);
+        }
+
+        len = snprintf(field, sizeof(field), "%c%c%u", journal_kinds[kind],
+                       journal_steps[plan->steps[i]],
+                       (unsigned)plan->components[i]);
+        // names alone cannot tell whether a swap happened, or whether a
+        // missing source was renamed rather than lost; inodes come from
+        // listing, only swaps of names listed without one look theirs up
+        const FileId *ids = plan->table->ids;
+        FileId id = ids ? ids[plan->entries[i]] : (FileId){.ino = 0};
+        struct stat st;
+        if (kind == OP_EXCHANGE && id.ino == 0) {
+            stats_count(CALL_STAT);
+            if (fstatat(journal->dir_fd, src, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                id = (FileId){.ino = st.st_ino, .dev = st.st_dev};
+            }
+        }
+        if ((kind == OP_RENAME || kind == OP_EXCHANGE) && id.ino != 0) {
+            len += snprintf(field + len, sizeof(field) - len, ":%lu:%lu",
+                            (unsigned long)id.ino, (unsigned long)id.dev);
+        }
+        char_buffer_append(&records, field, len + 1);
+        char_buffer_append(&records, src, strlen(src) + 1);
+        char_buffer_append(&records, dst, strlen(dst) + 1);
+    }
+    char_buffer_append(&records, "P", 2);
+
+    struct iovec iov = {.iov_base = records.data, .iov_len = records.count};
+    bool written = fd_writev_all(journal->fd, &iov, 1);
+    CharBuffer_free(&records);
+
+    if (!written || fdatasync(journal->fd) != 0) {
+        perror("write");
+        fprintf(stderr, "Error: Could not write journal '%s'.\n",
+                journal->path);
+        return false;
+    }
+    journal->synced = 0;
+    journal->stalled = false;
+    return true;
+}
+
+// stops recording after a failed write or sync, so that recovery never reads
+// a record cut short, or a marker for operations that may not be durable
+static void journal_stall(Journal *journal, const char *call) {
+    output_flush();
+    perror(call);
+    fprintf(stderr,
+            "Warning: Could not write journal '%s', progress from here on is "
+            "not recorded.\n",
+            journal->path);
+    journal->stalled = true;
+}
+
+// records where operation i put the file it trashed, so that a rollback can
+// restore it
+void journal_trashed(Journal *journal, size_t i, const char *trashed_path) {
+    if (journal->fd < 0 || journal->stalled) { return; }
+    char field[32];
+    int len = snprintf(field, sizeof(field), "t%zu", i);
+    struct iovec iov[2] = {{.iov_base = field, .iov_len = len + 1},
+                           {.iov_base = (char *)trashed_path,
+                            .iov_len = strlen(trashed_path) + 1}};
+    if (!fd_writev_all(journal->fd, iov, 2)) {
+        journal_stall(journal, "write");
+    }
+}
+
+// Records that operations [0, done) are complete. Progress is made durable in
+// batches, with one syncfs() of the target filesystem and one fdatasync() of
+// the journal per JOURNAL_SYNC_INTERVAL operations (or whenever force is set).
+// A marker is only written once the operations it covers are synced.
+void journal_mark(Journal *journal, size_t done, bool force) {
+    if (journal->fd < 0 || journal->stalled || done == journal->synced) {
+        return;
+    }
+    if (!force && done - journal->synced < JOURNAL_SYNC_INTERVAL) { return; }
+
+    if (syncfs(journal->dir_fd) != 0) {
+        journal_stall(journal, "syncfs");
+        return;
+    }
+    char marker[32];
+    int len = snprintf(marker, sizeof(marker), "M%zu", done);
+    struct iovec iov = {.iov_base = marker, .iov_len = len + 1};
+    if (!fd_writev_all(journal->fd, &iov, 1)) {
+        journal_stall(journal, "write");
+        return;
+    }
+    if (fdatasync(journal->fd) != 0) {
+        journal_stall(journal, "fdatasync");
+        return;
+    }
+    journal->synced = done;
+}
+
+// closes the journal, which is removed when the run succeeded and otherwise
+// left for --resume or --rollback
+void journal_end(Journal *journal, bool success) {
+    if (journal->fd < 0) { return; }
+    close(journal->fd);
+    journal->fd = -1;
+
+    if (success) {
+        unlink(journal->path);
+    } else {
         fprintf(stderr,
-                "Error: Mismatched number of lines. New filename list contains "
-                "%d entries while original list contains %d.\n",
-                new_names_list.count, initial_names_list.count);
-        goto fail;
+                "Error: The run did not complete. Retry it with --resume or "
+                "undo it with --rollback.\n");
+    }
+}
+
+// one operation read back from a journal
+typedef struct {
+    char kind;          // 'R', 'X', 'D' or 'T'
+    uint32_t component; // operations of one chain or cycle
+    unsigned long ino;  // inode and device of the file moved, 0 if unknown
+    unsigned long dev;
+    char *src;
+    char *dst;
+    char *trashed; // path in the trash of the file trashed, NULL if unknown
+    bool done;
+    bool lost; // source gone but not renamed, so the operation is skipped
+} JournalOp;
+
+DEFINE_ARRAY_TYPE(JournalOpList, JournalOp)
+
+// Whether the rename op, whose source is gone, ran: its file is at its
+// destination (a copy, if on another filesystem), or the destination lies in
+// a directory that a later operation moved on.
+static bool journal_rename_arrived(int dir_fd, const JournalOp *op) {
+    struct stat st;
+    if (fstatat(dir_fd, op->dst, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        return op->ino == 0 || st.st_dev != op->dev || st.st_ino == op->ino;
+    }
+
+    const char *slash = strrchr(op->dst, '/');
+    if (!slash) { return false; }
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%.*s", (int)(slash - op->dst), op->dst);
+    return !file_exists(dir_fd, parent);
+}
+
+// whether op renames a file out of the staging directory staging_name, whose
+// temporary names only exist once an earlier operation made them
+static bool journal_op_from_temp(const JournalOp *op,
+                                 const char *staging_name) {
+    size_t length = strlen(staging_name);
+    return op->kind == 'R' && length > 0 &&
+           strncmp(op->src, staging_name, length) == 0 &&
+           op->src[length] == '/';
+}
+
+// Determines which operations of component [begin, end) completed, knowing
+// that those before done_before did. Chains and cycles run from their free
+// end, so every rename leaves its source name free until the next one takes
+// it: the last operation whose source is missing is the last one that ran.
+// A cycle ends with a rename from a temporary name, which is also missing
+// before the rename to it ran, so it only counts once the file is seen to have
+// left it. Swaps are detected by inode,
+// removals by their source being gone. A rename whose source is gone without
+// its file arriving is reported and marked lost.
+// returns whether no file was lost
+bool journal_component_check(int dir_fd, JournalOp *ops, size_t begin,
+                             size_t end, size_t done_before,
+                             const char *staging_name) {
+    size_t done_end = done_before > begin ? done_before : begin;
+    if (done_end > end) { done_end = end; }
+
+    bool intact = true;
+    for (size_t i = begin; i < end; i++) {
+        JournalOp *op = &ops[i];
+        struct stat st;
+        if (op->kind == 'X') {
+            if (fstatat(dir_fd, op->dst, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                st.st_ino == op->ino && i + 1 > done_end) {
+                done_end = i + 1;
+            }
+            continue;
+        }
+        if (journal_op_from_temp(op, staging_name)) {
+            size_t made = begin;
+            while (made < i && strcmp(ops[made].dst, op->src) != 0) {
+                made++;
+            }
+            // if the rename to it is not known to have run, only the file
+            // having arrived shows that this one did
+            if ((made == i || made >= done_end) &&
+                !journal_rename_arrived(dir_fd, op)) {
+                continue;
+            }
+        }
+        if (!file_exists(dir_fd, op->src)) {
+            if (op->kind == 'R' && !journal_rename_arrived(dir_fd, op)) {
+                fprintf(stderr,
+                        "Error: '%s' is gone, but was not renamed to '%s'.\n",
+                        op->src, op->dst);
+                op->lost = true;
+                intact = false;
+            }
+            if (i + 1 > done_end) { done_end = i + 1; }
+        }
+    }
+    for (size_t i = begin; i < end; i++) {
+        ops[i].done = i < done_end;
+    }
+    return intact;
+}
+
+// counts an operation redone or undone by recovery, and reports it unless a
+// counter is shown
+void journal_op_report(const JournalOp *op, const char *from, const char *to,
+                       const Arguments *arguments) {
+    output.done++;
+    output.renamed += op->kind == 'R' ? 1 : op->kind == 'X' ? 2 : 0;
+    output.removed += op->kind == 'D';
+    output.trashed += op->kind == 'T';
+    if (output.progress) {
+        output_progress();
+        return;
+    }
+    if (arguments->silent) { return; }
+
+    if (op->kind == 'D') {
+        delete_message_print(from);
+    } else if (op->kind == 'T') {
+        trash_message_print(from);
+    } else {
+        rename_message_print(from, to);
+        if (op->kind == 'X') { rename_message_print(to, from); }
+    }
+}
+
+// Finishes (or with rollback, reverses) the interrupted run recorded in the
+// journal of dir_fd. Every operation is checked against the state of the
+// files first, so recovery can itself be interrupted and rerun. Rollback puts
+// trashed files back from the trash; if a file is lost (deleted, or gone from
+// where the journal expects it), the journal is kept.
+// returns whether successful
+bool journal_recover(int dir_fd, Staging *staging, Trash *trash,
+                     const Arguments *arguments, bool rollback) {
+    char path[PATH_MAX];
+    if (!directory_state_path(dir_fd, "journal", path, sizeof(path))) {
+        perror("journal");
+        return false;
+    }
+
+    size_t size;
+    char *buffer = file_read_all(path, &size);
+    if (!buffer) {
+        fprintf(stderr, "Error: No interrupted run found in '%s'.\n",
+                arguments->directory);
+        return false;
+    }
+
+    FilenameList fields;
+    FilenameList_init(&fields);
+    records_split(buffer, size, '\0', &fields);
+    JournalOpList ops;
+    JournalOpList_init(&ops);
+    bool success = true;
+    bool complete = false; // whether the plan was fully written
+    bool force = false;
+    bool intact = true; // whether every file can be accounted for
+    size_t done_before = 0;
+
+    if (fields.count < 3 || strcmp(fields.data[0], "cbr-journal 1") != 0) {
+        fprintf(stderr, "Error: Journal '%s' is not readable.\n", path);
+        success = false;
+    } else {
+        force = strchr(fields.data[1], 'f') != NULL;
+        snprintf(staging->name, sizeof(staging->name), "%s", fields.data[2]);
+        staging->created =
+            staging->name[0] != '\0' && file_exists(dir_fd, staging->name);
+    }
+
+    // a record cut short by a crash is ignored
+    for (size_t f = 3; success && f < fields.count; f++) {
+        char *field = fields.data[f];
+        if (field[0] == 'P') {
+            complete = true;
+        } else if (field[0] == 'M') {
+            done_before = strtoul(field + 1, NULL, 10);
+        } else if (field[0] == 't' && f + 1 < fields.count) {
+            size_t i = strtoul(field + 1, NULL, 10);
+            if (i < ops.count) { ops.data[i].trashed = fields.data[f + 1]; }
+            f++;
+        } else if (f + 2 < fields.count) {
+            char *ino = strchr(field, ':');
+            char *dev = NULL;
+            JournalOp op = {.kind = field[0],
+                            .component = strtoul(field + 2, NULL, 10),
+                            .ino = ino ? strtoul(ino + 1, &dev, 10) : 0,
+                            .dev = dev && *dev == ':' ? strtoul(dev + 1, NULL,
+                                                                10)
+                                                      : 0,
+                            .src = fields.data[f + 1],
+                            .dst = fields.data[f + 2],
+                            .trashed = NULL,
+                            .done = false,
+                            .lost = false};
+            JournalOpList_add(&ops, op);
+            f += 2;
+        }
+    }
+
+    // nothing ran before the plan was complete
+    if (success && !complete) { ops.count = 0; }
+
+    for (size_t begin = 0; success && begin < ops.count;) {
+        size_t end = begin + 1;
+        while (end < ops.count &&
+               ops.data[end].component == ops.data[begin].component) {
+            end++;
+        }
+        if (!journal_component_check(dir_fd, ops.data, begin, end,
+                                     done_before, staging->name)) {
+            intact = false;
+        }
+        begin = end;
+    }
+
+    // a run that stopped on a failed rename removed its staging directory
+    // if it was empty, but the cycles left to finish go through it
+    bool temps_left = false;
+    for (size_t k = 0; !rollback && k < ops.count; k++) {
+        const JournalOp *op = &ops.data[k];
+        if (!op->done && !op->lost && journal_op_from_temp(op, staging->name)) {
+            temps_left = true;
+        }
+    }
+    if (success && temps_left && !staging->created) {
+        if (mkdirat(dir_fd, staging->name, 0700) != 0) {
+            perror("mkdirat");
+            fprintf(stderr,
+                    "Error: Could not create staging directory '%s'.\n",
+                    staging->name);
+            success = false;
+        }
+        staging->created = success;
+    }
+
+    output_start(ops.count);
+    for (size_t k = 0; success && k < ops.count; k++) {
+        JournalOp *op = &ops.data[rollback ? ops.count - 1 - k : k];
+        if (op->done != rollback || op->lost) { continue; }
+
+        const char *from = rollback ? op->dst : op->src;
+        const char *to = rollback ? op->src : op->dst;
+        switch (op->kind) {
+        case 'R':
+            success = file_rename(dir_fd, from, to, force && !rollback);
+            break;
+        case 'X':
+            success = file_exchange(dir_fd, from, to, staging);
+            break;
+        case 'D':
+            if (rollback && from[0] != '\0' && file_exists(dir_fd, from)) {
+                // not unlinked yet, so it is put back and reported as the
+                // rename this is
+                success = file_rename(dir_fd, from, to, false);
+                op->kind = 'R';
+                break;
+            }
+            if (rollback) {
+                output_flush();
+                fprintf(stderr, "Error: Cannot restore '%s', it was deleted.\n",
+                        to);
+                intact = false;
+                continue;
+            }
+            errno = file_remove_quiet(dir_fd, from);
+            success = errno == 0;
+            if (!success) {
+                output_flush();
+                perror("unlinkat");
+                fprintf(stderr, "Error: Could not delete file '%s'.\n", from);
+            }
+            break;
+        case 'T':
+            if (!rollback) {
+                success = trash_file(trash, from);
+                break;
+            }
+            if (!op->trashed || !file_exists(dir_fd, op->trashed)) {
+                output_flush();
+                fprintf(stderr, "Error: Cannot restore '%s', it was trashed.\n",
+                        to);
+                intact = false;
+                continue;
+            }
+            // put back and reported as the rename this is
+            from = op->trashed;
+            success = file_rename(dir_fd, from, to, false);
+            if (success) { trash_info_remove(from); }
+            op->kind = 'R';
+            break;
+        }
+        if (success) { journal_op_report(op, from, to, arguments); }
+    }
+    output_finish(arguments->silent);
+
+    // deleted files the interrupted run left in the staging directory
+    for (size_t k = 0; success && !rollback && k < ops.count; k++) {
+        JournalOp *op = &ops.data[k];
+        if (op->kind == 'D' && op->done && op->dst[0] != '\0') {
+            errno = file_remove_quiet(dir_fd, op->dst);
+            if (errno != 0 && errno != ENOENT) {
+                perror("unlinkat");
+                fprintf(stderr, "Error: Could not delete file '%s'.\n",
+                        op->dst);
+                success = false;
+            }
+        }
+    }
+
+    if (success && !intact) {
+        fprintf(stderr,
+                "Error: Not every file could be %s, the journal '%s' is kept "
+                "as a record of them. Remove it to start new runs in '%s'.\n",
+                rollback ? "restored" : "accounted for", path,
+                arguments->directory);
+        success = false;
+    }
+    if (success) {
+        staging_remove(staging);
+        unlink(path);
+    }
+    JournalOpList_free(&ops);
+    FilenameList_free(&fields);
+    free(buffer);
+    return success;
+}
+
+// ===== UNDO ==================================================================
+
+#define UNDO_KEEP 16 // records kept per directory, older ones are removed
+
+// directory of the undo records of the target directory, in the state
+// directory next to its journal, which is created if needed
+// returns whether successful
+bool undo_directory_path(int dir_fd, char *path, size_t size) {
+    return directory_state_path(dir_fd, "undo", path, size) &&
+           directory_create_all(path, 0700);
+}
+
+static int undo_id_compare(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// adds the IDs of the undo records in directory path to ids, oldest first
+// returns whether successful
+static bool undo_ids_list(const char *path, FilenameList *ids, Arena *arena) {
+    DIR *dir = opendir(path);
+    if (!dir) { return false; }
+    for (struct dirent *entry; (entry = readdir(dir));) {
+        if (entry->d_name[0] == '.') { continue; }
+        FilenameList_add(ids, arena_strdup(arena, entry->d_name));
+    }
+    closedir(dir);
+    qsort(ids->data, ids->count, sizeof(char *), undo_id_compare);
+    return true;
+}
+
+// Path entry i of a recursive run ends up at: its new name, unless a
+// directory it leads through is renamed after it, at a lower level (finals
+// caches the paths, NULL until known)
+static char *undo_final_path(const RenameTable *table,
+                             const NameIndex *initial_index, char delete_char,
+                             size_t i, char **finals, Arena *arena) {
+    if (finals[i]) { return finals[i]; }
+    char *name = table->new_names[i];
+    finals[i] = name;
+
+    // the deepest such directory, whose own path is final once resolved
+    for (char *slash = name + strlen(name); slash > name; slash--) {
+        if (*slash != '/') { continue; }
+        *slash = '\0';
+        size_t j = name_index_find(initial_index, name, name_hash(name));
+        *slash = '/';
+        if (j == INDEX_NONE || table->depths[j] >= table->depths[i] ||
+            table->new_names[j][0] == delete_char ||
+            strcmp(table->initial_names[j], table->new_names[j]) == 0) {
+            continue;
+        }
+
+        char *parent = undo_final_path(table, initial_index, delete_char, j,
+                                       finals, arena);
+        size_t parent_len = strlen(parent), rest_len = strlen(slash);
+        char *path = arena_alloc(arena, parent_len + rest_len + 1);
+        memcpy(path, parent, parent_len);
+        memcpy(path + parent_len, slash, rest_len + 1);
+        finals[i] = path;
+        break;
+    }
+    return finals[i];
+}
+
+// Records how to revert the run of table, which completed: the names each
+// renamed file ends up with and started from, then the paths in the trash
+// and the initial names of trashed files (deleted ones cannot be restored).
+// The record is a sequence of NUL-terminated fields, a header ("cbr-undo 1",
+// flags, the counts of renamed and trashed files) followed by the pairs. Its
+// ID is a zero-padded run number, one past the newest record's, and the UTC
+// time of the run (e.g. "00000042-20261014T053200Z"), so that IDs order as
+// the runs did whatever the clock does. Only the UNDO_KEEP newest records of
+// a directory are kept.
+// returns whether successful
+bool undo_record_write(const RenameTable *table, const NameIndex *initial_index,
+                       const Trash *trash, const Arguments *arguments,
+                       int dir_fd, Arena *arena) {
+    char delete_char = arguments->delete_char;
+    char **finals = NULL;
+    if (arguments->recursive) {
+        finals = calloc(table->count > 0 ? table->count : 1, sizeof(char *));
+    }
+
+    CharBuffer records;
+    CharBuffer_init(&records);
+    size_t renamed = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        const char *initial_name = table->initial_names[i];
+        const char *new_name = table->new_names[i];
+        if (new_name[0] == delete_char || strcmp(initial_name, new_name) == 0) {
+            continue;
+        }
+        if (finals) {
+            new_name = undo_final_path(table, initial_index, delete_char, i,
+                                       finals, arena);
+        }
+        char_buffer_append(&records, new_name, strlen(new_name) + 1);
+        char_buffer_append(&records, initial_name, strlen(initial_name) + 1);
+        renamed++;
+    }
+    for (size_t k = 0; k + 1 < trash->trashed.count; k += 2) {
+        const char *name = trash->trashed.data[k];
+        const char *trashed_path = trash->trashed.data[k + 1];
+        char_buffer_append(&records, trashed_path, strlen(trashed_path) + 1);
+        char_buffer_append(&records, name, strlen(name) + 1);
+    }
+    free(finals);
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "cbr-undo 1%c%s%c%zu%c%zu%c", '\0',
+                              arguments->recursive ? "r" : "", '\0', renamed,
+                              '\0', trash->trashed.count / 2, '\0');
+
+    char path[PATH_MAX];
+    bool success = undo_directory_path(dir_fd, path, sizeof(path));
+    size_t path_len = strlen(path);
+    FilenameList ids;
+    FilenameList_init(&ids);
+    Arena ids_arena = {.head = NULL};
+    success = success && undo_ids_list(path, &ids, &ids_arena);
+    unsigned long number = 1;
+    if (ids.count > 0) {
+        number = strtoul(ids.data[ids.count - 1], NULL, 10) + 1;
+    }
+
+    char time_id[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    strftime(time_id, sizeof(time_id), "%Y%m%dT%H%M%SZ", gmtime_r(&now, &tm));
+    int fd = -1;
+    for (; success && fd < 0; number++) {
+        snprintf(path + path_len, sizeof(path) - path_len, "/%08lu-%s",
+                 number, time_id);
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        success = fd >= 0 || errno == EEXIST;
+    }
+    if (success) {
+        struct iovec iov[2] = {
+            {.iov_base = header, .iov_len = header_len},
+            {.iov_base = records.data, .iov_len = records.count}};
+        success = fd_writev_all(fd, iov, 2);
+        close(fd);
+        if (!success) { unlink(path); }
+    }
+    CharBuffer_free(&records);
+    if (!success) {
+        output_flush();
+        perror("undo");
+        fprintf(stderr, "Error: Could not record the run for --undo.\n");
+        FilenameList_free(&ids);
+        arena_free(&ids_arena);
+        return false;
+    }
+
+    // the oldest records make room for the new one
+    for (size_t k = 0; k + UNDO_KEEP < ids.count + 1; k++) {
+        snprintf(path + path_len, sizeof(path) - path_len, "/%s", ids.data[k]);
+        unlink(path);
+    }
+    FilenameList_free(&ids);
+    arena_free(&ids_arena);
+    return true;
+}
+
+// Reads the undo record of the target directory given by --undo (its newest
+// one if no ID is given) into a buffer, and splits it into the names of a run
+// that reverts it: initial_names are the names files have now (the last
+// trashed of them in the trash), new_names the ones they had. Recursive runs
+// are reverted recursively. path receives the path of the record.
+// returns the buffer the names point into, NULL on failure
+char *undo_record_read(int dir_fd, Arguments *arguments, char *path,
+                       size_t size, FilenameList *initial_names,
+                       FilenameList *new_names, size_t *trashed) {
+    if (!undo_directory_path(dir_fd, path, size)) {
+        perror("undo");
+        return NULL;
+    }
+
+    const char *id = arguments->undo;
+    FilenameList ids;
+    FilenameList_init(&ids);
+    Arena ids_arena = {.head = NULL};
+    if (id[0] == '\0' && undo_ids_list(path, &ids, &ids_arena) &&
+        ids.count > 0) {
+        id = ids.data[ids.count - 1];
+    }
+    size_t path_len = strlen(path);
+    snprintf(path + path_len, size - path_len, "/%s", id);
+
+    size_t buffer_size;
+    char *buffer = id[0] ? file_read_all(path, &buffer_size) : NULL;
+    if (!buffer) {
+        if (arguments->undo[0]) {
+            fprintf(stderr, "Error: No run '%s' to undo in '%s'.\n",
+                    arguments->undo, arguments->directory);
+        } else {
+            fprintf(stderr, "Error: No run to undo in '%s'.\n",
+                    arguments->directory);
+        }
+    }
+    FilenameList_free(&ids);
+    arena_free(&ids_arena);
+    if (!buffer) { return NULL; }
+
+    // header fields, then the pairs as a NUL-separated mapping
+    char *fields[4];
+    char *field = buffer, *end = buffer + buffer_size;
+    bool valid = true;
+    for (int f = 0; f < 4 && valid; f++) {
+        char *nul = memchr(field, '\0', end - field);
+        fields[f] = field;
+        valid = nul != NULL;
+        if (valid) { field = nul + 1; }
+    }
+    valid = valid && strcmp(fields[0], "cbr-undo 1") == 0 &&
+            mapping_split(field, end - field, true, initial_names, new_names);
+    size_t renamed = valid ? strtoul(fields[2], NULL, 10) : 0;
+    *trashed = valid ? strtoul(fields[3], NULL, 10) : 0;
+    if (!valid || renamed + *trashed != initial_names->count) {
+        fprintf(stderr, "Error: Undo record '%s' is not readable.\n", path);
+        free(buffer);
+        return NULL;
+    }
+    if (strchr(fields[1], 'r')) { arguments->recursive = true; }
+    return buffer;
+}
+
+// Removes the undo record at path once the run it recorded is reverted,
+// along with the .trashinfo files of the last trashed of initial_names,
+// which were restored from the trash.
+void undo_record_remove(const char *path, const FilenameList *initial_names,
+                        size_t trashed) {
+    for (size_t k = initial_names->count - trashed; k < initial_names->count;
+         k++) {
+        trash_info_remove(initial_names->data[k]);
+    }
+    unlink(path);
+
+    // as is the directory of records, once it is empty
+    char directory[PATH_MAX];
+    snprintf(directory, sizeof(directory), "%s", path);
+    char *slash = strrchr(directory, '/');
+    if (slash) {
+        *slash = '\0';
+        rmdir(directory);
+    }
+}
+
+// ===== EXECUTION =============================================================
+
+void reaper_init(Reaper *reaper, const Plan *plan, bool detach) {
+    memset(reaper, 0, sizeof(*reaper));
+    pthread_mutex_init(&reaper->lock, NULL);
+    pthread_cond_init(&reaper->wake, NULL);
+    reaper->plan = plan;
+    reaper->dir_fd = -1;
+    reaper->detach = detach;
+}
+
+// Unlinks the file of staged deletion i. A file that cannot be unlinked (a
+// directory with contents that were not listed) is moved back to its name.
+static void reaper_remove(Reaper *reaper, size_t i) {
+    const char *staged = plan_dst(reaper->plan, i);
+    int error = file_remove_quiet(reaper->dir_fd, staged);
+    // gone already if it was on another filesystem and removed in place
+    if (error == 0 || error == ENOENT) { return; }
+
+    const char *src = plan_src(reaper->plan, i);
+    errno = error;
+    perror("unlinkat");
+    fprintf(stderr, "Error: Could not delete file '%s'.\n", src);
+    if (file_rename_quiet(reaper->dir_fd, staged, reaper->dir_fd, src,
+                          false) != 0) {
+        fprintf(stderr, "Error: It remains in '%s'.\n", staged);
+    }
+    __atomic_fetch_add(&reaper->failed, 1, __ATOMIC_RELAXED);
+}
+
+static void *reaper_worker(void *arg) {
+    Reaper *reaper = arg;
+
+    pthread_mutex_lock(&reaper->lock);
+    for (;;) {
+        while (reaper->next == reaper->count && !reaper->closing) {
+            pthread_cond_wait(&reaper->wake, &reaper->lock);
+        }
+        if (reaper->next == reaper->count) { break; }
+
+        size_t i = reaper->queue[reaper->next++];
+        pthread_mutex_unlock(&reaper->lock);
+        reaper_remove(reaper, i);
+        pthread_mutex_lock(&reaper->lock);
+    }
+    pthread_mutex_unlock(&reaper->lock);
+    return NULL;
+}
+
+// queues operation i if it is a staged deletion, starting threads as needed
+// (up to REAPER_THREADS)
+void reaper_add(Reaper *reaper, size_t i) {
+    const Plan *plan = reaper->plan;
+    if (plan->kinds[i] != OP_DELETE || plan->steps[i] != STEP_TO_TEMP) {
+        return;
+    }
+
+    pthread_mutex_lock(&reaper->lock);
+    if (reaper->count >= reaper->capacity) {
+        reaper->capacity = reaper->capacity ? reaper->capacity * 2 : 64;
+        reaper->queue =
+            realloc(reaper->queue, reaper->capacity * sizeof(size_t));
+    }
+    reaper->queue[reaper->count++] = i;
+    if (!reaper->detach && reaper->thread_count < REAPER_THREADS &&
+        pthread_create(&reaper->threads[reaper->thread_count], NULL,
+                       reaper_worker, reaper) == 0) {
+        reaper->thread_count++;
+    }
+    pthread_cond_signal(&reaper->wake);
+    pthread_mutex_unlock(&reaper->lock);
+}
+
+// Waits until every queued file is unlinked, helping on the calling thread
+// and starting threads if none run yet.
+// returns whether all files were unlinked
+bool reaper_finish(Reaper *reaper) {
+    pthread_mutex_lock(&reaper->lock);
+    reaper->closing = true;
+    while (reaper->thread_count + 1 < REAPER_THREADS &&
+           reaper->count - reaper->next > reaper->thread_count + 1 &&
+           pthread_create(&reaper->threads[reaper->thread_count], NULL,
+                          reaper_worker, reaper) == 0) {
+        reaper->thread_count++;
+    }
+    pthread_cond_broadcast(&reaper->wake);
+    pthread_mutex_unlock(&reaper->lock);
+
+    reaper_worker(reaper);
+    for (size_t t = 0; t < reaper->thread_count; t++) {
+        pthread_join(reaper->threads[t], NULL);
+    }
+    reaper->thread_count = 0;
+    return __atomic_load_n(&reaper->failed, __ATOMIC_RELAXED) == 0;
+}
+
+// stops at the files being unlinked, leaving the rest in the staging
+// directory for --resume (which unlinks them) or --rollback (which restores
+// them)
+void reaper_cancel(Reaper *reaper) {
+    pthread_mutex_lock(&reaper->lock);
+    reaper->next = reaper->count;
+    pthread_mutex_unlock(&reaper->lock);
+    reaper_finish(reaper);
+}
+
+// Leaves the queued files to a child process in a session of its own, which
+// unlinks them and removes the staging directory after cbr has exited. Without
+// a child the files are unlinked here.
+// returns whether successful so far
+bool reaper_detach(Reaper *reaper, Staging *staging) {
+    if (reaper->next == reaper->count) { return true; }
+
+    fflush(stdout);
+    fflush(stderr);
+    stats_count(CALL_FORK);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return reaper_finish(reaper);
+    }
+    if (pid == 0) {
+        setsid();
+        int null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+        }
+        bool success = reaper_finish(reaper);
+        staging_remove(staging);
+        _exit(success ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    reaper->next = reaper->count;
+    staging->created = false; // removed by the child
+    return true;
+}
+
+void reaper_free(Reaper *reaper) {
+    free(reaper->queue);
+    pthread_mutex_destroy(&reaper->lock);
+    pthread_cond_destroy(&reaper->wake);
+}
+
+// state shared by all operations of a run
+typedef struct {
+    int dir_fd;
+    const Shards *shards;      // directories of the running phase, or NULL
+    const uint32_t *op_shards; // source and destination shard of each of its
+                               // operations, from shard_begin on
+    size_t shard_begin;
+    Staging *staging;
+    Trash *trash;
+    Journal *journal;
+    Reaper *reaper;
+    const Arguments *arguments;
+} ExecContext;
+
+// source and destination of an operation, each as a directory fd and a name
+// below it
+typedef struct {
+    int src_fd;
+    const char *src;
+    int dst_fd;
+    const char *dst;
+} OpFiles;
+
+// names the files of operation i below their shards, by their paths relative
+// to the target directory if the phase is not sharded
+static inline void op_files(const Plan *plan, size_t i, const ExecContext *ctx,
+                            OpFiles *files) {
+    files->src_fd = ctx->dir_fd;
+    files->src = plan_src(plan, i);
+    files->dst_fd = ctx->dir_fd;
+    files->dst = plan_dst(plan, i);
+    if (ctx->shards) {
+        const uint32_t *shards = &ctx->op_shards[2 * (i - ctx->shard_begin)];
+        files->src_fd = shard_at(ctx->shards, shards[0], &files->src);
+        files->dst_fd = shard_at(ctx->shards, shards[1], &files->dst);
+    }
+}
+
+// shard of the source of operation i, SHARD_NONE if the phase is not sharded
+static inline uint32_t op_shard(const ExecContext *ctx, size_t i) {
+    return ctx->shards ? ctx->op_shards[2 * (i - ctx->shard_begin)]
+                       : SHARD_NONE;
+}
+
+// counts operation i as done, and reports it unless a counter is shown
+void op_report(const Plan *plan, size_t i, const Arguments *arguments) {
+    // moving a file aside is not reported, its final rename is
+    OpKind kind = plan->kinds[i];
+    if (kind == OP_RENAME && plan->steps[i] == STEP_TO_TEMP) { return; }
+
+    output.done++;
+    output.renamed += kind == OP_RENAME ? 1 : kind == OP_EXCHANGE ? 2 : 0;
+    output.removed += kind == OP_DELETE;
+    output.trashed += kind == OP_TRASH;
+    if (output.progress) {
+        output_progress();
+        return;
+    }
+    if (arguments->silent) { return; }
+
+    const char *initial_name = plan->table->initial_names[plan->entries[i]];
+    const char *new_name = plan->table->new_names[plan->entries[i]];
+
+    switch (kind) {
+    case OP_RENAME:
+        rename_message_print(initial_name, new_name);
+        break;
+    case OP_EXCHANGE:
+        rename_message_print(initial_name, new_name);
+        rename_message_print(new_name, initial_name);
+        break;
+    case OP_DELETE:
+        delete_message_print(initial_name);
+        break;
+    case OP_TRASH:
+        trash_message_print(initial_name);
+        break;
+    }
+}
+
+// Removes the file of deletion i: moves it into the staging directory, where
+// the reaper unlinks it. Files on another filesystem and directories with
+// listed contents are removed in place.
+// returns 0 if successful, errno otherwise
+int op_delete_quiet(const Plan *plan, size_t i, const OpFiles *files) {
+    if (plan->steps[i] == STEP_TO_TEMP) {
+        int error = file_rename_quiet(files->src_fd, files->src, files->dst_fd,
+                                      files->dst, false);
+        if (error != EXDEV) { return error; }
+    }
+    return file_remove_quiet(files->src_fd, files->src);
+}
+
+// runs a single rename, exchange, deletion or trashing
+// returns whether successful
+bool op_execute(const Plan *plan, size_t i, ExecContext *ctx) {
+    bool success = true;
+    const char *src = plan_src(plan, i);
+
+    switch ((OpKind)plan->kinds[i]) {
+    case OP_RENAME:
+        success = file_rename(ctx->dir_fd, src, plan_dst(plan, i),
+                              ctx->arguments->force);
+        break;
+    case OP_EXCHANGE:
+        success =
+            file_exchange(ctx->dir_fd, src, plan_dst(plan, i), ctx->staging);
+        break;
+    case OP_DELETE: {
+        OpFiles files = {.src_fd = ctx->dir_fd,
+                         .src = src,
+                         .dst_fd = ctx->dir_fd,
+                         .dst = plan_dst(plan, i)};
+        errno = op_delete_quiet(plan, i, &files);
+        if (errno != 0) {
+            output_flush();
+            perror("unlinkat");
+            fprintf(stderr, "Error: Could not delete file '%s'.\n", src);
+            success = false;
+        }
+        break;
+    }
+    case OP_TRASH:
+        stats_phase(STATS_TRASH);
+        success = trash_file(ctx->trash, src);
+        stats_phase(STATS_RENAME);
+        if (success) {
+            const FilenameList *trashed = &ctx->trash->trashed;
+            journal_trashed(ctx->journal, i, trashed->data[trashed->count - 1]);
+        }
+        break;
+    }
+
+    if (success) {
+        op_report(plan, i, ctx->arguments);
+        reaper_add(ctx->reaper, i);
+    }
+    return success;
+}
+
+// runs a single rename, exchange or deletion without fallbacks that need the
+// staging directory and without printing, so it is safe on worker threads
+// (trashing is left to op_execute(), as trash directories are resolved lazily)
+// returns 0 if successful, errno otherwise, -1 if not run
+int op_execute_quiet(const Plan *plan, size_t i, ExecContext *ctx) {
+    OpFiles files;
+    op_files(plan, i, ctx, &files);
+
+    switch ((OpKind)plan->kinds[i]) {
+    case OP_RENAME: {
+        bool force = ctx->arguments->force;
+        int error = file_rename_quiet(files.src_fd, files.src, files.dst_fd,
+                                      files.dst, force);
+        // moves to other filesystems copy on the worker, up to -j at a time
+        if (error == EXDEV) {
+            error = file_move_quiet(files.src_fd, files.src, files.dst_fd,
+                                    files.dst, force);
+        }
+        return error;
+    }
+    case OP_EXCHANGE:
+        if (__atomic_load_n(&exchange_unsupported, __ATOMIC_RELAXED)) {
+            return EINVAL;
+        }
+        stats_count(CALL_RENAME);
+        if (renameat2(files.src_fd, files.src, files.dst_fd, files.dst,
+                      RENAME_EXCHANGE) != 0) {
+            return errno;
+        }
+        return 0;
+    case OP_DELETE:
+        return op_delete_quiet(plan, i, &files);
+    case OP_TRASH:
+        return -1;
+    }
+    return 0;
+}
+
+// Reports plan operations [begin, end) in plan order after they ran in a
+// batch, where results[i - begin] is 0 for operations that succeeded. The
+// others (failed, cancelled or never started) are retried with op_execute(),
+// which handles fallbacks and prints errors. A failure skips the rest of its
+// component but not other components, so every failing component is reported.
+// returns whether all operations succeeded
+bool batch_results_report(const Plan *plan, size_t begin, size_t end,
+                          int results[], ExecContext *ctx) {
+    bool success = true;
+    size_t failed_component = INDEX_NONE;
+
+    for (size_t i = begin; i < end; i++) {
+        if (plan->components[i] == failed_component) { continue; }
+
+        if (results[i - begin] == 0) {
+            op_report(plan, i, ctx->arguments);
+            reaper_add(ctx->reaper, i);
+        } else if (!op_execute(plan, i, ctx)) {
+            success = false;
+            failed_component = plan->components[i];
+        }
+    }
+    return success;
+}
+
+// moves of one run between filesystems, picked up by a pool of threads
+typedef struct {
+    const Plan *plan;
+    size_t begin;
+    size_t *indices; // plan operations that failed with EXDEV
+    size_t count;
+    size_t next; // accessed atomically
+    int *results;
+    ExecContext *ctx;
+} MoveRun;
+
+#define MOVE_THREADS 4
+
+static void *move_worker(void *arg) {
+    MoveRun *run = arg;
+
+    for (;;) {
+        size_t m = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+        if (m >= run->count) { break; }
+
+        size_t i = run->indices[m];
+        OpFiles files;
+        op_files(run->plan, i, run->ctx, &files);
+        run->results[i - run->begin] =
+            file_move_quiet(files.src_fd, files.src, files.dst_fd, files.dst,
+                            run->ctx->arguments->force);
+    }
+    return NULL;
+}
+
+// Redoes the renames among plan operations [begin, end) that io_uring failed
+// with EXDEV as moves by copying, on up to MOVE_THREADS threads (or -j), so
+// that several large files are copied at once. The rest of their components
+// was cancelled and is left to batch_results_report(), which runs it in order.
+void moves_run(const Plan *plan, size_t begin, size_t end, int results[],
+               ExecContext *ctx) {
+    MoveRun run = {.plan = plan,
+                   .begin = begin,
+                   .indices = malloc((end - begin) * sizeof(size_t)),
+                   .count = 0,
+                   .next = 0,
+                   .results = results,
+                   .ctx = ctx};
+    for (size_t i = begin; i < end; i++) {
+        if (results[i - begin] == -EXDEV && plan->kinds[i] == OP_RENAME) {
+            run.indices[run.count++] = i;
+        }
+    }
+
+    size_t thread_count = ctx->arguments->jobs > 1 ? ctx->arguments->jobs
+                                                   : MOVE_THREADS;
+    if (thread_count > run.count) { thread_count = run.count; }
+    pool_run(move_worker, &run, thread_count);
+    free(run.indices);
+}
+
+// minimal io_uring interface over the raw system calls (no liburing
+// dependency, so static builds keep working)
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size;
+} Uring;
+
+#define URING_ENTRIES 256
+
+bool uring_init(Uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) { return false; }
+    ring->entries = params.sq_entries;
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring =
+        mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) { goto fail; }
+
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_size) {
+        ring->cq_ring =
+            mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) { goto fail; }
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) { goto fail; }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return true;
+
+fail:
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->cq_ring_size && ring->cq_ring && ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    close(ring->fd);
+    return false;
+}
+
+void uring_destroy(Uring *ring) {
+    munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring_size) { munmap(ring->cq_ring, ring->cq_ring_size); }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// queues a submission entry, caller must ensure ring is not full
+void uring_queue_op(Uring *ring, const Plan *plan, size_t i,
+                    const ExecContext *ctx, bool linked,
+                    unsigned long user_data) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+
+    OpFiles files;
+    op_files(plan, i, ctx, &files);
+    sqe->fd = files.src_fd;
+    sqe->addr = (unsigned long)files.src;
+    if (plan->kinds[i] == OP_DELETE && plan->steps[i] != STEP_TO_TEMP) {
+        sqe->opcode = IORING_OP_UNLINKAT;
+        stats_count(CALL_UNLINK);
+    } else {
+        stats_count(CALL_RENAME);
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->len = files.dst_fd;
+        sqe->addr2 = (unsigned long)files.dst;
+        if (plan->kinds[i] == OP_EXCHANGE) {
+            sqe->rename_flags = RENAME_EXCHANGE;
+        } else if (!ctx->arguments->force && !noreplace_unsupported) {
+            sqe->rename_flags = RENAME_NOREPLACE;
+        }
+    }
+    if (linked) { sqe->flags = IOSQE_IO_LINK; }
+    sqe->user_data = user_data;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// submits queued entries and waits until all of them have completed
+// results[user_data] receives the result of each operation
+bool uring_flush(Uring *ring, unsigned queued, int results[]) {
+    unsigned to_submit = queued;
+
+    while (queued > 0) {
+        stats_count(CALL_URING_ENTER);
+        int result = syscall(__NR_io_uring_enter, ring->fd, to_submit, queued,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+        if (result < 0) {
+            if (errno == EINTR) { continue; }
+            output_flush();
+            perror("io_uring_enter");
+            return false;
+        }
+        to_submit -= (unsigned)result;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            queued--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// Runs the deletions and renames among plan operations [begin, end) through
+// io_uring. Operations of a component are linked so the kernel runs them in
+// order, independent components run concurrently. Any operation that did not
+// succeed (including ones cancelled after an earlier failure in their
+// component) is retried by batch_results_report().
+// returns whether successful
+bool uring_execute(const Plan *plan, size_t begin, size_t end,
+                   ExecContext *ctx) {
+    Uring ring;
+    if (!uring_init(&ring, URING_ENTRIES)) {
+        perror("io_uring_setup");
+        fprintf(stderr, "Warning: io_uring unavailable, using sync engine.\n");
+        for (size_t i = begin; i < end; i++) {
+            if (!op_execute(plan, i, ctx)) { return false; }
+        }
+        return true;
+    }
+
+    // 1 marks operations that have not run
+    int *results = malloc((end - begin) * sizeof(int));
+    for (size_t i = 0; i < end - begin; i++) {
+        results[i] = 1;
+    }
+
+    bool success = true;
+    unsigned queued = 0;
+    size_t i = begin;
+    while (i < end && success) {
+        size_t j = i;
+        while (j < end && plan->components[j] == plan->components[i]) {
+            j++;
+        }
+
+        if (plan->kinds[i] == OP_TRASH) {
+            i = j;
+            continue;
+        }
+
+        // keep a component within one submission where possible, as links
+        // do not extend across submissions
+        if (queued + (j - i) > ring.entries && queued > 0) {
+            success = uring_flush(&ring, queued, results);
+            queued = 0;
+        }
+
+        for (size_t k = i; k < j && success; k++) {
+            // component longer than the ring, continue only if the part
+            // submitted so far succeeded
+            if (queued == ring.entries) {
+                success = uring_flush(&ring, queued, results);
+                queued = 0;
+                if (results[k - 1 - begin] != 0) { break; }
+            }
+
+            bool linked = k + 1 < j && queued + 1 < ring.entries;
+            uring_queue_op(&ring, plan, k, ctx, linked, k - begin);
+            queued++;
+        }
+        i = j;
+    }
+    if (success && queued > 0) {
+        success = uring_flush(&ring, queued, results);
+    }
+
+    if (success) {
+        moves_run(plan, begin, end, results, ctx);
+        success = batch_results_report(plan, begin, end, results, ctx);
+    }
+
+    free(results);
+    uring_destroy(&ring);
+    return success;
+}
+
+// work shared by the threads of a parallel run
+typedef struct {
+    const Plan *plan;
+    size_t begin;
+    size_t *component_starts; // one past the last entry ends the last component
+    size_t *order;            // components grouped by shard of their first file
+    size_t *shard_starts;     // one past the last entry ends the last shard
+    size_t *shard_next;       // next of each shard in order, taken atomically
+    size_t shard_count;
+    size_t thread_count;
+    size_t next_thread; // taken atomically by workers
+    int *results;
+    ExecContext *ctx;
+} ParallelRun;
+
+static void *parallel_worker(void *arg) {
+    ParallelRun *run = arg;
+
+    // threads start on shards of their own, where they do not wait for each
+    // other on the lock of the directory, and help with the rest when done
+    size_t t = __atomic_fetch_add(&run->next_thread, 1, __ATOMIC_RELAXED);
+    size_t first = t * run->shard_count / run->thread_count;
+
+    for (size_t n = 0; n < run->shard_count; n++) {
+        size_t s = (first + n) % run->shard_count;
+        for (;;) {
+            size_t k =
+                __atomic_fetch_add(&run->shard_next[s], 1, __ATOMIC_RELAXED);
+            if (k >= run->shard_starts[s + 1]) { break; }
+
+            // operations of a component depend on each other, stop at failure
+            size_t c = run->order[k];
+            for (size_t i = run->component_starts[c];
+                 i < run->component_starts[c + 1]; i++) {
+                int result = op_execute_quiet(run->plan, i, run->ctx);
+                run->results[i - run->begin] = result;
+                if (result != 0) { break; }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Runs the deletions and renames among plan operations [begin, end) on a pool
+// of worker threads. Files of different components never share a name, so
+// components run concurrently while each runs in order on a single thread.
+// The components of a sharded phase are dealt out by the directory of their
+// first file, so that threads mostly rename in different directories.
+// Workers do not print, results are reported by batch_results_report().
+// returns whether successful
+bool parallel_execute(const Plan *plan, size_t begin, size_t end,
+                      ExecContext *ctx) {
+    int *results = malloc((end - begin) * sizeof(int));
+    size_t *starts = malloc((end - begin + 1) * sizeof(size_t));
+    size_t component_count = 0;
+
+    for (size_t i = begin; i < end; i++) {
+        results[i - begin] = -1; // not run
+        if (i == begin || plan->components[i] != plan->components[i - 1]) {
+            starts[component_count++] = i;
+        }
+    }
+    starts[component_count] = end;
+
+    // components ordered by shard with a counting sort
+    size_t shard_count = ctx->shards ? ctx->shards->count : 1;
+    size_t *order = malloc(component_count * sizeof(size_t));
+    size_t *shard_starts = calloc(shard_count + 1, sizeof(size_t));
+    size_t *shard_next = malloc(shard_count * sizeof(size_t));
+    for (size_t c = 0; c < component_count; c++) {
+        shard_starts[op_shard(ctx, starts[c]) + 1]++;
+    }
+    for (size_t s = 0; s < shard_count; s++) {
+        shard_starts[s + 1] += shard_starts[s];
+        shard_next[s] = shard_starts[s];
+    }
+    for (size_t c = 0; c < component_count; c++) {
+        order[shard_next[op_shard(ctx, starts[c])]++] = c;
+    }
+    memcpy(shard_next, shard_starts, shard_count * sizeof(size_t));
+
+    size_t thread_count = ctx->arguments->jobs; // main thread works too
+    if (thread_count > component_count) { thread_count = component_count; }
+    ParallelRun run = {.plan = plan,
+                       .begin = begin,
+                       .component_starts = starts,
+                       .order = order,
+                       .shard_starts = shard_starts,
+                       .shard_next = shard_next,
+                       .shard_count = shard_count,
+                       .thread_count = thread_count,
+                       .next_thread = 0,
+                       .results = results,
+                       .ctx = ctx};
+
+    pool_run(parallel_worker, &run, thread_count);
+    bool success = batch_results_report(plan, begin, end, results, ctx);
+
+    free(shard_next);
+    free(shard_starts);
+    free(order);
+    free(starts);
+    free(results);
+    return success;
+}
+
+// runs the deletions and renames among plan operations [begin, end)
+// returns whether successful
+bool plan_execute(const Plan *plan, size_t begin, size_t end,
+                  ExecContext *ctx) {
+    if (begin == end) { return true; }
+
+    // each phase is sharded anew, as the phases before it may have renamed
+    // the directories its paths lead through
+    Shards shards;
+    shards_init(&shards, ctx->dir_fd);
+    uint32_t *op_shards = malloc(2 * (end - begin) * sizeof(uint32_t));
+    for (size_t i = begin; i < end; i++) {
+        uint32_t *pair = &op_shards[2 * (i - begin)];
+        pair[0] = pair[1] = SHARD_NONE;
+        OpKind kind = plan->kinds[i];
+        if (kind == OP_TRASH) { continue; } // trashed by path
+
+        pair[0] = shards_add(&shards, plan_src(plan, i));
+        if (kind != OP_DELETE || plan->steps[i] == STEP_TO_TEMP) {
+            pair[1] = shards_add(&shards, plan_dst(plan, i));
+        }
+    }
+    if (shards.opened > 0) {
+        ctx->shards = &shards;
+        ctx->op_shards = op_shards;
+        ctx->shard_begin = begin;
+    }
+
+    bool success = true;
+    if (ctx->arguments->engine == ENGINE_URING) {
+        success = uring_execute(plan, begin, end, ctx);
+    } else if (ctx->arguments->jobs > 1) {
+        success = parallel_execute(plan, begin, end, ctx);
+    } else {
+        for (size_t i = begin; i < end && success; i++) {
+            // below the shards first, then by path with fallbacks and errors
+            if (ctx->shards && op_execute_quiet(plan, i, ctx) == 0) {
+                op_report(plan, i, ctx->arguments);
+                reaper_add(ctx->reaper, i);
+            } else {
+                success = op_execute(plan, i, ctx);
+            }
+            if (success) { journal_mark(ctx->journal, i + 1, false); }
+        }
+    }
+
+    ctx->shards = NULL;
+    free(op_shards);
+    shards_close(&shards);
+    return success;
+}
+
+// ===== DRY RUN ===============================================================
+
+// what a plan amounts to when it runs
+typedef struct {
+    size_t renames;   // final renames, direct or out of the staging directory
+    size_t temp_hops; // files moved aside to break a cycle
+    size_t exchanges;
+    size_t deletes;
+    size_t trashes;
+    size_t syscalls; // expected, for the chosen engine
+} PlanCost;
+
+// Estimates the syscalls of a run: one per rename, exchange or deletion (two
+// for deletions through the staging directory), six per trashed file (stat,
+// open, write and close of its .trashinfo file, rename, journal record), the
+// staging directory, the journal with its periodic syncs and, with io_uring,
+// one submission per full ring in place of the syscalls of each operation.
+// Trash directory lookups and fallbacks are not counted.
+void plan_cost(const Plan *plan, const Arguments *arguments, PlanCost *cost) {
+    memset(cost, 0, sizeof(*cost));
+    size_t batched = 0; // operations submitted through io_uring
+    size_t staged = 0;  // deletions unlinked later by the reaper
+    for (size_t i = 0; i < plan->count; i++) {
+        switch ((OpKind)plan->kinds[i]) {
+        case OP_RENAME:
+            if (plan->steps[i] == STEP_TO_TEMP) {
+                cost->temp_hops++;
+            } else {
+                cost->renames++;
+            }
+            batched++;
+            break;
+        case OP_EXCHANGE:
+            cost->exchanges++;
+            batched++;
+            break;
+        case OP_DELETE:
+            cost->deletes++;
+            staged += plan->steps[i] == STEP_TO_TEMP;
+            batched++;
+            break;
+        case OP_TRASH:
+            cost->trashes++;
+            break;
+        }
+    }
+    if (plan->count == 0) { return; }
+
+    cost->syscalls = 6 * cost->trashes + staged;
+    if (arguments->engine == ENGINE_URING) {
+        // setup, three mappings and teardown per phase
+        cost->syscalls += (batched + URING_ENTRIES - 1) / URING_ENTRIES +
+                          8 * plan->phase_count;
+    } else {
+        cost->syscalls += batched;
+    }
+    if (cost->temp_hops > 0 || staged > 0) { cost->syscalls += 2; }
+
+    // creation, plan write and sync, removal, then syncfs, write and
+    // fdatasync per marker
+    size_t markers = plan->count / JOURNAL_SYNC_INTERVAL + plan->phase_count;
+    cost->syscalls += 6 + 3 * markers;
+}
+
+// appends string to buffer as a JSON string literal
+void json_string_append(CharBuffer *buffer, const char *string) {
+    char_buffer_append(buffer, "\"", 1);
+    for (const char *c = string; *c; c++) {
+        char escaped[8];
+        if (*c == '"' || *c == '\\') {
+            escaped[0] = '\\';
+            escaped[1] = *c;
+            char_buffer_append(buffer, escaped, 2);
+        } else if ((unsigned char)*c < 0x20) {
+            snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)*c);
+            char_buffer_append(buffer, escaped, 6);
+        } else {
+            char_buffer_append(buffer, c, 1);
+        }
+    }
+    char_buffer_append(buffer, "\"", 1);
+}
+
+static const char *const op_names[] = {[OP_RENAME] = "rename",
+                                       [OP_EXCHANGE] = "exchange",
+                                       [OP_DELETE] = "delete",
+                                       [OP_TRASH] = "trash"};
+static const char *const step_names[] = {[STEP_DIRECT] = "direct",
+                                         [STEP_TO_TEMP] = "to_temp",
+                                         [STEP_FROM_TEMP] = "from_temp"};
+
+// Prints the operations of plan in the order they would run, followed by
+// what they amount to. With --json, every operation is a JSON object on its
+// own line and the summary is the last one.
+void plan_print(const Plan *plan, const Arguments *arguments) {
+    CharBuffer line;
+    CharBuffer_init(&line);
+    char number[256];
+
+    for (size_t p = 0, i = 0; p < plan->phase_count; p++) {
+        for (; i < plan->phase_ends[p]; i++) {
+            OpKind kind = plan->kinds[i];
+            bool paired = kind == OP_RENAME || kind == OP_EXCHANGE;
+            bool aside = kind == OP_RENAME && plan->steps[i] == STEP_TO_TEMP;
+            line.count = 0;
+
+            if (arguments->json) {
+                int len = snprintf(number, sizeof(number),
+                                   "{\"type\":\"op\",\"phase\":%zu,"
+                                   "\"op\":\"%s\"",
+                                   p + 1, op_names[kind]);
+                char_buffer_append(&line, number, len);
+                if (kind == OP_RENAME) {
+                    len = snprintf(number, sizeof(number), ",\"step\":\"%s\"",
+                                   step_names[plan->steps[i]]);
+                    char_buffer_append(&line, number, len);
+                }
+                char_buffer_append(&line, ",\"src\":", 7);
+                json_string_append(&line, plan_src(plan, i));
+                if (paired) {
+                    char_buffer_append(&line, ",\"dst\":", 7);
+                    json_string_append(&line, plan_dst(plan, i));
+                }
+                char_buffer_append(&line, "}\n", 2);
+            } else {
+                int len = snprintf(number, sizeof(number), "%3zu  %-8s '",
+                                   p + 1, aside ? "aside" : op_names[kind]);
+                char_buffer_append(&line, number, len);
+                const char *src = plan_src(plan, i);
+                char_buffer_append(&line, src, strlen(src));
+                if (paired) {
+                    const char *dst = plan_dst(plan, i);
+                    const char *arrow =
+                        kind == OP_EXCHANGE ? "' <-> '" : "' -> '";
+                    char_buffer_append(&line, arrow, strlen(arrow));
+                    char_buffer_append(&line, dst, strlen(dst));
+                }
+                char_buffer_append(&line, "'\n", 2);
+            }
+            output_write(line.data, line.count);
+        }
+    }
+    CharBuffer_free(&line);
+
+    PlanCost cost;
+    plan_cost(plan, arguments, &cost);
+    const char *engine = arguments->engine == ENGINE_URING ? "uring" : "sync";
+    int len;
+    if (arguments->json) {
+        len = snprintf(number, sizeof(number),
+                       "{\"type\":\"summary\",\"operations\":%zu,"
+                       "\"phases\":%zu,\"renames\":%zu,\"temp_hops\":%zu,"
+                       "\"exchanges\":%zu,\"deletes\":%zu,\"trashes\":%zu,"
+                       "\"engine\":\"%s\",\"syscalls\":%zu}\n",
+                       plan->count, plan->phase_count, cost.renames,
+                       cost.temp_hops, cost.exchanges, cost.deletes,
+                       cost.trashes, engine, cost.syscalls);
+    } else {
+        len = snprintf(number, sizeof(number),
+                       "Dry run: %zu operations in %zu phases, %zu renames "
+                       "(%zu through a temporary name), %zu exchanges, %zu "
+                       "deletions, %zu trashed, about %zu syscalls (%s "
+                       "engine)\n",
+                       plan->count, plan->phase_count, cost.renames,
+                       cost.temp_hops, cost.exchanges, cost.deletes,
+                       cost.trashes, cost.syscalls, engine);
+    }
+    output_write(number, len);
+}
+
+// ===== DAEMON ================================================================
+
+// stands for the names of removed entries until the index is rebuilt
+static char dir_index_removed_name[] = "";
+
+// indexes entries [0, count) of dir_index, with room for as many again
+static void dir_index_hash(DirIndex *dir_index) {
+    name_index_free(&dir_index->index);
+    name_index_init(&dir_index->index, dir_index->names,
+                    2 * dir_index->count + 64);
+    for (size_t e = 0; e < dir_index->count; e++) {
+        name_index_insert(&dir_index->index, e,
+                          name_hash(dir_index->names[e]));
+    }
+}
+
+// drops removed entries and their names, then indexes the rest anew
+static void dir_index_rebuild(DirIndex *dir_index) {
+    Arena arena = {.head = NULL};
+    size_t live = 0;
+    for (size_t e = 0; e < dir_index->count; e++) {
+        if (dir_index->names[e][0] == '\0') { continue; }
+        dir_index->names[live] = arena_strdup(&arena, dir_index->names[e]);
+        dir_index->types[live] = dir_index->types[e];
+        live++;
+    }
+    arena_free(&dir_index->arena);
+    dir_index->arena = arena;
+    dir_index->count = live;
+    dir_index->removed = 0;
+    dir_index_hash(dir_index);
+}
+
+// appends an entry without checking whether name is already indexed
+static void dir_index_append(DirIndex *dir_index, const char *name,
+                             mode_t type) {
+    if (dir_index->count >= dir_index->capacity) {
+        dir_index->capacity =
+            dir_index->capacity ? dir_index->capacity * 2 : 1024;
+        dir_index->names = realloc(dir_index->names,
+                                   dir_index->capacity * sizeof(char *));
+        dir_index->types = realloc(dir_index->types,
+                                   dir_index->capacity * sizeof(mode_t));
+        dir_index->index.names = dir_index->names;
+    }
+    dir_index->names[dir_index->count] = arena_strdup(&dir_index->arena, name);
+    dir_index->types[dir_index->count] = type;
+    dir_index->count++;
+}
+
+// adds name, or updates its type if it is indexed already
+void dir_index_add(DirIndex *dir_index, const char *name, mode_t type) {
+    uint64_t hash = name_hash(name);
+    size_t e = name_index_find(&dir_index->index, name, hash);
+    if (e != INDEX_NONE) {
+        dir_index->types[e] = type;
+        return;
+    }
+
+    // slots stay at most half full
+    if (2 * (dir_index->count + 1) > dir_index->index.mask + 1) {
+        dir_index_rebuild(dir_index);
+    }
+    dir_index_append(dir_index, name, type);
+    name_index_insert(&dir_index->index, dir_index->count - 1, hash);
+}
+
+void dir_index_remove(DirIndex *dir_index, const char *name) {
+    size_t e = name_index_find(&dir_index->index, name, name_hash(name));
+    if (e == INDEX_NONE) { return; }
+    dir_index->names[e] = dir_index_removed_name;
+    dir_index->types[e] = 0;
+    if (++dir_index->removed > dir_index->count / 2) {
+        dir_index_rebuild(dir_index);
+    }
+}
+
+void dir_index_free(DirIndex *dir_index) {
+    name_index_free(&dir_index->index);
+    arena_free(&dir_index->arena);
+    free(dir_index->names);
+    free(dir_index->types);
+}
+
+// (re)reads every entry of the directory, with getdents64() into buffer
+// returns whether successful
+bool dir_index_scan(DirIndex *dir_index, char *buffer, size_t buffer_size) {
+    int scan_fd =
+        openat(dir_index->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan_fd < 0) {
+        perror("openat");
+        return false;
+    }
+
+    arena_free(&dir_index->arena);
+    dir_index->count = 0;
+    dir_index->removed = 0;
+    bool success = true;
+    for (;;) {
+        long bytes = syscall(SYS_getdents64, scan_fd, buffer, buffer_size);
+        if (bytes < 0) {
+            perror("getdents64");
+            success = false;
+        }
+        if (bytes <= 0) { break; }
+
+        for (long offset = 0; offset < bytes;) {
+            LinuxDirent64 *entry = (LinuxDirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 ||
+                strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            mode_t type = entry->d_type == DT_UNKNOWN
+                              ? file_type(scan_fd, entry->d_name)
+                              : DTTOIF(entry->d_type);
+            dir_index_append(dir_index, entry->d_name, type);
+        }
+    }
+    close(scan_fd);
+    dir_index_hash(dir_index);
+    return success;
+}
+
+// Applies the pending inotify events of the directory. Entries appearing
+// under a name are looked up once for their type, and the whole directory is
+// read again if the kernel dropped events.
+// returns false if the directory is gone or cannot be read
+bool dir_index_update(DirIndex *dir_index, char *buffer, size_t buffer_size) {
+    for (;;) {
+        ssize_t len = read(dir_index->inotify_fd, buffer, buffer_size);
+        if (len < 0 && errno == EINTR) { continue; }
+        if (len < 0 && errno == EAGAIN) { return true; }
+        if (len <= 0) {
+            perror("read");
+            return false;
+        }
+
+        for (ssize_t offset = 0; offset < len;) {
+            struct inotify_event *event =
+                (struct inotify_event *)(buffer + offset);
+            offset += sizeof(*event) + event->len;
+
+            if (event->mask & (IN_DELETE_SELF | IN_IGNORED | IN_UNMOUNT)) {
+                return false;
+            }
+            if (event->mask & IN_Q_OVERFLOW) {
+                if (!dir_index_scan(dir_index, buffer, buffer_size)) {
+                    return false;
+                }
+                break; // the rest of the buffer was read by the scan
+            }
+            if (event->len == 0) { continue; }
+
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                dir_index_remove(dir_index, event->name);
+            } else if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                mode_t type = event->mask & IN_ISDIR
+                                  ? S_IFDIR
+                                  : file_type(dir_index->dir_fd, event->name);
+                if (type != 0) { dir_index_add(dir_index, event->name, type); }
+            }
+        }
+    }
+}
+
+// whether dir_index is of the directory of dir_fd
+bool dir_index_serves(const DirIndex *dir_index, int dir_fd) {
+    struct stat st;
+    return fstat(dir_fd, &st) == 0 && st.st_dev == dir_index->dev &&
+           st.st_ino == dir_index->ino;
+}
+
+// collects the regular files and symbolic links of dir_index into names, as
+// directory_scan() does for the directory itself
+// returns whether successful
+bool dir_index_list(const DirIndex *dir_index, char delete_char,
+                    FilenameList *names) {
+    for (size_t e = 0; e < dir_index->count; e++) {
+        char *name = dir_index->names[e];
+        mode_t type = dir_index->types[e];
+        if (name[0] == '\0' || (type != S_IFREG && type != S_IFLNK)) {
+            continue;
+        }
+        if (name[0] == delete_char) {
+            fprintf(stderr,
+                    "Error: Input filenames ('%s') cannot begin with delete "
+                    "character '%c'.\n",
+                    name, delete_char);
+            return false;
+        }
+        FilenameList_add(names, name);
+    }
+    return true;
+}
+
+// socket of the daemon serving the directory of dir_fd, next to its journal
+// returns whether successful (and short enough for a socket address)
+bool daemon_socket_address(int dir_fd, struct sockaddr_un *address) {
+    char path[PATH_MAX];
+    if (!directory_state_path(dir_fd, "sock", path, sizeof(path))) {
+        perror("socket path");
+        return false;
+    }
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "Error: Socket path '%s' is too long.\n", path);
+        return false;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return true;
+}
+
+// a request carries the client's standard input, output and error and its
+// working directory, followed by its NUL-terminated arguments
+#define DAEMON_REQUEST_FDS 4
+#define DAEMON_REQUEST_MAX (64u << 20)
+
+typedef struct {
+    uint32_t argc;
+    uint32_t size; // bytes of arguments that follow
+} DaemonRequest;
+
+static volatile sig_atomic_t daemon_stopping = 0;
+
+static void daemon_stop(int signal) {
+    (void)signal;
+    daemon_stopping = 1;
+}
+
+// reads exactly size bytes from fd
+// returns whether successful
+static bool fd_read_exact(int fd, char *data, size_t size) {
+    while (size > 0) {
+        ssize_t len = read(fd, data, size);
+        if (len < 0 && errno == EINTR) { continue; }
+        if (len <= 0) { return false; }
+        data += len;
+        size -= len;
     }
+    return true;
+}
 
-    // shallow copy new file list for sorting
-    new_sorted_names_list.data = malloc(new_names_list.count * sizeof(char **));
-    memcpy(new_sorted_names_list.data, new_names_list.data,
-           new_names_list.count * sizeof(char **));
-    new_sorted_names_list.count = new_names_list.count;
+// waits for child, applying inotify events meanwhile so that the kernel queue
+// does not overflow on large runs
+// returns the exit status of child
+static int daemon_wait(DirIndex *dir_index, pid_t child, char *buffer,
+                       size_t buffer_size) {
+    int pid_fd = syscall(SYS_pidfd_open, child, 0);
+    struct pollfd fds[2] = {{.fd = dir_index->inotify_fd, .events = POLLIN},
+                            {.fd = pid_fd, .events = POLLIN}};
+    int status = 0;
+    for (;;) {
+        pid_t done = waitpid(child, &status, WNOHANG);
+        if (done == child) { break; }
+        if (done < 0 && errno != EINTR) {
+            perror("waitpid");
+            status = EXIT_FAILURE << 8;
+            break;
+        }
+        // without pidfds, the exit is noticed within 10 ms
+        poll(fds, pid_fd >= 0 ? 2 : 1, pid_fd >= 0 ? -1 : 10);
+        dir_index_update(dir_index, buffer, buffer_size);
+    }
+    if (pid_fd >= 0) { close(pid_fd); }
+    dir_index_update(dir_index, buffer, buffer_size);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
 
-    qsort(new_sorted_names_list.data, new_sorted_names_list.count,
-          sizeof(char **), string_compare);
+int cbr_main(int argc, char *argv[]);
 
-    // further validation
-    for (int i = 0; i < initial_names_list.count; i++) {
-        char *new_filename = new_names_list.data[i];
+// Runs the request of one client in a child process, which gets the client's
+// standard streams and working directory and the index as it is now, and
+// sends back its exit status. Requests are served one at a time, so each one
+// sees the renames of the last.
+void daemon_serve(DirIndex *dir_index, int conn, char *buffer,
+                  size_t buffer_size) {
+    DaemonRequest request;
+    int fds[DAEMON_REQUEST_FDS];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(request)};
+    struct msghdr message = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    ssize_t len = recvmsg(conn, &message, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    size_t fd_count = 0;
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+        cmsg->cmsg_type == SCM_RIGHTS && cmsg->cmsg_len >= CMSG_LEN(0)) {
+        fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+    }
+    if (len != sizeof(request) || fd_count != DAEMON_REQUEST_FDS) {
+        // descriptors that did arrive are ours now
+        for (size_t f = 0; f < fd_count; f++) {
+            close(fds[f]);
+        }
+        fprintf(stderr, "Error: Malformed request.\n");
+        return;
+    }
 
-        // skip files to be deleted
-        if (new_filename[0] == arguments.delete_char) { continue; }
+    char *data = NULL;
+    char **argv = NULL;
+    bool valid = request.argc > 0 && request.size <= DAEMON_REQUEST_MAX;
+    if (valid) {
+        data = malloc(request.size + 1);
+        argv = malloc((request.argc + 1) * sizeof(char *));
+        valid = fd_read_exact(conn, data, request.size);
+    }
+    // arguments are split where they were joined, and must come out whole
+    size_t argc = 0;
+    for (size_t offset = 0; valid && offset < request.size; argc++) {
+        if (argc == request.argc) {
+            valid = false;
+            break;
+        }
+        argv[argc] = data + offset;
+        offset += strnlen(data + offset, request.size - offset) + 1;
+        valid = offset <= request.size;
+    }
+    valid = valid && argc == request.argc;
 
-        // if renaming to filename not in input list and file already exists
-        if (!filename_list_has(&initial_names_list, new_filename)) {
-            if (!arguments.force && file_exists(new_filename)) {
-                fprintf(stderr, "Error: File '%s' already exists.\n",
-                        new_filename);
-                goto fail;
+    if (!valid) {
+        fprintf(stderr, "Error: Malformed request.\n");
+    } else {
+        argv[argc] = NULL;
+        dir_index_update(dir_index, buffer, buffer_size);
+
+        fflush(stdout);
+        pid_t child = fork();
+        if (child < 0) {
+            perror("fork");
+        } else if (child == 0) {
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+            close(conn);
+            close(dir_index->inotify_fd);
+            for (int f = 0; f < 3; f++) {
+                dup2(fds[f], f);
+            }
+            if (fchdir(fds[3]) != 0) {
+                perror("fchdir");
+                _exit(EXIT_FAILURE);
             }
+            warm_index = dir_index;
+            exit(cbr_main(argc, argv));
+        } else {
+            unsigned char status =
+                daemon_wait(dir_index, child, buffer, buffer_size);
+            send(conn, &status, 1, MSG_NOSIGNAL);
         }
+    }
 
-        // check that output filenames are unique
-        if (i == initial_names_list.count - 1) { continue; }
+    for (int f = 0; f < DAEMON_REQUEST_FDS; f++) {
+        close(fds[f]);
+    }
+    free(argv);
+    free(data);
+}
 
-        if (strcmp(new_sorted_names_list.data[i],
-                   new_sorted_names_list.data[i + 1]) == 0) {
-            fprintf(stderr, "Error: Output filenames are not unique ('%s').\n",
-                    new_sorted_names_list.data[i]);
-            goto fail;
+// Keeps an index of the directory of dir_fd, updated from inotify events, and
+// serves the runs of --connect clients from it until SIGINT or SIGTERM.
+// returns the exit status of the daemon
+int daemon_run(int dir_fd, const Arguments *arguments) {
+    struct sockaddr_un address;
+    if (!daemon_socket_address(dir_fd, &address)) { return EXIT_FAILURE; }
+
+    DirIndex dir_index = {.dir_fd = dir_fd,
+                          .names = NULL,
+                          .types = NULL,
+                          .count = 0,
+                          .capacity = 0,
+                          .removed = 0,
+                          .index = {.slots = NULL},
+                          .arena = {.head = NULL}};
+    struct stat st;
+    if (fstat(dir_fd, &st) != 0) {
+        perror("fstat");
+        fprintf(stderr, "Error: Could not open directory '%s'.\n",
+                arguments->directory);
+        return EXIT_FAILURE;
+    }
+    dir_index.dev = st.st_dev;
+    dir_index.ino = st.st_ino;
+
+    int status = EXIT_FAILURE;
+    int listen_fd = -1;
+    size_t buffer_size = arguments->scan_buffer;
+    char *buffer = malloc(buffer_size);
+
+    // watched before the first scan, so that no change is missed
+    dir_index.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dir_index.inotify_fd < 0 ||
+        inotify_add_watch(dir_index.inotify_fd, arguments->directory,
+                          IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                              IN_DELETE_SELF | IN_ONLYDIR) < 0) {
+        perror("inotify");
+        fprintf(stderr, "Error: Could not watch directory '%s'.\n",
+                arguments->directory);
+        goto out;
+    }
+    if (!dir_index_scan(&dir_index, buffer, buffer_size)) { goto out; }
+
+    // a socket left behind by a daemon that died no longer accepts
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        goto out;
+    }
+    if (connect(listen_fd, (struct sockaddr *)&address, sizeof(address)) ==
+        0) {
+        fprintf(stderr, "Error: A daemon already serves '%s'.\n",
+                arguments->directory);
+        close(listen_fd);
+        listen_fd = -1;
+        goto out;
+    }
+    unlink(address.sun_path);
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(listen_fd, 16) != 0) {
+        perror("bind");
+        fprintf(stderr, "Error: Could not listen on '%s'.\n",
+                address.sun_path);
+        close(listen_fd);
+        listen_fd = -1;
+        goto out;
+    }
+
+    struct sigaction action = {.sa_handler = daemon_stop};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!arguments->silent) {
+        printf("Serving '%s' (%zu entries) on '%s'\n", arguments->directory,
+               dir_index.count, address.sun_path);
+        fflush(stdout);
+    }
+
+    status = EXIT_SUCCESS;
+    struct pollfd fds[2] = {{.fd = dir_index.inotify_fd, .events = POLLIN},
+                            {.fd = listen_fd, .events = POLLIN}};
+    while (!daemon_stopping) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) { continue; }
+            perror("poll");
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (fds[0].revents &&
+            !dir_index_update(&dir_index, buffer, buffer_size)) {
+            fprintf(stderr, "Error: Directory '%s' can no longer be watched.\n",
+                    arguments->directory);
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn >= 0) {
+                daemon_serve(&dir_index, conn, buffer, buffer_size);
+                close(conn);
+            }
         }
     }
 
-    // rename/delete files
-    for (int i = 0; i < initial_names_list.count; i++) {
-        char *initial_filename = initial_names_list.data[i];
-        char *new_filename = new_names_list.data[i];
+out:
+    if (listen_fd >= 0) {
+        close(listen_fd);
+        unlink(address.sun_path);
+    }
+    if (dir_index.inotify_fd >= 0) { close(dir_index.inotify_fd); }
+    dir_index_free(&dir_index);
+    free(buffer);
+    return status;
+}
+
+// Hands the run given by argv over to the daemon serving the directory of
+// dir_fd, along with the standard streams and working directory.
+// returns the exit status of the run
+int daemon_connect(int dir_fd, int argc, char *argv[]) {
+    struct sockaddr_un address;
+    if (!daemon_socket_address(dir_fd, &address)) { return EXIT_FAILURE; }
+
+    // the daemon runs in the working directory, so it must be passable
+    int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd < 0) {
+        perror("open");
+        fprintf(stderr, "Error: Could not open the working directory.\n");
+        return EXIT_FAILURE;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0 ||
+        connect(sock, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        perror("connect");
+        fprintf(stderr,
+                "Error: No daemon serves this directory, start one with "
+                "--daemon.\n");
+        if (sock >= 0) { close(sock); }
+        close(cwd_fd);
+        return EXIT_FAILURE;
+    }
+
+    CharBuffer arguments;
+    CharBuffer_init(&arguments);
+    for (int a = 0; a < argc; a++) {
+        char_buffer_append(&arguments, argv[a], strlen(argv[a]) + 1);
+    }
+
+    int fds[DAEMON_REQUEST_FDS] = {STDIN_FILENO, STDOUT_FILENO,
+                                   STDERR_FILENO, cwd_fd};
+    DaemonRequest request = {.argc = argc, .size = arguments.count};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {.iov_base = &request, .iov_len = sizeof(request)};
+    struct msghdr message = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control,
+                             .msg_controllen = sizeof(control)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    signal(SIGPIPE, SIG_IGN); // a daemon that exits fails the send instead
+    struct iovec data = {.iov_base = arguments.data,
+                         .iov_len = arguments.count};
+    unsigned char status = EXIT_FAILURE;
+    bool sent = sendmsg(sock, &message, MSG_NOSIGNAL) == sizeof(request) &&
+                fd_writev_all(sock, &data, 1);
+    if (!sent) {
+        perror("send");
+        fprintf(stderr, "Error: Could not send the run to the daemon.\n");
+    } else if (!fd_read_exact(sock, (char *)&status, 1)) {
+        fprintf(stderr, "Error: The daemon ended the run.\n");
+        status = EXIT_FAILURE;
+    }
+
+    close(cwd_fd);
+    CharBuffer_free(&arguments);
+    close(sock);
+    return status;
+}
+
+// ===== FOLDING ===============================================================
+
+// Keys under which names collide on case-insensitive or normalizing
+// filesystems (exFAT, SMB shares, ext4 casefold directories). Unicode is
+// covered for Latin (U+0080-024F and U+1E00-1EFF), Greek (U+0370-03FF),
+// Cyrillic (U+0400-04FF), the combining marks of U+0300-036F, the ligatures
+// U+FB00-FB06 and fullwidth ASCII, with the mappings of Unicode 14.0. Other
+// code points (Greek Extended, Hangul, CJK compatibility forms, ...) are
+// compared as they are, so names that differ only there are not caught.
+
+// canonical decomposition of a code point into one or two others, which may
+// decompose further
+typedef struct {
+    uint16_t code_point;
+    uint16_t first;
+    uint16_t second; // 0 if none
+} FoldDecomposition;
+
+// full case folding and compatibility mapping of a code point that has no
+// canonical decomposition, in decomposed form
+typedef struct {
+    uint16_t code_point;
+    uint16_t folded[3]; // 0-terminated unless all three are used
+} FoldMapping;
+
+static const FoldDecomposition fold_decompositions[] = {
+    {0x00C0, 0x0041, 0x0300}, {0x00C1, 0x0041, 0x0301},
+    {0x00C2, 0x0041, 0x0302}, {0x00C3, 0x0041, 0x0303},
+    {0x00C4, 0x0041, 0x0308}, {0x00C5, 0x0041, 0x030A},
+    {0x00C7, 0x0043, 0x0327}, {0x00C8, 0x0045, 0x0300},
+    {0x00C9, 0x0045, 0x0301}, {0x00CA, 0x0045, 0x0302},
+    {0x00CB, 0x0045, 0x0308}, {0x00CC, 0x0049, 0x0300},
+    {0x00CD, 0x0049, 0x0301}, {0x00CE, 0x0049, 0x0302},
+    {0x00CF, 0x0049, 0x0308}, {0x00D1, 0x004E, 0x0303},
+    {0x00D2, 0x004F, 0x0300}, {0x00D3, 0x004F, 0x0301},
+    {0x00D4, 0x004F, 0x0302}, {0x00D5, 0x004F, 0x0303},
+    {0x00D6, 0x004F, 0x0308}, {0x00D9, 0x0055, 0x0300},
+    {0x00DA, 0x0055, 0x0301}, {0x00DB, 0x0055, 0x0302},
+    {0x00DC, 0x0055, 0x0308}, {0x00DD, 0x0059, 0x0301},
+    {0x00E0, 0x0061, 0x0300}, {0x00E1, 0x0061, 0x0301},
+    {0x00E2, 0x0061, 0x0302}, {0x00E3, 0x0061, 0x0303},
+    {0x00E4, 0x0061, 0x0308}, {0x00E5, 0x0061, 0x030A},
+    {0x00E7, 0x0063, 0x0327}, {0x00E8, 0x0065, 0x0300},
+    {0x00E9, 0x0065, 0x0301}, {0x00EA, 0x0065, 0x0302},
+    {0x00EB, 0x0065, 0x0308}, {0x00EC, 0x0069, 0x0300},
+    {0x00ED, 0x0069, 0x0301}, {0x00EE, 0x0069, 0x0302},
+    {0x00EF, 0x0069, 0x0308}, {0x00F1, 0x006E, 0x0303},
+    {0x00F2, 0x006F, 0x0300}, {0x00F3, 0x006F, 0x0301},
+    {0x00F4, 0x006F, 0x0302}, {0x00F5, 0x006F, 0x0303},
+    {0x00F6, 0x006F, 0x0308}, {0x00F9, 0x0075, 0x0300},
+    {0x00FA, 0x0075, 0x0301}, {0x00FB, 0x0075, 0x0302},
+    {0x00FC, 0x0075, 0x0308}, {0x00FD, 0x0079, 0x0301},
+    {0x00FF, 0x0079, 0x0308}, {0x0100, 0x0041, 0x0304},
+    {0x0101, 0x0061, 0x0304}, {0x0102, 0x0041, 0x0306},
+    {0x0103, 0x0061, 0x0306}, {0x0104, 0x0041, 0x0328},
+    {0x0105, 0x0061, 0x0328}, {0x0106, 0x0043, 0x0301},
+    {0x0107, 0x0063, 0x0301}, {0x0108, 0x0043, 0x0302},
+    {0x0109, 0x0063, 0x0302}, {0x010A, 0x0043, 0x0307},
+    {0x010B, 0x0063, 0x0307}, {0x010C, 0x0043, 0x030C},
+    {0x010D, 0x0063, 0x030C}, {0x010E, 0x0044, 0x030C},
+    {0x010F, 0x0064, 0x030C}, {0x0112, 0x0045, 0x0304},
+    {0x0113, 0x0065, 0x0304}, {0x0114, 0x0045, 0x0306},
+    {0x0115, 0x0065, 0x0306}, {0x0116, 0x0045, 0x0307},
+    {0x0117, 0x0065, 0x0307}, {0x0118, 0x0045, 0x0328},
+    {0x0119, 0x0065, 0x0328}, {0x011A, 0x0045, 0x030C},
+    {0x011B, 0x0065, 0x030C}, {0x011C, 0x0047, 0x0302},
+    {0x011D, 0x0067, 0x0302}, {0x011E, 0x0047, 0x0306},
+    {0x011F, 0x0067, 0x0306}, {0x0120, 0x0047, 0x0307},
+    {0x0121, 0x0067, 0x0307}, {0x0122, 0x0047, 0x0327},
+    {0x0123, 0x0067, 0x0327}, {0x0124, 0x0048, 0x0302},
+    {0x0125, 0x0068, 0x0302}, {0x0128, 0x0049, 0x0303},
+    {0x0129, 0x0069, 0x0303}, {0x012A, 0x0049, 0x0304},
+    {0x012B, 0x0069, 0x0304}, {0x012C, 0x0049, 0x0306},
+    {0x012D, 0x0069, 0x0306}, {0x012E, 0x0049, 0x0328},
+    {0x012F, 0x0069, 0x0328}, {0x0130, 0x0049, 0x0307},
+    {0x0134, 0x004A, 0x0302}, {0x0135, 0x006A, 0x0302},
+    {0x0136, 0x004B, 0x0327}, {0x0137, 0x006B, 0x0327},
+    {0x0139, 0x004C, 0x0301}, {0x013A, 0x006C, 0x0301},
+    {0x013B, 0x004C, 0x0327}, {0x013C, 0x006C, 0x0327},
+    {0x013D, 0x004C, 0x030C}, {0x013E, 0x006C, 0x030C},
+    {0x0143, 0x004E, 0x0301}, {0x0144, 0x006E, 0x0301},
+    {0x0145, 0x004E, 0x0327}, {0x0146, 0x006E, 0x0327},
+    {0x0147, 0x004E, 0x030C}, {0x0148, 0x006E, 0x030C},
+    {0x014C, 0x004F, 0x0304}, {0x014D, 0x006F, 0x0304},
+    {0x014E, 0x004F, 0x0306}, {0x014F, 0x006F, 0x0306},
+    {0x0150, 0x004F, 0x030B}, {0x0151, 0x006F, 0x030B},
+    {0x0154, 0x0052, 0x0301}, {0x0155, 0x0072, 0x0301},
+    {0x0156, 0x0052, 0x0327}, {0x0157, 0x0072, 0x0327},
+    {0x0158, 0x0052, 0x030C}, {0x0159, 0x0072, 0x030C},
+    {0x015A, 0x0053, 0x0301}, {0x015B, 0x0073, 0x0301},
+    {0x015C, 0x0053, 0x0302}, {0x015D, 0x0073, 0x0302},
+    {0x015E, 0x0053, 0x0327}, {0x015F, 0x0073, 0x0327},
+    {0x0160, 0x0053, 0x030C}, {0x0161, 0x0073, 0x030C},
+    {0x0162, 0x0054, 0x0327}, {0x0163, 0x0074, 0x0327},
+    {0x0164, 0x0054, 0x030C}, {0x0165, 0x0074, 0x030C},
+    {0x0168, 0x0055, 0x0303}, {0x0169, 0x0075, 0x0303},
+    {0x016A, 0x0055, 0x0304}, {0x016B, 0x0075, 0x0304},
+    {0x016C, 0x0055, 0x0306}, {0x016D, 0x0075, 0x0306},
+    {0x016E, 0x0055, 0x030A}, {0x016F, 0x0075, 0x030A},
+    {0x0170, 0x0055, 0x030B}, {0x0171, 0x0075, 0x030B},
+    {0x0172, 0x0055, 0x0328}, {0x0173, 0x0075, 0x0328},
+    {0x0174, 0x0057, 0x0302}, {0x0175, 0x0077, 0x0302},
+    {0x0176, 0x0059, 0x0302}, {0x0177, 0x0079, 0x0302},
+    {0x0178, 0x0059, 0x0308}, {0x0179, 0x005A, 0x0301},
+    {0x017A, 0x007A, 0x0301}, {0x017B, 0x005A, 0x0307},
+    {0x017C, 0x007A, 0x0307}, {0x017D, 0x005A, 0x030C},
+    {0x017E, 0x007A, 0x030C}, {0x01A0, 0x004F, 0x031B},
+    {0x01A1, 0x006F, 0x031B}, {0x01AF, 0x0055, 0x031B},
+    {0x01B0, 0x0075, 0x031B}, {0x01CD, 0x0041, 0x030C},
+    {0x01CE, 0x0061, 0x030C}, {0x01CF, 0x0049, 0x030C},
+    {0x01D0, 0x0069, 0x030C}, {0x01D1, 0x004F, 0x030C},
+    {0x01D2, 0x006F, 0x030C}, {0x01D3, 0x0055, 0x030C},
+    {0x01D4, 0x0075, 0x030C}, {0x01D5, 0x00DC, 0x0304},
+    {0x01D6, 0x00FC, 0x0304}, {0x01D7, 0x00DC, 0x0301},
+    {0x01D8, 0x00FC, 0x0301}, {0x01D9, 0x00DC, 0x030C},
+    {0x01DA, 0x00FC, 0x030C}, {0x01DB, 0x00DC, 0x0300},
+    {0x01DC, 0x00FC, 0x0300}, {0x01DE, 0x00C4, 0x0304},
+    {0x01DF, 0x00E4, 0x0304}, {0x01E0, 0x0226, 0x0304},
+    {0x01E1, 0x0227, 0x0304}, {0x01E2, 0x00C6, 0x0304},
+    {0x01E3, 0x00E6, 0x0304}, {0x01E6, 0x0047, 0x030C},
+    {0x01E7, 0x0067, 0x030C}, {0x01E8, 0x004B, 0x030C},
+    {0x01E9, 0x006B, 0x030C}, {0x01EA, 0x004F, 0x0328},
+    {0x01EB, 0x006F, 0x0328}, {0x01EC, 0x01EA, 0x0304},
+    {0x01ED, 0x01EB, 0x0304}, {0x01EE, 0x01B7, 0x030C},
+    {0x01EF, 0x0292, 0x030C}, {0x01F0, 0x006A, 0x030C},
+    {0x01F4, 0x0047, 0x0301}, {0x01F5, 0x0067, 0x0301},
+    {0x01F8, 0x004E, 0x0300}, {0x01F9, 0x006E, 0x0300},
+    {0x01FA, 0x00C5, 0x0301}, {0x01FB, 0x00E5, 0x0301},
+    {0x01FC, 0x00C6, 0x0301}, {0x01FD, 0x00E6, 0x0301},
+    {0x01FE, 0x00D8, 0x0301}, {0x01FF, 0x00F8, 0x0301},
+    {0x0200, 0x0041, 0x030F}, {0x0201, 0x0061, 0x030F},
+    {0x0202, 0x0041, 0x0311}, {0x0203, 0x0061, 0x0311},
+    {0x0204, 0x0045, 0x030F}, {0x0205, 0x0065, 0x030F},
+    {0x0206, 0x0045, 0x0311}, {0x0207, 0x0065, 0x0311},
+    {0x0208, 0x0049, 0x030F}, {0x0209, 0x0069, 0x030F},
+    {0x020A, 0x0049, 0x0311}, {0x020B, 0x0069, 0x0311},
+    {0x020C, 0x004F, 0x030F}, {0x020D, 0x006F, 0x030F},
+    {0x020E, 0x004F, 0x0311}, {0x020F, 0x006F, 0x0311},
+    {0x0210, 0x0052, 0x030F}, {0x0211, 0x0072, 0x030F},
+    {0x0212, 0x0052, 0x0311}, {0x0213, 0x0072, 0x0311},
+    {0x0214, 0x0055, 0x030F}, {0x0215, 0x0075, 0x030F},
+    {0x0216, 0x0055, 0x0311}, {0x0217, 0x0075, 0x0311},
+    {0x0218, 0x0053, 0x0326}, {0x0219, 0x0073, 0x0326},
+    {0x021A, 0x0054, 0x0326}, {0x021B, 0x0074, 0x0326},
+    {0x021E, 0x0048, 0x030C}, {0x021F, 0x0068, 0x030C},
+    {0x0226, 0x0041, 0x0307}, {0x0227, 0x0061, 0x0307},
+    {0x0228, 0x0045, 0x0327}, {0x0229, 0x0065, 0x0327},
+    {0x022A, 0x00D6, 0x0304}, {0x022B, 0x00F6, 0x0304},
+    {0x022C, 0x00D5, 0x0304}, {0x022D, 0x00F5, 0x0304},
+    {0x022E, 0x004F, 0x0307}, {0x022F, 0x006F, 0x0307},
+    {0x0230, 0x022E, 0x0304}, {0x0231, 0x022F, 0x0304},
+    {0x0232, 0x0059, 0x0304}, {0x0233, 0x0079, 0x0304},
+    {0x0340, 0x0300, 0x0000}, {0x0341, 0x0301, 0x0000},
+    {0x0343, 0x0313, 0x0000}, {0x0344, 0x0308, 0x0301},
+    {0x0374, 0x02B9, 0x0000}, {0x037E, 0x003B, 0x0000},
+    {0x0385, 0x00A8, 0x0301}, {0x0386, 0x0391, 0x0301},
+    {0x0387, 0x00B7, 0x0000}, {0x0388, 0x0395, 0x0301},
+    {0x0389, 0x0397, 0x0301}, {0x038A, 0x0399, 0x0301},
+    {0x038C, 0x039F, 0x0301}, {0x038E, 0x03A5, 0x0301},
+    {0x038F, 0x03A9, 0x0301}, {0x0390, 0x03CA, 0x0301},
+    {0x03AA, 0x0399, 0x0308}, {0x03AB, 0x03A5, 0x0308},
+    {0x03AC, 0x03B1, 0x0301}, {0x03AD, 0x03B5, 0x0301},
+    {0x03AE, 0x03B7, 0x0301}, {0x03AF, 0x03B9, 0x0301},
+    {0x03B0, 0x03CB, 0x0301}, {0x03CA, 0x03B9, 0x0308},
+    {0x03CB, 0x03C5, 0x0308}, {0x03CC, 0x03BF, 0x0301},
+    {0x03CD, 0x03C5, 0x0301}, {0x03CE, 0x03C9, 0x0301},
+    {0x03D3, 0x03D2, 0x0301}, {0x03D4, 0x03D2, 0x0308},
+    {0x0400, 0x0415, 0x0300}, {0x0401, 0x0415, 0x0308},
+    {0x0403, 0x0413, 0x0301}, {0x0407, 0x0406, 0x0308},
+    {0x040C, 0x041A, 0x0301}, {0x040D, 0x0418, 0x0300},
+    {0x040E, 0x0423, 0x0306}, {0x0419, 0x0418, 0x0306},
+    {0x0439, 0x0438, 0x0306}, {0x0450, 0x0435, 0x0300},
+    {0x0451, 0x0435, 0x0308}, {0x0453, 0x0433, 0x0301},
+    {0x0457, 0x0456, 0x0308}, {0x045C, 0x043A, 0x0301},
+    {0x045D, 0x0438, 0x0300}, {0x045E, 0x0443, 0x0306},
+    {0x0476, 0x0474, 0x030F}, {0x0477, 0x0475, 0x030F},
+    {0x04C1, 0x0416, 0x0306}, {0x04C2, 0x0436, 0x0306},
+    {0x04D0, 0x0410, 0x0306}, {0x04D1, 0x0430, 0x0306},
+    {0x04D2, 0x0410, 0x0308}, {0x04D3, 0x0430, 0x0308},
+    {0x04D6, 0x0415, 0x0306}, {0x04D7, 0x0435, 0x0306},
+    {0x04DA, 0x04D8, 0x0308}, {0x04DB, 0x04D9, 0x0308},
+    {0x04DC, 0x0416, 0x0308}, {0x04DD, 0x0436, 0x0308},
+    {0x04DE, 0x0417, 0x0308}, {0x04DF, 0x0437, 0x0308},
+    {0x04E2, 0x0418, 0x0304}, {0x04E3, 0x0438, 0x0304},
+    {0x04E4, 0x0418, 0x0308}, {0x04E5, 0x0438, 0x0308},
+    {0x04E6, 0x041E, 0x0308}, {0x04E7, 0x043E, 0x0308},
+    {0x04EA, 0x04E8, 0x0308}, {0x04EB, 0x04E9, 0x0308},
+    {0x04EC, 0x042D, 0x0308}, {0x04ED, 0x044D, 0x0308},
+    {0x04EE, 0x0423, 0x0304}, {0x04EF, 0x0443, 0x0304},
+    {0x04F0, 0x0423, 0x0308}, {0x04F1, 0x0443, 0x0308},
+    {0x04F2, 0x0423, 0x030B}, {0x04F3, 0x0443, 0x030B},
+    {0x04F4, 0x0427, 0x0308}, {0x04F5, 0x0447, 0x0308},
+    {0x04F8, 0x042B, 0x0308}, {0x04F9, 0x044B, 0x0308},
+    {0x1E00, 0x0041, 0x0325}, {0x1E01, 0x0061, 0x0325},
+    {0x1E02, 0x0042, 0x0307}, {0x1E03, 0x0062, 0x0307},
+    {0x1E04, 0x0042, 0x0323}, {0x1E05, 0x0062, 0x0323},
+    {0x1E06, 0x0042, 0x0331}, {0x1E07, 0x0062, 0x0331},
+    {0x1E08, 0x00C7, 0x0301}, {0x1E09, 0x00E7, 0x0301},
+    {0x1E0A, 0x0044, 0x0307}, {0x1E0B, 0x0064, 0x0307},
+    {0x1E0C, 0x0044, 0x0323}, {0x1E0D, 0x0064, 0x0323},
+    {0x1E0E, 0x0044, 0x0331}, {0x1E0F, 0x0064, 0x0331},
+    {0x1E10, 0x0044, 0x0327}, {0x1E11, 0x0064, 0x0327},
+    {0x1E12, 0x0044, 0x032D}, {0x1E13, 0x0064, 0x032D},
+    {0x1E14, 0x0112, 0x0300}, {0x1E15, 0x0113, 0x0300},
+    {0x1E16, 0x0112, 0x0301}, {0x1E17, 0x0113, 0x0301},
+    {0x1E18, 0x0045, 0x032D}, {0x1E19, 0x0065, 0x032D},
+    {0x1E1A, 0x0045, 0x0330}, {0x1E1B, 0x0065, 0x0330},
+    {0x1E1C, 0x0228, 0x0306}, {0x1E1D, 0x0229, 0x0306},
+    {0x1E1E, 0x0046, 0x0307}, {0x1E1F, 0x0066, 0x0307},
+    {0x1E20, 0x0047, 0x0304}, {0x1E21, 0x0067, 0x0304},
+    {0x1E22, 0x0048, 0x0307}, {0x1E23, 0x0068, 0x0307},
+    {0x1E24, 0x0048, 0x0323}, {0x1E25, 0x0068, 0x0323},
+    {0x1E26, 0x0048, 0x0308}, {0x1E27, 0x0068, 0x0308},
+    {0x1E28, 0x0048, 0x0327}, {0x1E29, 0x0068, 0x0327},
+    {0x1E2A, 0x0048, 0x032E}, {0x1E2B, 0x0068, 0x032E},
+    {0x1E2C, 0x0049, 0x0330}, {0x1E2D, 0x0069, 0x0330},
+    {0x1E2E, 0x00CF, 0x0301}, {0x1E2F, 0x00EF, 0x0301},
+    {0x1E30, 0x004B, 0x0301}, {0x1E31, 0x006B, 0x0301},
+    {0x1E32, 0x004B, 0x0323}, {0x1E33, 0x006B, 0x0323},
+    {0x1E34, 0x004B, 0x0331}, {0x1E35, 0x006B, 0x0331},
+    {0x1E36, 0x004C, 0x0323}, {0x1E37, 0x006C, 0x0323},
+    {0x1E38, 0x1E36, 0x0304}, {0x1E39, 0x1E37, 0x0304},
+    {0x1E3A, 0x004C, 0x0331}, {0x1E3B, 0x006C, 0x0331},
+    {0x1E3C, 0x004C, 0x032D}, {0x1E3D, 0x006C, 0x032D},
+    {0x1E3E, 0x004D, 0x0301}, {0x1E3F, 0x006D, 0x0301},
+    {0x1E40, 0x004D, 0x0307}, {0x1E41, 0x006D, 0x0307},
+    {0x1E42, 0x004D, 0x0323}, {0x1E43, 0x006D, 0x0323},
+    {0x1E44, 0x004E, 0x0307}, {0x1E45, 0x006E, 0x0307},
+    {0x1E46, 0x004E, 0x0323}, {0x1E47, 0x006E, 0x0323},
+    {0x1E48, 0x004E, 0x0331}, {0x1E49, 0x006E, 0x0331},
+    {0x1E4A, 0x004E, 0x032D}, {0x1E4B, 0x006E, 0x032D},
+    {0x1E4C, 0x00D5, 0x0301}, {0x1E4D, 0x00F5, 0x0301},
+    {0x1E4E, 0x00D5, 0x0308}, {0x1E4F, 0x00F5, 0x0308},
+    {0x1E50, 0x014C, 0x0300}, {0x1E51, 0x014D, 0x0300},
+    {0x1E52, 0x014C, 0x0301}, {0x1E53, 0x014D, 0x0301},
+    {0x1E54, 0x0050, 0x0301}, {0x1E55, 0x0070, 0x0301},
+    {0x1E56, 0x0050, 0x0307}, {0x1E57, 0x0070, 0x0307},
+    {0x1E58, 0x0052, 0x0307}, {0x1E59, 0x0072, 0x0307},
+    {0x1E5A, 0x0052, 0x0323}, {0x1E5B, 0x0072, 0x0323},
+    {0x1E5C, 0x1E5A, 0x0304}, {0x1E5D, 0x1E5B, 0x0304},
+    {0x1E5E, 0x0052, 0x0331}, {0x1E5F, 0x0072, 0x0331},
+    {0x1E60, 0x0053, 0x0307}, {0x1E61, 0x0073, 0x0307},
+    {0x1E62, 0x0053, 0x0323}, {0x1E63, 0x0073, 0x0323},
+    {0x1E64, 0x015A, 0x0307}, {0x1E65, 0x015B, 0x0307},
+    {0x1E66, 0x0160, 0x0307}, {0x1E67, 0x0161, 0x0307},
+    {0x1E68, 0x1E62, 0x0307}, {0x1E69, 0x1E63, 0x0307},
+    {0x1E6A, 0x0054, 0x0307}, {0x1E6B, 0x0074, 0x0307},
+    {0x1E6C, 0x0054, 0x0323}, {0x1E6D, 0x0074, 0x0323},
+    {0x1E6E, 0x0054, 0x0331}, {0x1E6F, 0x0074, 0x0331},
+    {0x1E70, 0x0054, 0x032D}, {0x1E71, 0x0074, 0x032D},
+    {0x1E72, 0x0055, 0x0324}, {0x1E73, 0x0075, 0x0324},
+    {0x1E74, 0x0055, 0x0330}, {0x1E75, 0x0075, 0x0330},
+    {0x1E76, 0x0055, 0x032D}, {0x1E77, 0x0075, 0x032D},
+    {0x1E78, 0x0168, 0x0301}, {0x1E79, 0x0169, 0x0301},
+    {0x1E7A, 0x016A, 0x0308}, {0x1E7B, 0x016B, 0x0308},
+    {0x1E7C, 0x0056, 0x0303}, {0x1E7D, 0x0076, 0x0303},
+    {0x1E7E, 0x0056, 0x0323}, {0x1E7F, 0x0076, 0x0323},
+    {0x1E80, 0x0057, 0x0300}, {0x1E81, 0x0077, 0x0300},
+    {0x1E82, 0x0057, 0x0301}, {0x1E83, 0x0077, 0x0301},
+    {0x1E84, 0x0057, 0x0308}, {0x1E85, 0x0077, 0x0308},
+    {0x1E86, 0x0057, 0x0307}, {0x1E87, 0x0077, 0x0307},
+    {0x1E88, 0x0057, 0x0323}, {0x1E89, 0x0077, 0x0323},
+    {0x1E8A, 0x0058, 0x0307}, {0x1E8B, 0x0078, 0x0307},
+    {0x1E8C, 0x0058, 0x0308}, {0x1E8D, 0x0078, 0x0308},
+    {0x1E8E, 0x0059, 0x0307}, {0x1E8F, 0x0079, 0x0307},
+    {0x1E90, 0x005A, 0x0302}, {0x1E91, 0x007A, 0x0302},
+    {0x1E92, 0x005A, 0x0323}, {0x1E93, 0x007A, 0x0323},
+    {0x1E94, 0x005A, 0x0331}, {0x1E95, 0x007A, 0x0331},
+    {0x1E96, 0x0068, 0x0331}, {0x1E97, 0x0074, 0x0308},
+    {0x1E98, 0x0077, 0x030A}, {0x1E99, 0x0079, 0x030A},
+    {0x1E9B, 0x017F, 0x0307}, {0x1EA0, 0x0041, 0x0323},
+    {0x1EA1, 0x0061, 0x0323}, {0x1EA2, 0x0041, 0x0309},
+    {0x1EA3, 0x0061, 0x0309}, {0x1EA4, 0x00C2, 0x0301},
+    {0x1EA5, 0x00E2, 0x0301}, {0x1EA6, 0x00C2, 0x0300},
+    {0x1EA7, 0x00E2, 0x0300}, {0x1EA8, 0x00C2, 0x0309},
+    {0x1EA9, 0x00E2, 0x0309}, {0x1EAA, 0x00C2, 0x0303},
+    {0x1EAB, 0x00E2, 0x0303}, {0x1EAC, 0x1EA0, 0x0302},
+    {0x1EAD, 0x1EA1, 0x0302}, {0x1EAE, 0x0102, 0x0301},
+    {0x1EAF, 0x0103, 0x0301}, {0x1EB0, 0x0102, 0x0300},
+    {0x1EB1, 0x0103, 0x0300}, {0x1EB2, 0x0102, 0x0309},
+    {0x1EB3, 0x0103, 0x0309}, {0x1EB4, 0x0102, 0x0303},
+    {0x1EB5, 0x0103, 0x0303}, {0x1EB6, 0x1EA0, 0x0306},
+    {0x1EB7, 0x1EA1, 0x0306}, {0x1EB8, 0x0045, 0x0323},
+    {0x1EB9, 0x0065, 0x0323}, {0x1EBA, 0x0045, 0x0309},
+    {0x1EBB, 0x0065, 0x0309}, {0x1EBC, 0x0045, 0x0303},
+    {0x1EBD, 0x0065, 0x0303}, {0x1EBE, 0x00CA, 0x0301},
+    {0x1EBF, 0x00EA, 0x0301}, {0x1EC0, 0x00CA, 0x0300},
+    {0x1EC1, 0x00EA, 0x0300}, {0x1EC2, 0x00CA, 0x0309},
+    {0x1EC3, 0x00EA, 0x0309}, {0x1EC4, 0x00CA, 0x0303},
+    {0x1EC5, 0x00EA, 0x0303}, {0x1EC6, 0x1EB8, 0x0302},
+    {0x1EC7, 0x1EB9, 0x0302}, {0x1EC8, 0x0049, 0x0309},
+    {0x1EC9, 0x0069, 0x0309}, {0x1ECA, 0x0049, 0x0323},
+    {0x1ECB, 0x0069, 0x0323}, {0x1ECC, 0x004F, 0x0323},
+    {0x1ECD, 0x006F, 0x0323}, {0x1ECE, 0x004F, 0x0309},
+    {0x1ECF, 0x006F, 0x0309}, {0x1ED0, 0x00D4, 0x0301},
+    {0x1ED1, 0x00F4, 0x0301}, {0x1ED2, 0x00D4, 0x0300},
+    {0x1ED3, 0x00F4, 0x0300}, {0x1ED4, 0x00D4, 0x0309},
+    {0x1ED5, 0x00F4, 0x0309}, {0x1ED6, 0x00D4, 0x0303},
+    {0x1ED7, 0x00F4, 0x0303}, {0x1ED8, 0x1ECC, 0x0302},
+    {0x1ED9, 0x1ECD, 0x0302}, {0x1EDA, 0x01A0, 0x0301},
+    {0x1EDB, 0x01A1, 0x0301}, {0x1EDC, 0x01A0, 0x0300},
+    {0x1EDD, 0x01A1, 0x0300}, {0x1EDE, 0x01A0, 0x0309},
+    {0x1EDF, 0x01A1, 0x0309}, {0x1EE0, 0x01A0, 0x0303},
+    {0x1EE1, 0x01A1, 0x0303}, {0x1EE2, 0x01A0, 0x0323},
+    {0x1EE3, 0x01A1, 0x0323}, {0x1EE4, 0x0055, 0x0323},
+    {0x1EE5, 0x0075, 0x0323}, {0x1EE6, 0x0055, 0x0309},
+    {0x1EE7, 0x0075, 0x0309}, {0x1EE8, 0x01AF, 0x0301},
+    {0x1EE9, 0x01B0, 0x0301}, {0x1EEA, 0x01AF, 0x0300},
+    {0x1EEB, 0x01B0, 0x0300}, {0x1EEC, 0x01AF, 0x0309},
+    {0x1EED, 0x01B0, 0x0309}, {0x1EEE, 0x01AF, 0x0303},
+    {0x1EEF, 0x01B0, 0x0303}, {0x1EF0, 0x01AF, 0x0323},
+    {0x1EF1, 0x01B0, 0x0323}, {0x1EF2, 0x0059, 0x0300},
+    {0x1EF3, 0x0079, 0x0300}, {0x1EF4, 0x0059, 0x0323},
+    {0x1EF5, 0x0079, 0x0323}, {0x1EF6, 0x0059, 0x0309},
+    {0x1EF7, 0x0079, 0x0309}, {0x1EF8, 0x0059, 0x0303},
+    {0x1EF9, 0x0079, 0x0303},
+};
+
+static const FoldMapping fold_mappings[] = {
+    {0x00A0, {0x0020}}, {0x00A8, {0x0020, 0x0308}}, {0x00AA, {0x0061}},
+    {0x00AF, {0x0020, 0x0304}}, {0x00B2, {0x0032}}, {0x00B3, {0x0033}},
+    {0x00B4, {0x0020, 0x0301}}, {0x00B5, {0x03BC}}, {0x00B8, {0x0020, 0x0327}},
+    {0x00B9, {0x0031}}, {0x00BA, {0x006F}}, {0x00BC, {0x0031, 0x2044, 0x0034}},
+    {0x00BD, {0x0031, 0x2044, 0x0032}}, {0x00BE, {0x0033, 0x2044, 0x0034}},
+    {0x00C6, {0x00E6}}, {0x00D0, {0x00F0}}, {0x00D8, {0x00F8}},
+    {0x00DE, {0x00FE}}, {0x00DF, {0x0073, 0x0073}}, {0x0110, {0x0111}},
+    {0x0126, {0x0127}}, {0x0132, {0x0069, 0x006A}}, {0x0133, {0x0069, 0x006A}},
+    {0x013F, {0x006C, 0x00B7}}, {0x0140, {0x006C, 0x00B7}}, {0x0141, {0x0142}},
+    {0x0149, {0x02BC, 0x006E}}, {0x014A, {0x014B}}, {0x0152, {0x0153}},
+    {0x0166, {0x0167}}, {0x017F, {0x0073}}, {0x0181, {0x0253}},
+    {0x0182, {0x0183}}, {0x0184, {0x0185}}, {0x0186, {0x0254}},
+    {0x0187, {0x0188}}, {0x0189, {0x0256}}, {0x018A, {0x0257}},
+    {0x018B, {0x018C}}, {0x018E, {0x01DD}}, {0x018F, {0x0259}},
+    {0x0190, {0x025B}}, {0x0191, {0x0192}}, {0x0193, {0x0260}},
+    {0x0194, {0x0263}}, {0x0196, {0x0269}}, {0x0197, {0x0268}},
+    {0x0198, {0x0199}}, {0x019C, {0x026F}}, {0x019D, {0x0272}},
+    {0x019F, {0x0275}}, {0x01A2, {0x01A3}}, {0x01A4, {0x01A5}},
+    {0x01A6, {0x0280}}, {0x01A7, {0x01A8}}, {0x01A9, {0x0283}},
+    {0x01AC, {0x01AD}}, {0x01AE, {0x0288}}, {0x01B1, {0x028A}},
+    {0x01B2, {0x028B}}, {0x01B3, {0x01B4}}, {0x01B5, {0x01B6}},
+    {0x01B7, {0x0292}}, {0x01B8, {0x01B9}}, {0x01BC, {0x01BD}},
+    {0x01C4, {0x0064, 0x007A, 0x030C}}, {0x01C5, {0x0064, 0x007A, 0x030C}},
+    {0x01C6, {0x0064, 0x007A, 0x030C}}, {0x01C7, {0x006C, 0x006A}},
+    {0x01C8, {0x006C, 0x006A}}, {0x01C9, {0x006C, 0x006A}},
+    {0x01CA, {0x006E, 0x006A}}, {0x01CB, {0x006E, 0x006A}},
+    {0x01CC, {0x006E, 0x006A}}, {0x01E4, {0x01E5}}, {0x01F1, {0x0064, 0x007A}},
+    {0x01F2, {0x0064, 0x007A}}, {0x01F3, {0x0064, 0x007A}}, {0x01F6, {0x0195}},
+    {0x01F7, {0x01BF}}, {0x021C, {0x021D}}, {0x0220, {0x019E}},
+    {0x0222, {0x0223}}, {0x0224, {0x0225}}, {0x023A, {0x2C65}},
+    {0x023B, {0x023C}}, {0x023D, {0x019A}}, {0x023E, {0x2C66}},
+    {0x0241, {0x0242}}, {0x0243, {0x0180}}, {0x0244, {0x0289}},
+    {0x0245, {0x028C}}, {0x0246, {0x0247}}, {0x0248, {0x0249}},
+    {0x024A, {0x024B}}, {0x024C, {0x024D}}, {0x024E, {0x024F}},
+    {0x0370, {0x0371}}, {0x0372, {0x0373}}, {0x0376, {0x0377}},
+    {0x037A, {0x0020, 0x0345}}, {0x037F, {0x03F3}}, {0x0384, {0x0020, 0x0301}},
+    {0x0391, {0x03B1}}, {0x0392, {0x03B2}}, {0x0393, {0x03B3}},
+    {0x0394, {0x03B4}}, {0x0395, {0x03B5}}, {0x0396, {0x03B6}},
+    {0x0397, {0x03B7}}, {0x0398, {0x03B8}}, {0x0399, {0x03B9}},
+    {0x039A, {0x03BA}}, {0x039B, {0x03BB}}, {0x039C, {0x03BC}},
+    {0x039D, {0x03BD}}, {0x039E, {0x03BE}}, {0x039F, {0x03BF}},
+    {0x03A0, {0x03C0}}, {0x03A1, {0x03C1}}, {0x03A3, {0x03C3}},
+    {0x03A4, {0x03C4}}, {0x03A5, {0x03C5}}, {0x03A6, {0x03C6}},
+    {0x03A7, {0x03C7}}, {0x03A8, {0x03C8}}, {0x03A9, {0x03C9}},
+    {0x03C2, {0x03C3}}, {0x03CF, {0x03D7}}, {0x03D0, {0x03B2}},
+    {0x03D1, {0x03B8}}, {0x03D2, {0x03C5}}, {0x03D5, {0x03C6}},
+    {0x03D6, {0x03C0}}, {0x03D8, {0x03D9}}, {0x03DA, {0x03DB}},
+    {0x03DC, {0x03DD}}, {0x03DE, {0x03DF}}, {0x03E0, {0x03E1}},
+    {0x03E2, {0x03E3}}, {0x03E4, {0x03E5}}, {0x03E6, {0x03E7}},
+    {0x03E8, {0x03E9}}, {0x03EA, {0x03EB}}, {0x03EC, {0x03ED}},
+    {0x03EE, {0x03EF}}, {0x03F0, {0x03BA}}, {0x03F1, {0x03C1}},
+    {0x03F2, {0x03C3}}, {0x03F4, {0x03B8}}, {0x03F5, {0x03B5}},
+    {0x03F7, {0x03F8}}, {0x03F9, {0x03C3}}, {0x03FA, {0x03FB}},
+    {0x03FD, {0x037B}}, {0x03FE, {0x037C}}, {0x03FF, {0x037D}},
+    {0x0402, {0x0452}}, {0x0404, {0x0454}}, {0x0405, {0x0455}},
+    {0x0406, {0x0456}}, {0x0408, {0x0458}}, {0x0409, {0x0459}},
+    {0x040A, {0x045A}}, {0x040B, {0x045B}}, {0x040F, {0x045F}},
+    {0x0410, {0x0430}}, {0x0411, {0x0431}}, {0x0412, {0x0432}},
+    {0x0413, {0x0433}}, {0x0414, {0x0434}}, {0x0415, {0x0435}},
+    {0x0416, {0x0436}}, {0x0417, {0x0437}}, {0x0418, {0x0438}},
+    {0x041A, {0x043A}}, {0x041B, {0x043B}}, {0x041C, {0x043C}},
+    {0x041D, {0x043D}}, {0x041E, {0x043E}}, {0x041F, {0x043F}},
+    {0x0420, {0x0440}}, {0x0421, {0x0441}}, {0x0422, {0x0442}},
+    {0x0423, {0x0443}}, {0x0424, {0x0444}}, {0x0425, {0x0445}},
+    {0x0426, {0x0446}}, {0x0427, {0x0447}}, {0x0428, {0x0448}},
+    {0x0429, {0x0449}}, {0x042A, {0x044A}}, {0x042B, {0x044B}},
+    {0x042C, {0x044C}}, {0x042D, {0x044D}}, {0x042E, {0x044E}},
+    {0x042F, {0x044F}}, {0x0460, {0x0461}}, {0x0462, {0x0463}},
+    {0x0464, {0x0465}}, {0x0466, {0x0467}}, {0x0468, {0x0469}},
+    {0x046A, {0x046B}}, {0x046C, {0x046D}}, {0x046E, {0x046F}},
+    {0x0470, {0x0471}}, {0x0472, {0x0473}}, {0x0474, {0x0475}},
+    {0x0478, {0x0479}}, {0x047A, {0x047B}}, {0x047C, {0x047D}},
+    {0x047E, {0x047F}}, {0x0480, {0x0481}}, {0x048A, {0x048B}},
+    {0x048C, {0x048D}}, {0x048E, {0x048F}}, {0x0490, {0x0491}},
+    {0x0492, {0x0493}}, {0x0494, {0x0495}}, {0x0496, {0x0497}},
+    {0x0498, {0x0499}}, {0x049A, {0x049B}}, {0x049C, {0x049D}},
+    {0x049E, {0x049F}}, {0x04A0, {0x04A1}}, {0x04A2, {0x04A3}},
+    {0x04A4, {0x04A5}}, {0x04A6, {0x04A7}}, {0x04A8, {0x04A9}},
+    {0x04AA, {0x04AB}}, {0x04AC, {0x04AD}}, {0x04AE, {0x04AF}},
+    {0x04B0, {0x04B1}}, {0x04B2, {0x04B3}}, {0x04B4, {0x04B5}},
+    {0x04B6, {0x04B7}}, {0x04B8, {0x04B9}}, {0x04BA, {0x04BB}},
+    {0x04BC, {0x04BD}}, {0x04BE, {0x04BF}}, {0x04C0, {0x04CF}},
+    {0x04C3, {0x04C4}}, {0x04C5, {0x04C6}}, {0x04C7, {0x04C8}},
+    {0x04C9, {0x04CA}}, {0x04CB, {0x04CC}}, {0x04CD, {0x04CE}},
+    {0x04D4, {0x04D5}}, {0x04D8, {0x04D9}}, {0x04E0, {0x04E1}},
+    {0x04E8, {0x04E9}}, {0x04F6, {0x04F7}}, {0x04FA, {0x04FB}},
+    {0x04FC, {0x04FD}}, {0x04FE, {0x04FF}}, {0x1E9A, {0x0061, 0x02BE}},
+    {0x1E9E, {0x0073, 0x0073}}, {0x1EFA, {0x1EFB}}, {0x1EFC, {0x1EFD}},
+    {0x1EFE, {0x1EFF}}, {0xFB00, {0x0066, 0x0066}}, {0xFB01, {0x0066, 0x0069}},
+    {0xFB02, {0x0066, 0x006C}}, {0xFB03, {0x0066, 0x0066, 0x0069}},
+    {0xFB04, {0x0066, 0x0066, 0x006C}}, {0xFB05, {0x0073, 0x0074}},
+    {0xFB06, {0x0073, 0x0074}},
+};
+
+static const uint8_t fold_mark_classes[0x70] = {
+    230, 230, 230, 230, 230, 230, 230, 230, 230, 230, 230, 230, 230, 230,
+    230, 230, 230, 230, 230, 230, 230, 232, 220, 220, 220, 220, 232, 216,
+    220, 220, 220, 220, 220, 202, 202, 220, 220, 220, 220, 202, 202, 220,
+    220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 1, 1, 1, 1,
+    1, 220, 220, 220, 220, 230, 230, 230, 230, 230, 230, 230, 230, 240,
+    230, 220, 220, 220, 230, 230, 230, 220, 220, 0, 230, 230, 230, 220,
+    220, 220, 220, 230, 232, 220, 220, 230, 233, 234, 234, 233, 234, 234,
+    233, 230, 230, 230, 230, 230, 230, 230, 230, 230, 230, 230, 230, 230,
+};
+
+// bytes of malformed UTF-8 are keyed as themselves
+#define FOLD_RAW 0x80000000u
+
+// Lowercases the ASCII letters of length bytes at src into dst if lower is
+// set, else copies them, 16 bytes at a time where SSE2 or NEON is available.
+// returns whether every byte is ASCII
+static bool ascii_fold(const char *src, char *dst, size_t length, bool lower) {
+    size_t i = 0;
+    bool ascii = true;
+#if defined(__SSE2__)
+    const __m128i before_a = _mm_set1_epi8('A' - 1);
+    const __m128i after_z = _mm_set1_epi8('Z' + 1);
+    const __m128i bit = _mm_set1_epi8(lower ? 0x20 : 0);
+    __m128i high = _mm_setzero_si128();
+    for (; i + 16 <= length; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+        // signed compares, bytes from 0x80 up are below 'A'
+        __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, before_a),
+                                      _mm_cmplt_epi8(v, after_z));
+        v = _mm_or_si128(v, _mm_and_si128(upper, bit));
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+        high = _mm_or_si128(high, v);
+    }
+    ascii = _mm_movemask_epi8(high) == 0;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t a = vdupq_n_u8('A');
+    const uint8x16_t letters = vdupq_n_u8(26);
+    const uint8x16_t bit = vdupq_n_u8(lower ? 0x20 : 0);
+    uint8x16_t high = vdupq_n_u8(0);
+    for (; i + 16 <= length; i += 16) {
+        uint8x16_t v = vld1q_u8((const uint8_t *)(src + i));
+        uint8x16_t upper = vcltq_u8(vsubq_u8(v, a), letters);
+        v = vorrq_u8(v, vandq_u8(upper, bit));
+        vst1q_u8((uint8_t *)(dst + i), v);
+        high = vorrq_u8(high, v);
+    }
+    ascii = vmaxvq_u8(high) < 0x80;
+#endif
+    for (; i < length; i++) {
+        char c = src[i];
+        if (lower && c >= 'A' && c <= 'Z') { c += 'a' - 'A'; }
+        ascii = ascii && (unsigned char)c < 0x80;
+        dst[i] = c;
+    }
+    return ascii;
+}
+
+// Decodes the code point at the start of the length bytes at s into
+// code_point, which is FOLD_RAW plus the first byte if they are not valid
+// UTF-8.
+// returns the bytes consumed
+static size_t utf8_decode(const unsigned char *s, size_t length,
+                          uint32_t *code_point) {
+    size_t size = s[0] >= 0xf0 ? 4 : s[0] >= 0xe0 ? 3 : s[0] >= 0xc0 ? 2 : 1;
+    uint32_t c = size == 1 ? s[0] : s[0] & (0x7f >> size);
+    bool valid = size <= length && (size > 1 || s[0] < 0x80);
+    for (size_t k = 1; valid && k < size; k++) {
+        valid = (s[k] & 0xc0) == 0x80;
+        c = (c << 6) | (s[k] & 0x3f);
+    }
+    static const uint32_t minimum[] = {0, 0, 0x80, 0x800, 0x10000};
+    if (!valid || c < minimum[size] || c > 0x10ffff ||
+        (c >= 0xd800 && c <= 0xdfff)) {
+        *code_point = FOLD_RAW | s[0];
+        return 1;
+    }
+    *code_point = c;
+    return size;
+}
+
+static char *utf8_encode(char *out, uint32_t c) {
+    if (c & FOLD_RAW) {
+        *out++ = (char)(c & 0xff);
+    } else if (c < 0x80) {
+        *out++ = (char)c;
+    } else if (c < 0x800) {
+        *out++ = (char)(0xc0 | c >> 6);
+        *out++ = (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+        *out++ = (char)(0xe0 | c >> 12);
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (c & 0x3f));
+    } else {
+        *out++ = (char)(0xf0 | c >> 18);
+        *out++ = (char)(0x80 | ((c >> 12) & 0x3f));
+        *out++ = (char)(0x80 | ((c >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (c & 0x3f));
+    }
+    return out;
+}
+
+static int fold_entry_compare(const void *key, const void *entry) {
+    // both tables start with their code point
+    uint16_t code_point = *(const uint16_t *)key;
+    return (int)code_point - (int)*(const uint16_t *)entry;
+}
+
+// Appends the code points c decomposes to, case folded and mapped to their
+// compatibility equivalents if casefold is set, to out.
+// returns the new end of out
+static uint32_t *code_point_fold(uint32_t c, bool casefold, uint32_t *out) {
+    if (c < 0x80) {
+        *out++ = casefold && c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+        return out;
+    }
+    if (casefold && c >= 0xff01 && c <= 0xff5e) {
+        return code_point_fold(c - 0xfee0, casefold, out); // fullwidth ASCII
+    }
+    if (c > 0xffff) {
+        *out++ = c;
+        return out;
+    }
+
+    uint16_t key = (uint16_t)c;
+    const FoldDecomposition *decomposition =
+        bsearch(&key, fold_decompositions,
+                sizeof(fold_decompositions) / sizeof(*fold_decompositions),
+                sizeof(*fold_decompositions), fold_entry_compare);
+    if (decomposition) {
+        out = code_point_fold(decomposition->first, casefold, out);
+        if (decomposition->second) {
+            out = code_point_fold(decomposition->second, casefold, out);
+        }
+        return out;
+    }
+
+    const FoldMapping *mapping =
+        casefold ? bsearch(&key, fold_mappings,
+                           sizeof(fold_mappings) / sizeof(*fold_mappings),
+                           sizeof(*fold_mappings), fold_entry_compare)
+                 : NULL;
+    if (!mapping) {
+        *out++ = c;
+        return out;
+    }
+    for (int k = 0; k < 3 && mapping->folded[k]; k++) {
+        *out++ = mapping->folded[k];
+    }
+    return out;
+}
+
+// canonical combining class, 0 for code points that are not covered marks
+static inline uint8_t mark_class(uint32_t c) {
+    if (c >= 0x300 && c < 0x370) { return fold_mark_classes[c - 0x300]; }
+    return c >= 0x483 && c <= 0x487 ? 230 : 0; // Cyrillic
+}
 
-        // skip if unchanged
-        if (strcmp(initial_filename, new_filename) == 0) { continue; }
+// Writes the key of name under mode to key, which holds 3 * strlen(name) + 1
+// bytes, using scratch for as many code points. Names that differ only in
+// ASCII letter case, or in the covered Latin, Greek and Cyrillic code points
+// (see above), get equal keys when they collide under mode; code points
+// outside that subset are kept as they are, so collisions through them are
+// missed. Unicode keys are decomposed and case folded rather than composed,
+// which compares the same.
+void fold_key_write(const char *name, FoldMode mode, char *key,
+                    uint32_t *scratch) {
+    size_t length = strlen(name);
+    bool casefold = mode != FOLD_NFC;
+    bool ascii = ascii_fold(name, key, length, casefold);
+    if (ascii || mode == FOLD_ASCII) {
+        key[length] = '\0';
+        return;
+    }
+
+    const unsigned char *s = (const unsigned char *)name;
+    uint32_t *end = scratch;
+    for (size_t i = 0; i < length;) {
+        uint32_t c;
+        i += utf8_decode(s + i, length - i, &c);
+        end = code_point_fold(c, casefold, end);
+    }
+
+    // combining marks in canonical order, an insertion sort of each run
+    for (uint32_t *c = scratch + 1; c < end; c++) {
+        uint8_t class = mark_class(*c);
+        if (class == 0) { continue; }
+        uint32_t mark = *c, *at = c;
+        for (; at > scratch && mark_class(at[-1]) > class; at--) {
+            at[0] = at[-1];
+        }
+        *at = mark;
+    }
+
+    // ypogegrammeni folds to iota, a starter, once it is in order
+    char *out = key;
+    for (uint32_t *c = scratch; c < end; c++) {
+        out = utf8_encode(out, casefold && *c == 0x345 ? 0x3b9 : *c);
+    }
+    *out = '\0';
+}
+
+// state of a --fold check, new names are indexed by key and the entries of
+// the directories they are in looked up one at a time
+typedef struct {
+    const RenameTable *table;
+    const NameIndex *initial_index;
+    const Arguments *arguments;
+    char **keys;     // key of each new name
+    size_t *entries; // table entry of each key
+    NameIndex index; // over keys
+    CharBuffer key;  // key of the name being checked
+    uint32_t *scratch;
+    CharBuffer path; // path of the entry being checked
+    Arena arena;     // owns keys that differ from their names
+    bool success;
+} FoldCheck;
+
+// writes the key of name to check->key (and returns it)
+// returns NULL, failing the check, if there is no memory for the key
+static char *fold_check_key(FoldCheck *check, const char *name) {
+    size_t size = 3 * strlen(name) + 1;
+    if (size > check->key.capacity) {
+        char *key = realloc(check->key.data, size);
+        if (key) { check->key.data = key; }
+        uint32_t *scratch = realloc(check->scratch, size * sizeof(uint32_t));
+        if (scratch) { check->scratch = scratch; }
+        if (!key || !scratch) {
+            perror("realloc");
+            check->success = false;
+            return NULL;
+        }
+        check->key.capacity = size;
+    }
+    fold_key_write(name, check->arguments->fold, check->key.data,
+                   check->scratch);
+    return check->key.data;
+}
+
+// reports if existing entry name collides with a new name other than its own
+static void fold_check_entry(FoldCheck *check, const char *name) {
+    const char *key = fold_check_key(check, name);
+    if (!key) { return; }
+    size_t k = name_index_find(&check->index, key, name_hash(key));
+    if (k == INDEX_NONE) { return; }
 
-        // if marked for deletion
-        if (new_filename[0] == arguments.delete_char) {
-            // trash
-            if (arguments.trash) {
-                FilenameList_add(&trash_list, strdup(initial_filename));
+    const RenameTable *table = check->table;
+    size_t i = check->entries[k];
+    const char *new_name = table->new_names[i];
+    // left to the exact checks, or the file itself
+    if (strcmp(name, new_name) == 0 ||
+        strcmp(name, table->initial_names[i]) == 0) {
+        return;
+    }
+
+    size_t t = name_index_find(check->initial_index, name, name_hash(name));
+    if (t == INDEX_NONE) {
+        if (check->arguments->force) { return; }
+        fprintf(stderr,
+                "Error: File '%s' collides with existing '%s' when folded.\n",
+                new_name, name);
+    } else if (table->new_names[t][0] == check->arguments->delete_char) {
+        return; // removed first
+    } else {
+        fprintf(stderr,
+                "Error: File '%s' collides with '%s' when folded, which is "
+                "renamed in the same run; rename them in separate runs.\n",
+                new_name, name);
+    }
+    check->success = false;
+}
+
+// Checks every entry of directory parent (a path below dir_fd, NULL for
+// dir_fd itself), read with getdents64() into buffer.
+// returns false if it cannot be read, a missing one is made by the run
+static bool fold_check_directory(FoldCheck *check, int dir_fd,
+                                 const char *parent, char *buffer,
+                                 size_t buffer_size) {
+    int scan_fd = openat(dir_fd, parent ? parent : ".",
+                         O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (scan_fd < 0) {
+        if (parent && (errno == ENOENT || errno == ENOTDIR)) { return true; }
+        perror("openat");
+        return false;
+    }
+
+    size_t prefix = 0;
+    check->path.count = 0;
+    if (parent) {
+        prefix = strlen(parent);
+        char_buffer_append(&check->path, parent, prefix);
+        char_buffer_append(&check->path, "/", 1);
+        prefix++;
+    }
+
+    bool success = true;
+    for (;;) {
+        long bytes = syscall(SYS_getdents64, scan_fd, buffer, buffer_size);
+        if (bytes < 0) {
+            perror("getdents64");
+            success = false;
+        }
+        if (bytes <= 0) { break; }
+
+        for (long offset = 0; offset < bytes;) {
+            LinuxDirent64 *entry = (LinuxDirent64 *)(buffer + offset);
+            offset += entry->d_reclen;
+            const char *name = entry->d_name;
+            if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
                 continue;
             }
-            // delete
-            else {
-                int result = remove(initial_filename);
-                if (result != 0) {
-                    perror("remove");
-                    fprintf(stderr, "Error: Could not delete file '%s'.\n",
-                            initial_filename);
-                    goto fail;
-                }
-                if (!arguments.silent) {
-                    delete_message_print(initial_filename);
-                }
-                continue;
+            if (parent) {
+                check->path.count = prefix;
+                char_buffer_append(&check->path, name, strlen(name) + 1);
+                name = check->path.data;
             }
+            fold_check_entry(check, name);
         }
+    }
+    close(scan_fd);
+    return success;
+}
 
-        // if instance of cyclic renaming
-        if (filename_list_has(&initial_names_list, new_filename)) {
-            char temp_filename[256];
-            unique_filepath_generate(temp_filename, sizeof(temp_filename),
-                                     "cbr_transition_file");
+// Checks new names on their keys under --fold: they must differ from each
+// other and from every entry of the directories they are in, except the file
+// taking the name, files removed before the renames run and, with -f, files
+// not in the run. Every collision is reported.
+// A new name colliding with a file renamed in the same run is rejected too:
+// plans order renames by exact names, so on a folding filesystem the rename
+// could run while the other file still holds the name.
+// returns whether no names collide
+bool fold_check(const RenameTable *table, const NameIndex *initial_index,
+                const Arguments *arguments, int dir_fd) {
+    char delete_char = arguments->delete_char;
+    FoldCheck check = {.table = table,
+                       .initial_index = initial_index,
+                       .arguments = arguments,
+                       .keys = malloc((table->count + 1) * sizeof(char *)),
+                       .entries = malloc((table->count + 1) * sizeof(size_t)),
+                       .scratch = NULL,
+                       .arena = {.head = NULL},
+                       .success = true};
+    char *buffer = malloc(arguments->scan_buffer);
+    if (!check.keys || !check.entries || !buffer) {
+        perror("malloc");
+        free(check.keys);
+        free(check.entries);
+        free(buffer);
+        return false;
+    }
+    CharBuffer_init(&check.key);
+    CharBuffer_init(&check.path);
+    name_index_init(&check.index, check.keys, table->count);
 
-            // will rename later from temp name to avoid conflict
-            bool success = file_rename(initial_filename, temp_filename);
-            if (!success) { goto fail; }
+    // new names must not collide with each other (exact duplicates were
+    // rejected already)
+    size_t count = 0;
+    for (size_t i = 0; i < table->count; i++) {
+        char *new_name = table->new_names[i];
+        if (new_name[0] == delete_char) { continue; }
 
-            RenamePath *rp = malloc(sizeof *rp);
-            *rp = (RenamePath){.initial_name = initial_filename,
-                               .temp_name = strdup(temp_filename),
-                               .new_name = new_filename};
-            RenamePathList_add(&rename_path_list, rp);
+        char *key = fold_check_key(&check, new_name);
+        if (!key) { break; }
+        key = strcmp(key, new_name) == 0 ? new_name
+                                         : arena_strdup(&check.arena, key);
+        check.keys[count] = key;
+        check.entries[count] = i;
+        size_t k = name_index_insert(&check.index, count, name_hash(key));
+        if (k == INDEX_NONE) {
+            count++;
+            continue;
         }
-        // else standard rename
-        else {
-            bool success = file_rename(initial_filename, new_filename);
-            if (!success) { goto fail; }
-            if (!arguments.silent) {
-                rename_message_print(initial_filename, new_filename);
-            }
+        fprintf(stderr,
+                "Error: Output filenames collide when folded ('%s' and "
+                "'%s').\n",
+                table->new_names[check.entries[k]], new_name);
+        check.success = false;
+    }
+
+    // nor with the entries of the directory, from the warm index if there
+    // is one, and of every directory new paths lead into
+    bool listed = true;
+    if (warm_index) {
+        for (size_t e = 0; e < warm_index->count; e++) {
+            if (warm_index->names[e][0] == '\0') { continue; } // removed
+            fold_check_entry(&check, warm_index->names[e]);
         }
+    } else {
+        listed = fold_check_directory(&check, dir_fd, NULL, buffer,
+                                      arguments->scan_buffer);
     }
 
-    // trash files in batches
-    if (trash_list.count > 0) {
-        // first argument is program itself, second is trash command
-        char *gio_args[200] = {"gio", "trash"};
-        int args_idx = 2;
+    FilenameList parents;
+    FilenameList_init(&parents);
+    NameIndex parent_index;
+    name_index_init(&parent_index, NULL, count);
+    for (size_t k = 0; listed && k < count; k++) {
+        const char *new_name = table->new_names[check.entries[k]];
+        const char *slash = strrchr(new_name, '/');
+        if (!slash) { continue; }
+
+        size_t length = slash - new_name;
+        char *parent = arena_alloc(&check.arena, length + 1);
+        memcpy(parent, new_name, length);
+        parent[length] = '\0';
+        FilenameList_add(&parents, parent);
+        parent_index.names = parents.data;
+        if (name_index_insert(&parent_index, parents.count - 1,
+                              name_hash(parent)) != INDEX_NONE) {
+            parents.count--;
+            continue;
+        }
+        listed = fold_check_directory(&check, dir_fd, parent, buffer,
+                                      arguments->scan_buffer);
+    }
+    if (!listed) {
+        fprintf(stderr, "Error: Cannot list the directories of new names.\n");
+        check.success = false;
+    }
 
-        for (int i = 0; i < trash_list.count; i++) {
-            gio_args[args_idx] = trash_list.data[i];
-            args_idx++;
+    FilenameList_free(&parents);
+    name_index_free(&parent_index);
+    name_index_free(&check.index);
+    free(buffer);
+    free(check.keys);
+    free(check.entries);
+    CharBuffer_free(&check.key);
+    CharBuffer_free(&check.path);
+    free(check.scratch);
+    arena_free(&check.arena);
+    return check.success;
+}
 
-            if (args_idx == ARRAY_LEN(gio_args) - 1) {
-                gio_args[args_idx] = NULL;
-                bool success = gio_trash(gio_args);
-                if (!success) { goto fail; }
-                args_idx = 2;
+// ===== MAIN ==================================================================
 
-                for (int j = 2; gio_args[j]; j++) {
-                    trash_message_print(gio_args[j]);
-                }
+// one run of cbr, also made by the daemon for each of its clients
+int cbr_main(int argc, char *argv[]) {
+    double start = monotonic_now();
+    FilenameList initial_names_list, new_names_list, walk_roots;
+    FilenameList transformed_names;
+    FilenameList_init(&initial_names_list);
+    FilenameList_init(&new_names_list);
+    FilenameList_init(&walk_roots);
+    FilenameList_init(&transformed_names);
+    FileIdList initial_ids; // of the initial names, where listing found them
+    FileIdList_init(&initial_ids);
+    Transform transform = {.pattern = NULL, .template = NULL};
+
+    // hash sets over input and output names
+    NameIndex initial_index = {.slots = NULL}, new_index = {.slots = NULL};
+
+    // owns filenames read from the directory and temporary names
+    Arena arena = {.head = NULL};
+
+    // names of all entries and the ordered operations on them
+    RenameTable table = {
+        .temp_names = NULL, .depths = NULL, .emptied = NULL, .count = 0};
+    Plan plan;
+    plan_init(&plan, &table);
+
+    // default arguments
+    Arguments arguments = {.delete_char = '#',
+                           .editor = NULL,
+                           .directory = ".",
+                           .from = NULL,
+                           .null_data = false,
+                           .progress = false,
+                           .subst = NULL,
+                           .template = NULL,
+                           .review = false,
+                           .resume = false,
+                           .rollback = false,
+                           .undo = NULL,
+                           .dry_run = false,
+                           .detach = false,
+                           .daemon = false,
+                           .connect = false,
+                           .json = false,
+                           .stats = false,
+                           .stats_file = NULL,
+                           .engine = ENGINE_SYNC,
+                           .jobs = 1,
+                           .scan_buffer = 1 << 20,
+                           .sort = SORT_NAME,
+                           .fold = FOLD_NONE,
+                           .force = false,
+                           .recursive = false,
+                           .silent = false,
+                           .trash = false,
+                           .files = &initial_names_list};
+
+    // parse arguments
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+    output_init(arguments.progress);
+    stats_init(&arguments, start);
+    stats_phase(STATS_LIST);
+
+    char *edit_buffer = NULL; // contents of edited temp file
+    char tmp_file_path[PATH_MAX] = "";
+    char undo_path[PATH_MAX] = ""; // record replayed by --undo
+    size_t undo_trashed = 0;       // its files restored from the trash
+    Staging staging = {.dir_fd = -1,
+                       .created = false,
+                       .dry_run = arguments.dry_run,
+                       .count = 0};
+    Trash trash = {.dir_fd = -1, .dir_path = NULL, .arena = {.head = NULL}};
+    TrashDirList_init(&trash.dirs);
+    FilenameList_init(&trash.trashed);
+    Journal journal = {.fd = -1, .dir_fd = -1};
+    Reaper reaper;
+    reaper_init(&reaper, &plan, arguments.detach);
+
+    // open target directory once, all file operations are relative to it
+    int dir_fd = open(arguments.directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        perror("open");
+        fprintf(stderr, "Error: Could not open directory '%s'.\n",
+                arguments.directory);
+        goto fail;
+    }
+    staging.dir_fd = dir_fd;
+    trash.dir_fd = dir_fd;
+    journal.dir_fd = dir_fd;
+    reaper.dir_fd = dir_fd;
+
+    // a daemon serves runs until it is stopped, clients hand theirs over
+    if (arguments.daemon || (arguments.connect && !warm_index)) {
+        int status = arguments.daemon ? daemon_run(dir_fd, &arguments)
+                                      : daemon_connect(dir_fd, argc, argv);
+        close(dir_fd);
+        return status;
+    }
+    // the index only stands for the directory it was built from
+    if (warm_index && !dir_index_serves(warm_index, dir_fd)) {
+        warm_index = NULL;
+    }
+
+    // trashinfo files record absolute paths
+    bool recover = arguments.resume || arguments.rollback;
+    if (arguments.trash || recover) {
+        trash.dir_path = realpath(arguments.directory, NULL);
+        if (!trash.dir_path) {
+            perror("realpath");
+            goto fail;
+        }
+    }
+
+    // an interrupted run is completed or undone before anything else
+    if (recover) {
+        bool recovered = journal_recover(dir_fd, &staging, &trash, &arguments,
+                                         arguments.rollback);
+        trash_close(&trash);
+        close(dir_fd);
+        stats_report();
+        return recovered ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    // dry runs write no journal, so they need none
+    if (!arguments.dry_run && !journal_check(&journal, &arguments)) {
+        goto fail;
+    }
+
+    // compile the transform once, before anything is listed
+    if (!transform_init(&transform, &arguments)) { goto fail; }
+
+    // read old and new names from a mapping instead of editing them, in one
+    // go with names pointing into the buffer
+    if (arguments.from) {
+        size_t size;
+        int from_fd = STDIN_FILENO;
+        if (strcmp(arguments.from, "-") != 0) {
+            from_fd = open(arguments.from, O_RDONLY | O_CLOEXEC);
+            if (from_fd < 0) {
+                perror("open");
+                fprintf(stderr, "Error: Could not open mapping '%s'.\n",
+                        arguments.from);
+                goto fail;
             }
         }
+        edit_buffer = fd_read_all(from_fd, &size);
+        if (from_fd != STDIN_FILENO) { close(from_fd); }
+        if (!edit_buffer) { goto fail; }
+
+        stats_phase(STATS_PARSE);
+        bool split = mapping_split(edit_buffer, size, arguments.null_data,
+                                   &initial_names_list, &new_names_list);
+        if (!split) { goto fail; }
+        stats_phase(STATS_LIST);
+    } else if (arguments.undo) {
+        // the recorded run, as a mapping back to the names it started from
+        edit_buffer = undo_record_read(dir_fd, &arguments, undo_path,
+                                       sizeof(undo_path), &initial_names_list,
+                                       &new_names_list, &undo_trashed);
+        if (!edit_buffer) { goto fail; }
+    }
+    bool mapped = arguments.from || arguments.undo;
+
+    // if no file arguments specified, populate input list with contents of
+    // target directory
+    // (listed names are classified by type, so they skip validation below)
+    bool listed = initial_names_list.count == 0 && !mapped;
+    if (listed && arguments.recursive) {
+        FilenameList_add(&walk_roots, ".");
+    } else if (listed && warm_index) {
+        bool copied = dir_index_list(warm_index, arguments.delete_char,
+                                     &initial_names_list);
+        if (!copied) { goto fail; }
+    } else if (listed) {
+        char *buffer = malloc(arguments.scan_buffer);
+        if (!buffer) {
+            perror("malloc");
+            goto fail;
+        }
+        bool scanned =
+            directory_scan(dir_fd, ".", buffer, arguments.scan_buffer,
+                           arguments.delete_char, &arena, &initial_names_list,
+                           &initial_ids, NULL);
+        free(buffer);
+        if (!scanned) { goto fail; }
+    } else {
+        stats_phase(STATS_VALIDATE_INPUT);
 
-        // flush buffer
-        if (args_idx > 2) {
-            gio_args[args_idx] = NULL;
-            bool success = gio_trash(gio_args);
-            if (!success) { goto fail; }
+        // check that input files exist
+        // and that they are regular or symbolic link files (or directories in
+        // recursive mode, walked unless they come from a mapping)
+        // every invalid file is reported before failing
+        size_t count = initial_names_list.count;
+        mode_t *types = malloc((count > 0 ? count : 1) * sizeof(mode_t));
+        initial_ids.data = malloc((count > 0 ? count : 1) * sizeof(FileId));
+        if (!types || !initial_ids.data) {
+            perror("malloc");
+            free(types);
+            goto fail;
+        }
+        initial_ids.capacity = initial_ids.count = count;
+        names_probe(dir_fd, initial_names_list.data, NULL, count,
+                    probe_thread_count(&arguments), types, initial_ids.data);
+        bool valid = true;
+        for (size_t i = 0; i < count; i++) {
+            char *filename = initial_names_list.data[i];
 
-            for (int j = 2; gio_args[j]; j++) {
-                trash_message_print(gio_args[j]);
+            if (types[i] == 0) {
+                fprintf(stderr, "Error: File '%s' does not exist.\n",
+                        filename);
+                valid = false;
+            } else if (types[i] == S_IFDIR && arguments.recursive) {
+                if (!mapped) { FilenameList_add(&walk_roots, filename); }
+            } else if (types[i] != S_IFREG && types[i] != S_IFLNK) {
+                fprintf(stderr,
+                        "Error: File '%s' is not a regular file or symbolic "
+                        "link.\n",
+                        filename);
+                valid = false;
             }
         }
+        free(types);
+        if (!valid) { goto fail; }
+    }
+
+    // walk directory trees
+    if (walk_roots.count > 0) {
+        stats_phase(STATS_LIST);
+        bool walked =
+            walk_run(dir_fd, &walk_roots, worker_thread_count(&arguments),
+                     &arguments, &arena, &initial_names_list, &initial_ids);
+        if (!walked) { goto fail; }
+    }
+
+    // check that there is at least one input filename
+    if (initial_names_list.count == 0) {
+        stats_report();
+        exit(EXIT_SUCCESS);
+    }
+
+    // names from the warm index of a daemon come without inodes
+    FileId *ids = initial_ids.count == initial_names_list.count
+                      ? initial_ids.data
+                      : NULL;
+
+    // sort file names, mappings keep their order as they come in pairs
+    if (!mapped) {
+        stats_phase(STATS_SORT);
+        names_sort(&initial_names_list, ids, arguments.sort, dir_fd);
+    }
+
+    // index input names, which must be unique
+    stats_phase(STATS_VALIDATE_INPUT);
+    name_index_init(&initial_index, initial_names_list.data,
+                    initial_names_list.count);
+    for (size_t i = 0; i < initial_names_list.count; i++) {
+        uint64_t hash = name_hash(initial_names_list.data[i]);
+        if (name_index_insert(&initial_index, i, hash) != INDEX_NONE) {
+            fprintf(stderr, "Error: Input filenames are not unique ('%s').\n",
+                    initial_names_list.data[i]);
+            goto fail;
+        }
+    }
+
+    // new names come from the mapping, the transform or the editor
+    bool unchanged = false; // whether the list was saved as it was shown
+    if (arguments.subst || arguments.template) {
+        stats_phase(STATS_EDIT);
+        bool transformed = transform_run(&transform, &initial_names_list,
+                                         worker_thread_count(&arguments),
+                                         &arena, &transformed_names);
+        if (!transformed) { goto fail; }
+
+        if (!arguments.review) {
+            new_names_list = transformed_names;
+            FilenameList_init(&transformed_names);
+        } else if (!names_edit(&transformed_names, &arguments, &arena,
+                               tmp_file_path, &edit_buffer, &new_names_list,
+                               &unchanged)) {
+            goto fail;
+        }
+    } else if (!mapped) {
+        // edit file list, new names point into edit_buffer
+        bool edited =
+            names_edit(&initial_names_list, &arguments, &arena, tmp_file_path,
+                       &edit_buffer, &new_names_list, &unchanged);
+        if (!edited) { goto fail; }
+
+        // nothing to do
+        if (unchanged) { goto done; }
+    }
+
+    // check that there are same number of lines
+    stats_phase(STATS_VALIDATE_OUTPUT);
+    if (initial_names_list.count != new_names_list.count) {
+        fprintf(stderr,
+                "Error: Mismatched number of lines. New filename list contains "
+                "%zu entries while original list contains %zu.\n",
+                new_names_list.count, initial_names_list.count);
+        goto fail;
+    }
+
+    // further validation, in a single pass with one hash per name, which
+    // reports every conflict before failing
+    name_index_init(&new_index, new_names_list.data, new_names_list.count);
+    size_t name_slots = new_names_list.count > 0 ? new_names_list.count : 1;
+    size_t *probed = malloc(name_slots * sizeof(size_t));
+    if (!probed) {
+        perror("malloc");
+        goto fail;
+    }
+    size_t probe_count = 0;
+    bool valid = true;
+    for (size_t i = 0; i < new_names_list.count; i++) {
+        char *new_filename = new_names_list.data[i];
+        uint64_t hash = name_hash(new_filename);
+
+        // check that output filenames are unique
+        if (name_index_insert(&new_index, i, hash) != INDEX_NONE) {
+            fprintf(stderr, "Error: Output filenames are not unique ('%s').\n",
+                    new_filename);
+            valid = false;
+            continue;
+        }
+
+        // skip files to be deleted, and paths that are resolved first
+        if (new_filename[0] == arguments.delete_char) { continue; }
+        if (arguments.recursive) { continue; }
+
+        // filenames not in the input list must not exist yet
+        if (!arguments.force &&
+            name_index_find(&initial_index, new_filename, hash) == INDEX_NONE) {
+            probed[probe_count++] = i;
+        }
+    }
+
+    // existing files are looked up all at once
+    mode_t *types = malloc((probe_count > 0 ? probe_count : 1) *
+                           sizeof(mode_t));
+    if (!types) {
+        perror("malloc");
+        free(probed);
+        goto fail;
+    }
+    names_probe(dir_fd, new_names_list.data, probed, probe_count,
+                probe_thread_count(&arguments), types, NULL);
+    for (size_t k = 0; k < probe_count; k++) {
+        if (types[k] != 0) {
+            fprintf(stderr, "Error: File '%s' already exists.\n",
+                    new_names_list.data[probed[k]]);
+            valid = false;
+        }
+    }
+    free(types);
+    free(probed);
+
+    // collisions the target filesystem would make out of distinct names
+    if (valid && arguments.fold != FOLD_NONE) {
+        RenameTable folded = {.initial_names = initial_names_list.data,
+                              .new_names = new_names_list.data,
+                              .count = initial_names_list.count};
+        valid = fold_check(&folded, &initial_index, &arguments, dir_fd);
+    }
+    if (!valid) { goto fail; }
+
+    stats_phase(STATS_PLAN);
+    table.initial_names = initial_names_list.data;
+    table.new_names = new_names_list.data;
+    table.temp_names = calloc(name_slots, sizeof(char *));
+    if (!table.temp_names) {
+        perror("calloc");
+        goto fail;
+    }
+    table.ids = ids;
+    table.count = initial_names_list.count;
+
+    // nested entries are planned level by level
+    if (arguments.recursive) {
+        table.depths = malloc((table.count > 0 ? table.count : 1) *
+                              sizeof(uint32_t));
+        if (!table.depths) {
+            perror("malloc");
+            goto fail;
+        }
+        for (size_t i = 0; i < table.count; i++) {
+            table.depths[i] = path_depth(table.initial_names[i]);
+        }
+        plan_emptied_mark(&table, &initial_index, arguments.delete_char);
+        bool resolved = plan_resolve_paths(&table, &initial_index, &new_index,
+                                           &arguments, dir_fd, &arena);
+        if (!resolved) { goto fail; }
     }
 
-    // rename temp files to new filenames
-    for (int i = 0; i < rename_path_list.count; i++) {
-        RenamePath *rp = rename_path_list.data[i];
-        bool success = file_rename(rp->temp_name, rp->new_name);
-        if (!success) { goto fail; }
-        if (!arguments.silent) {
-            rename_message_print(rp->initial_name, rp->new_name);
+    bool planned =
+        plan_build(&plan, &initial_index, &arguments, &staging, &arena);
+    if (!planned) { goto fail; }
+
+    if (arguments.dry_run) {
+        plan_print(&plan, &arguments);
+    } else {
+        stats_phase(STATS_RENAME);
+
+        // the plan is on disk before its first operation runs
+        if (plan.count > 0 &&
+            !journal_begin(&journal, &plan, &staging, &arguments)) {
+            goto fail;
+        }
+
+        ExecContext ctx = {.dir_fd = dir_fd,
+                           .staging = &staging,
+                           .trash = &trash,
+                           .journal = &journal,
+                           .reaper = &reaper,
+                           .arguments = &arguments};
+
+        // count what will be reported, moving files aside is not
+        size_t reported = 0;
+        for (size_t i = 0; i < plan.count; i++) {
+            reported += plan.kinds[i] != OP_RENAME ||
+                        plan.steps[i] != STEP_TO_TEMP;
+        }
+        output_start(reported);
+
+        // run phases in order, deletions and trashing come first and
+        // complete before any file takes the name of a removed one
+        for (size_t p = 0; p < plan.phase_count; p++) {
+            size_t begin = p > 0 ? plan.phase_ends[p - 1] : 0;
+            if (!plan_execute(&plan, begin, plan.phase_ends[p], &ctx)) {
+                goto fail;
+            }
+            journal_mark(&journal, plan.phase_ends[p], true);
+        }
+
+        // a completed run can be reverted (the run itself succeeded even if
+        // it cannot, or has no state directory to record it in), reverting
+        // one consumes its record
+        if (arguments.undo) {
+            undo_record_remove(undo_path, &initial_names_list, undo_trashed);
+        } else if (plan.count > 0 && journal.path[0] != '\0') {
+            undo_record_write(&table, &initial_index, &trash, &arguments,
+                              dir_fd, &arena);
         }
     }
 
+done:
+    // deleted files are unlinked before the journal goes, unless left to a
+    // background process. The run is complete either way, so files that
+    // cannot be unlinked are reported (by the reaper, after the report lines
+    // before them) without keeping the journal for recovery.
+    output_flush();
+    stats_phase(STATS_REAP);
+    bool reaped = arguments.detach ? reaper_detach(&reaper, &staging)
+                                   : reaper_finish(&reaper);
+    output_finish(arguments.silent);
+    journal_end(&journal, true);
+    stats_report();
+
     // cleanup
     FilenameList_free(&initial_names_list);
-    FilenameList_free(&new_names_list);
-    FilenameList_free(&trash_list);
-    RenamePathList_free(&rename_path_list);
-    free(new_sorted_names_list.data);
+    FileIdList_free(&initial_ids);
+    FilenameList_free(&walk_roots);
+    FilenameList_free(&transformed_names);
+    transform_free(&transform);
+    free(new_names_list.data); // names are owned by edit_buffer
+    free(edit_buffer);
+    trash_close(&trash);
+    plan_free(&plan);
+    free(table.temp_names);
+    free(table.depths);
+    free(table.emptied);
+    arena_free(&arena);
+    name_index_free(&initial_index);
+    name_index_free(&new_index);
+    reaper_free(&reaper);
 
-    fclose(tmp_edit_file);
     remove(tmp_file_path);
+    staging_remove(&staging);
+    close(dir_fd);
 
-    return EXIT_SUCCESS;
+    return reaped ? EXIT_SUCCESS : EXIT_FAILURE;
 
 fail:
+    reaper_cancel(&reaper);
+    output_finish(arguments.silent);
+    journal_end(&journal, false);
+    stats_report();
     FilenameList_free(&initial_names_list);
-    FilenameList_free(&new_names_list);
-    FilenameList_free(&trash_list);
-    RenamePathList_free(&rename_path_list);
-    if (new_sorted_names_list.data) { free(new_sorted_names_list.data); }
+    FileIdList_free(&initial_ids);
+    FilenameList_free(&walk_roots);
+    FilenameList_free(&transformed_names);
+    transform_free(&transform);
+    free(new_names_list.data); // names are owned by edit_buffer
+    free(edit_buffer);
+    trash_close(&trash);
+    plan_free(&plan);
+    free(table.temp_names);
+    free(table.depths);
+    free(table.emptied);
+    arena_free(&arena);
+    name_index_free(&initial_index);
+    name_index_free(&new_index);
+    reaper_free(&reaper);
 
-    if (cur_dir) { closedir(cur_dir); }
-    if (tmp_edit_file) { fclose(tmp_edit_file); }
-    if (file_exists(tmp_file_path)) { remove(tmp_file_path); }
+    staging_remove(&staging);
+
+    if (dir_fd >= 0) { close(dir_fd); }
+    if (tmp_file_path[0]) { remove(tmp_file_path); }
 
     return EXIT_FAILURE;
 }
+
+int main(int argc, char *argv[]) { return cbr_main(argc, argv); }
@@ -0,0 +1,215 @@
+#!/bin/sh
+# Runs cbr on small directories and checks the trees it leaves, see usage
+# below.
+set -u
+
+usage() {
+    cat >&2 <<EOF
+usage: tests/check.sh [CASE]...
+
+Runs each CASE (by default all of them) in a fresh temporary directory, with
+the journal and trash kept below it, and reports the cases whose resulting
+tree differs from the expected one. CBR selects the binary (default: the cbr
+next to this directory).
+
+cases: $all
+EOF
+    exit 1
+}
+
+TESTS_DIR=$(dirname "$0")
+CBR=${CBR:-$TESTS_DIR/../cbr}
+case $CBR in /*) ;; *) CBR=$(pwd)/$CBR ;; esac
+
+all="cycle swap chain delete trash recursive resume rollback undo fold"
+cases=${*:-$all}
+for name in $cases; do
+    case " $all " in
+    *" $name "*) ;;
+    *) usage ;;
+    esac
+done
+
+root=$(mktemp -d "${TMPDIR:-/tmp}/cbr-check.XXXXXX")
+trap 'rm -rf "$root"' EXIT INT TERM
+export XDG_STATE_HOME="$root/state" XDG_DATA_HOME="$root/data"
+
+# starts a case in an empty $root/d holding the files given as arguments,
+# each containing its own name (those ending in / are directories)
+files() {
+    rm -rf "$root/d" "$root/state" "$root/data"
+    mkdir -p "$root/d"
+    for file in "$@"; do
+        case $file in
+        */) mkdir -p "$root/d/$file" ;;
+        *)
+            mkdir -p "$(dirname "$root/d/$file")"
+            echo "$file" >"$root/d/$file"
+            ;;
+        esac
+    done
+}
+
+# writes the mapping given as OLD NEW argument pairs to $root/map
+mapping() {
+    : >"$root/map"
+    while [ $# -ge 2 ]; do
+        printf '%s\t%s\n' "$1" "$2" >>"$root/map"
+        shift 2
+    done
+}
+
+# runs cbr on $root/d with the arguments given, and checks its exit status
+# against $status (0 unless set by the case)
+cbr() {
+    "$CBR" -s -C "$root/d" "$@" >"$root/out" 2>&1
+    result=$?
+    if [ "$result" -ne "${status:-0}" ]; then
+        echo "  cbr $* exited with $result, expected ${status:-0}:"
+        sed 's/^/    /' "$root/out"
+        failed=yes
+    fi
+    status=0
+}
+
+# checks that the tree of $root/d (NAME=CONTENT for files, NAME/ for
+# directories) is the one given as arguments
+tree() {
+    expected=$(for entry in "$@"; do echo "$entry"; done | sort)
+    actual=$(cd "$root/d" && find . -mindepth 1 | sed 's|^\./||' | sort |
+        while read -r entry; do
+            if [ -d "$entry" ]; then
+                echo "$entry/"
+            else
+                echo "$entry=$(cat "$entry")"
+            fi
+        done)
+    if [ "$actual" != "$expected" ]; then
+        echo "  expected tree:" $expected
+        echo "  actual tree:  " $actual
+        failed=yes
+    fi
+}
+
+# checks that no interrupted run is left in $root/d
+no_journal() {
+    if ls "$root/state/cbr" 2>/dev/null | grep -q '\.journal$'; then
+        echo "  a journal was left behind"
+        failed=yes
+    fi
+}
+
+case_cycle() {
+    files a b c d
+    mapping a b b c c a d e
+    cbr --from "$root/map"
+    tree b=a c=b a=c e=d
+    no_journal
+}
+
+case_swap() {
+    files a b x y
+    mapping a b b a x y y x
+    cbr --from "$root/map"
+    tree a=b b=a x=y y=x
+}
+
+case_chain() {
+    files a b c
+    mapping a b b c c d
+    cbr --from "$root/map"
+    tree b=a c=b d=c
+}
+
+case_delete() {
+    files a b c
+    mapping a '#a' b a c c
+    cbr --from "$root/map"
+    tree a=b c=c
+}
+
+case_trash() {
+    files a b
+    mapping a '#a' b b
+    cbr -t --from "$root/map"
+    tree b=b
+    if [ "$(cat "$root/data/Trash/files/a" 2>/dev/null)" != a ] ||
+        [ ! -f "$root/data/Trash/info/a.trashinfo" ]; then
+        echo "  'a' is not in the trash"
+        failed=yes
+    fi
+}
+
+# directories are renamed after their contents, which may be named by either
+# the old or the new name of their directory
+case_recursive() {
+    files d/x d/y e/z top
+    mapping d n d/x n/w e/z z e "#e" top e
+    cbr -r --from "$root/map"
+    tree n/ n/w=d/x n/y=d/y e=top z=e/z
+    no_journal
+}
+
+# a run stops at a rename onto a directory (allowed by -f), after the journal
+# is written but before the cycle runs
+stopped_run() {
+    files a b c x sub/
+    mapping a b b c c a x sub
+    status=1 cbr -f --from "$root/map"
+    tree a=a b=b c=c x=x sub/
+    rmdir "$root/d/sub"
+}
+
+case_resume() {
+    stopped_run
+    status=1 cbr --from "$root/map" # refused until the run is finished
+    cbr --resume
+    tree b=a c=b a=c sub=x
+    no_journal
+}
+
+case_rollback() {
+    stopped_run
+    cbr --rollback
+    tree a=a b=b c=c x=x
+    no_journal
+}
+
+case_undo() {
+    files a b c
+    mapping a b b a c '#c'
+    cbr -t --from "$root/map"
+    tree a=b b=a
+    cbr --undo
+    tree a=a b=b c=c
+    status=1 cbr --undo # nothing left to undo
+}
+
+case_fold() {
+    files Foo bar baz
+    mapping bar foo
+    status=1 cbr --fold=ascii --from "$root/map" # collides with Foo
+    mapping bar X baz x
+    status=1 cbr --fold=ascii --from "$root/map" # collide with each other
+    tree Foo=Foo bar=bar baz=baz
+    mapping bar "$(printf 'e\314\201')" baz "$(printf '\303\251')"
+    status=1 cbr --fold=nfc --from "$root/map"
+    mapping bar foo.txt
+    cbr --fold=ascii --from "$root/map"
+    tree Foo=Foo foo.txt=bar baz=baz
+}
+
+failures=0
+for name in $cases; do
+    failed=no
+    status=0
+    echo "$name"
+    "case_$name"
+    if [ "$failed" = yes ]; then
+        echo "FAILED: $name"
+        failures=$((failures + 1))
+    fi
+done
+count=$(echo $cases | wc -w)
+echo "$((count - failures)) of $count cases passed"
+[ "$failures" -eq 0 ]